@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "adapt.h"
+#include "timer.h"
+
+/* the buffers are charged from all the workers (see server.h) */
+static size_t budget = 0;
+static atomic_size_t used = 0;
+static atomic_size_t peak = 0;
+
+void adapt_set_budget(size_t sz) {
+	budget = sz;
+}
+
+static
+void update_peak(size_t now_used) {
+	size_t p = atomic_load(&peak);
+	while (now_used > p && !atomic_compare_exchange_weak(&peak, &p, now_used))
+		;
+}
+
+void adapt_charge(size_t sz) {
+	update_peak(atomic_fetch_add(&used, sz) + sz);
+}
+
+void adapt_uncharge(size_t sz) {
+	atomic_fetch_sub(&used, sz);
+}
+
+/*
+ * Charge sz bytes only if they fit in the budget.
+ * */
+static
+bool try_charge(size_t sz) {
+	size_t u = atomic_load(&used);
+	do {
+		if (budget && u + sz > budget)
+			return false;
+	} while (!atomic_compare_exchange_weak(&used, &u, u + sz));
+
+	update_peak(u + sz);
+	return true;
+}
+
+void adapt_init(struct adapt *ad, const char *from, const char *to,
+		const char *color_escape, size_t min, size_t max, long long now) {
+	memset(ad, 0, sizeof(*ad));
+	ad->from = from;
+	ad->to = to;
+	ad->color_escape = color_escape;
+	ad->min = min;
+	ad->max = max;
+	ad->window_start = now;
+	ad->largest = min;
+}
+
+static
+void adapt_print(struct adapt *ad, double elapsed, const char *what,
+		size_t sz) {
+	flockfile(stdout);
+	if (ad->color_escape)
+		printf("%s", ad->color_escape);
+
+	printf("[%10.3f] %s -> %s buffer %s to %zu bytes\n", elapsed,
+			ad->from, ad->to, what, sz);
+
+	if (ad->color_escape)
+		printf("%s", "\x1b[0m"); /* reset */
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+static
+void grow(struct adapt *ad, struct circular_buffer_t *b, double elapsed) {
+	size_t sz = b->sz * 2 < ad->max? b->sz * 2 : ad->max;
+	size_t delta = sz - b->sz;
+
+	if (!try_charge(delta)) {
+		ad->refused += 1;
+		return;
+	}
+
+	if (circular_buffer_resize(b, sz) != 0) {
+		adapt_uncharge(delta);
+		ad->refused += 1;
+		return;
+	}
+
+	ad->grown += 1;
+	if (sz > ad->largest)
+		ad->largest = sz;
+
+	adapt_print(ad, elapsed, "grown", sz);
+}
+
+static
+void shrink(struct adapt *ad, struct circular_buffer_t *b, double elapsed) {
+	size_t sz = b->sz / 2 > ad->min? b->sz / 2 : ad->min;
+	size_t delta = b->sz - sz;
+
+	if (circular_buffer_resize(b, sz) != 0)
+		return;
+
+	adapt_uncharge(delta);
+	ad->shrunk += 1;
+
+	adapt_print(ad, elapsed, "shrunk", sz);
+}
+
+void adapt_update(struct adapt *ad, struct circular_buffer_t *b,
+		bool read, bool filled, size_t held, long long now,
+		double elapsed) {
+	if (held > ad->window_peak)
+		ad->window_peak = held;
+
+	/* the rounds that only write do not break the fills in a row */
+	if (read)
+		ad->fills = filled? ad->fills + 1 : 0;
+
+	if (ad->fills >= ADAPT_GROW_FILLS && b->sz < ad->max) {
+		grow(ad, b, elapsed);
+
+		/* give the new size a whole period before shrinking it */
+		ad->fills = 0;
+		ad->window_start = now;
+		ad->window_peak = held;
+		return;
+	}
+
+	if (now - ad->window_start < ADAPT_SHRINK_PERIOD_US)
+		return;
+
+	/* the peak includes the bytes held now so they fit after halving;
+	 * the fills in a row counted so far were of the larger size */
+	if (b->sz > ad->min && ad->window_peak <= b->sz / 4) {
+		shrink(ad, b, elapsed);
+		ad->fills = 0;
+	}
+
+	ad->window_start = now;
+	ad->window_peak = held;
+}
+
+long long adapt_deadline(struct adapt *ad, size_t sz) {
+	if (sz <= ad->min)
+		return TIMER_NEVER;
+
+	return ad->window_start + ADAPT_SHRINK_PERIOD_US;
+}
+
+void adapt_summary_print(struct adapt *ad) {
+	printf("%s -> %s buffer: grown %llu times, shrunk %llu times, "
+			"%llu growths refused, largest %zu bytes\n",
+			ad->from, ad->to, ad->grown, ad->shrunk, ad->refused,
+			ad->largest);
+}
+
+void adapt_budget_print() {
+	if (budget)
+		printf("Buffers: peak of %zu bytes, budget of %zu bytes\n",
+				atomic_load(&peak), budget);
+	else
+		printf("Buffers: peak of %zu bytes, no budget\n",
+				atomic_load(&peak));
+}
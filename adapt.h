@@ -0,0 +1,96 @@
+#ifndef ADAPT_H_
+#define ADAPT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "circular_buffer.h"
+
+/* struct adapt: sizes the buffer of a direction (from -> to) after
+ * its traffic.
+ *
+ * The buffer starts with its minimum size and it is doubled, up to its
+ * maximum, when the producer fills it ADAPT_GROW_FILLS times in a row
+ * while the consumer is ready to take more: the buffer and not the
+ * consumer is what slows down the producer.
+ *
+ * When the buffer holds no more than a quarter of its size during
+ * ADAPT_SHRINK_PERIOD_US it is halved, down to its minimum.
+ *
+ * All the buffers share a memory budget (see adapt_set_budget): a
+ * buffer does not grow if that would exceed it.
+ *
+ * Each resize is printed as a timestamped event; how many and the
+ * largest size reached are kept for the summary (see adapt_summary_print).
+ * */
+struct adapt {
+	const char *from;
+	const char *to;
+	const char *color_escape;
+
+	size_t min;
+	size_t max;
+
+	unsigned int fills;
+	long long window_start;
+	size_t window_peak;
+
+	unsigned long long grown;
+	unsigned long long shrunk;
+	unsigned long long refused;
+	size_t largest;
+};
+
+#define ADAPT_GROW_FILLS 3
+#define ADAPT_SHRINK_PERIOD_US 2000000LL
+
+/*
+ * Set the memory budget in bytes of all the buffers together; 0 means
+ * no limit. It must be set before any buffer is allocated.
+ * */
+void adapt_set_budget(size_t budget);
+
+/*
+ * Account the sz bytes of a buffer allocated or freed outside of
+ * adapt_update. The buffers are always allocated, even beyond the
+ * budget: it limits how much they grow only.
+ * */
+void adapt_charge(size_t sz);
+void adapt_uncharge(size_t sz);
+
+/*
+ * Initialize the sizing of a buffer of min bytes (already allocated and
+ * charged) that can grow up to max bytes. The times are in microseconds.
+ * */
+void adapt_init(struct adapt *ad, const char *from, const char *to,
+		const char *color_escape, size_t min, size_t max, long long now);
+
+/*
+ * Update the sizing with the last round of the relay at time now:
+ * read is true if the producer was read, filled if that read filled
+ * the buffer while the consumer was ready and held is how many bytes
+ * the buffer held after the read.
+ *
+ * The buffer b is resized if needed; if the new buffer cannot be
+ * allocated the old one is kept.
+ *
+ * Elapsed is the time elapsed (in seconds) used to prefix the events.
+ * */
+void adapt_update(struct adapt *ad, struct circular_buffer_t *b,
+		bool read, bool filled, size_t held, long long now,
+		double elapsed);
+
+/*
+ * Return when the buffer of sz bytes may be shrunk if it keeps
+ * holding few bytes or TIMER_NEVER if it cannot shrink.
+ * */
+long long adapt_deadline(struct adapt *ad, size_t sz);
+
+void adapt_summary_print(struct adapt *ad);
+
+/*
+ * Print the peak of memory used by all the buffers and the budget.
+ * */
+void adapt_budget_print();
+
+#endif
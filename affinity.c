@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "affinity.h"
+
+int affinity_pin(int cpu) {
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	/* pid 0 is the calling thread, not the whole process */
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int affinity_allowed(int cpu) {
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE)
+		return 0;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return 0;
+
+	return CPU_ISSET(cpu, &set)? 1 : 0;
+}
+
+int affinity_cpu(const int cpus[], int ncpus, int n) {
+	return cpus[n % ncpus];
+}
+
+void affinity_touch(char *buf, size_t sz) {
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < sz; i += page)
+		buf[i] = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <stddef.h>
+
+/*
+ * Maximum number of CPUs in the list of -a.
+ * */
+#define AFFINITY_MAX_CPUS 64
+
+/*
+ * Pin the calling thread to the CPU cpu (see sched_setaffinity(2)).
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int affinity_pin(int cpu);
+
+/*
+ * Return 1 if the calling thread can be pinned to the CPU cpu: it is
+ * online and in its current affinity mask (see sched_getaffinity(2)),
+ * 0 otherwise.
+ * */
+int affinity_allowed(int cpu);
+
+/*
+ * The CPU of the n-th thread (from 0) pinned to the list of cpus,
+ * taken in turn.
+ * */
+int affinity_cpu(const int cpus[], int ncpus, int n);
+
+/*
+ * Touch every page of buf so the memory is committed now by the
+ * calling thread.
+ *
+ * Linux allocates a page in the NUMA node of the thread that touches
+ * it first (see numa(7)) so a pinned thread that touches its buffers
+ * before using them gets them in its local node instead of wherever
+ * the first read(2) happens to run.
+ * */
+void affinity_touch(char *buf, size_t sz);
+
+#endif
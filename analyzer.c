@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "analyzer.h"
+#include "timer.h"
+
+#define DEFAULT_MSS 536 /* the minimum MSS for IPv4, RFC 1122 */
+#define BAR_WIDTH 40
+
+void analyzer_init(struct analyzer *an, const char *from, const char *to,
+		size_t mss, struct analyzer *reverse) {
+	memset(an, 0, sizeof(*an));
+	an->from = from;
+	an->to = to;
+	an->mss = mss;
+	an->reverse = reverse;
+	an->last_read = TIMER_NEVER;
+}
+
+size_t analyzer_get_mss(int fd) {
+	int mss = 0;
+	socklen_t len = sizeof(mss);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) == -1 || mss <= 0)
+		return DEFAULT_MSS;
+
+	return (size_t)mss;
+}
+
+/*
+ * Index of the power of two bucket of v: floor(log2(v)) limited
+ * to nbuckets - 1; 0 and 1 go to the bucket 0.
+ * */
+static
+unsigned int bucket_of(unsigned long long v, unsigned int nbuckets) {
+	unsigned int k = 0;
+	while (v > 1 && k < nbuckets - 1) {
+		v >>= 1;
+		++k;
+	}
+
+	return k;
+}
+
+void analyzer_record(struct analyzer *an, size_t sz, long long now) {
+	bool small = sz < an->mss;
+
+	an->reads += 1;
+	an->sizes[bucket_of(sz, ANALYZER_SIZE_BUCKETS)] += 1;
+	if (small)
+		an->small_reads += 1;
+
+	if (an->last_read != TIMER_NEVER) {
+		long long gap = now - an->last_read;
+		an->gaps[bucket_of(gap, ANALYZER_GAP_BUCKETS)] += 1;
+
+		/* was the other direction quiet since our last read? */
+		long long other = an->reverse? an->reverse->last_read : TIMER_NEVER;
+		bool quiet = (other == TIMER_NEVER || other < an->last_read);
+
+		if (small && an->last_small && quiet
+				&& gap >= ANALYZER_DELACK_MIN_US
+				&& gap <= ANALYZER_DELACK_MAX_US) {
+			an->delack_suspects += 1;
+			an->delack_total += gap;
+		}
+
+		if (small && gap < ANALYZER_BURST_GAP_US) {
+			an->run += 1;
+			if (an->run == ANALYZER_BURST_LEN)
+				an->bursts += 1;
+		}
+		else {
+			an->run = small? 1 : 0;
+		}
+	}
+	else {
+		an->run = small? 1 : 0;
+	}
+
+	an->last_read = now;
+	an->last_small = small;
+
+	/* track when the data was read until it is sent */
+	an->produced += sz;
+	if (an->inflight_len == ANALYZER_INFLIGHT) {
+		unsigned int last = (an->inflight_head + an->inflight_len - 1)
+			% ANALYZER_INFLIGHT;
+		an->inflight[last].end = an->produced;
+		return;
+	}
+
+	unsigned int tail = (an->inflight_head + an->inflight_len)
+		% ANALYZER_INFLIGHT;
+	an->inflight[tail].end = an->produced;
+	an->inflight[tail].at = now;
+	an->inflight_len += 1;
+}
+
+void analyzer_record_sent(struct analyzer *an, size_t sz, long long now) {
+	an->sent += sz;
+	an->sends += 1;
+
+	while (an->inflight_len
+			&& an->inflight[an->inflight_head].end <= an->sent) {
+		long long latency = now - an->inflight[an->inflight_head].at;
+
+		an->latencies[bucket_of(latency, ANALYZER_GAP_BUCKETS)] += 1;
+		an->latency_count += 1;
+		an->latency_total += latency;
+		if (latency > an->latency_max)
+			an->latency_max = latency;
+
+		an->inflight_head = (an->inflight_head + 1) % ANALYZER_INFLIGHT;
+		an->inflight_len -= 1;
+	}
+}
+
+static
+void print_bar(unsigned long long count, unsigned long long max) {
+	int n = max? (int)((count * BAR_WIDTH + max - 1) / max) : 0;
+	for (int i = 0; i < n; ++i)
+		printf("#");
+	printf("\n");
+}
+
+static
+unsigned long long max_of(unsigned long long *hist, unsigned int n) {
+	unsigned long long max = 0;
+	for (unsigned int i = 0; i < n; ++i)
+		if (hist[i] > max)
+			max = hist[i];
+
+	return max;
+}
+
+/*
+ * Print a duration given in microseconds with a suitable unit.
+ * */
+static
+void print_duration(char *str, size_t len, unsigned long long us) {
+	if (us < 1000)
+		snprintf(str, len, "%llu us", us);
+	else if (us < 1000000)
+		snprintf(str, len, "%llu ms", us / 1000);
+	else
+		snprintf(str, len, "%llu s", us / 1000000);
+}
+
+/*
+ * Print the histogram of durations in power of two buckets of
+ * microseconds.
+ * */
+static
+void print_durations(unsigned long long *hist) {
+	unsigned long long max = max_of(hist, ANALYZER_GAP_BUCKETS);
+	for (unsigned int k = 0; k < ANALYZER_GAP_BUCKETS; ++k) {
+		char dur[16];
+		if (!hist[k])
+			continue;
+
+		if (k == ANALYZER_GAP_BUCKETS - 1) {
+			print_duration(dur, sizeof(dur), 1ULL << k);
+			printf("  >= %-12s %10llu ", dur, hist[k]);
+		}
+		else {
+			print_duration(dur, sizeof(dur), 1ULL << (k+1));
+			printf("  <  %-12s %10llu ", dur, hist[k]);
+		}
+		print_bar(hist[k], max);
+	}
+}
+
+void analyzer_summary_print(struct analyzer *an) {
+	flockfile(stdout);
+	printf("%s -> %s reads: %llu, smaller than the MSS (%zu bytes): %llu\n",
+			an->from, an->to, an->reads, an->mss, an->small_reads);
+
+	printf("%s -> %s read sizes:\n", an->from, an->to);
+	unsigned long long max = max_of(an->sizes, ANALYZER_SIZE_BUCKETS);
+	for (unsigned int k = 0; k < ANALYZER_SIZE_BUCKETS; ++k) {
+		if (!an->sizes[k])
+			continue;
+
+		if (k == ANALYZER_SIZE_BUCKETS - 1)
+			printf("  >= %-6llu bytes %10llu ", 1ULL << k, an->sizes[k]);
+		else
+			printf("  <  %-6llu bytes %10llu ", 1ULL << (k+1), an->sizes[k]);
+		print_bar(an->sizes[k], max);
+	}
+
+	printf("%s -> %s gaps between reads:\n", an->from, an->to);
+	print_durations(an->gaps);
+
+	if (an->latency_count) {
+		printf("%s -> %s relay latency (read to sent): %.1f us on average, "
+				"%lli us at most\n", an->from, an->to,
+				(double)an->latency_total / an->latency_count,
+				an->latency_max);
+		print_durations(an->latencies);
+	}
+
+	if (an->delack_suspects) {
+		printf("%s -> %s warning: %llu small writes delayed %.3f ms on average "
+				"waiting for an ACK (write-write-read with Nagle and "
+				"delayed ACK?), consider TCP_NODELAY in %s\n",
+				an->from, an->to, an->delack_suspects,
+				an->delack_total / 1000.0 / an->delack_suspects,
+				an->from);
+	}
+
+	if (an->bursts) {
+		printf("%s -> %s warning: %llu bursts of %i or more tiny writes "
+				"(consider buffering the writes in %s)\n",
+				an->from, an->to, an->bursts, ANALYZER_BURST_LEN,
+				an->from);
+	}
+	funlockfile(stdout);
+}
+
+void analyzer_syscalls_print(struct analyzer *an, const char *backend,
+		unsigned long long syscalls) {
+	unsigned long long sent = an->sent + an->reverse->sent;
+
+	printf("Relay with %s: %llu system calls for %llu bytes sent, "
+			"%.1f bytes per system call\n", backend, syscalls, sent,
+			syscalls? (double)sent / syscalls : 0.0);
+}
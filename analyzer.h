@@ -0,0 +1,132 @@
+#ifndef ANALYZER_H_
+#define ANALYZER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ANALYZER_SIZE_BUCKETS 17
+#define ANALYZER_GAP_BUCKETS 25
+
+/*
+ * Gaps between two small reads in the same direction that are
+ * typical of a delayed ACK (Linux waits 40 ms at least, 200 ms at
+ * most; other systems up to 500 ms).
+ * */
+#define ANALYZER_DELACK_MIN_US (30 * 1000LL)
+#define ANALYZER_DELACK_MAX_US (500 * 1000LL)
+
+/*
+ * A run of this many consecutive small reads, each one arriving
+ * less than ANALYZER_BURST_GAP_US after the previous, is a burst of
+ * tiny writes.
+ * */
+#define ANALYZER_BURST_LEN 8
+#define ANALYZER_BURST_GAP_US 1000LL
+
+/*
+ * How many reads are tracked until their data is sent; beyond it
+ * the newest ones are merged so their latency is overestimated.
+ * */
+#define ANALYZER_INFLIGHT 64
+
+/* struct analyzer: small-write / Nagle pathology analyzer of one
+ * direction (from -> to).
+ *
+ * It keeps a histogram of the sizes of the chunks read from the
+ * producer and a histogram of the gaps (inter-arrival times) between
+ * them, both in power of two buckets.
+ *
+ * A read smaller than the MSS of the producer's socket is a small read.
+ * The analyzer flags two patterns:
+ *
+ *  - write-write-read: two small reads in the same direction separated
+ *    by a gap of a delayed ACK (~40 ms) with nothing in the other
+ *    direction in the middle. This is the signature of the Nagle's
+ *    algorithm waiting for an ACK that the peer delays.
+ *  - tiny writes: bursts of ANALYZER_BURST_LEN or more small reads in
+ *    a row, each one arriving just after the previous.
+ *
+ * It keeps a histogram of the relay latency too: the time since a
+ * chunk is read from the producer until its last byte is sent to the
+ * consumer, the time that the data spends in tiburoncin.
+ *
+ * Each analyzer has a reference to the analyzer of the other direction
+ * (reverse) to know when the last data in that direction was seen.
+ * */
+struct analyzer {
+	const char *from;
+	const char *to;
+	struct analyzer *reverse;
+
+	size_t mss;
+
+	unsigned long long sizes[ANALYZER_SIZE_BUCKETS];
+	unsigned long long gaps[ANALYZER_GAP_BUCKETS];
+	unsigned long long reads;
+	unsigned long long small_reads;
+
+	long long last_read;
+	bool last_small;
+	unsigned int run;
+
+	unsigned long long delack_suspects;
+	long long delack_total;
+	unsigned long long bursts;
+
+	/* the reads not sent yet: the offset of their end and when
+	 * they were read, oldest first (a circular queue) */
+	struct {
+		unsigned long long end;
+		long long at;
+	} inflight[ANALYZER_INFLIGHT];
+	unsigned int inflight_head;
+	unsigned int inflight_len;
+	unsigned long long produced;
+	unsigned long long sent;
+	unsigned long long sends;
+
+	unsigned long long latencies[ANALYZER_GAP_BUCKETS];
+	unsigned long long latency_count;
+	long long latency_total;
+	long long latency_max;
+};
+
+/*
+ * Initialize the analyzers of both directions of a channel.
+ * mss is the MSS of the producer's socket of each direction.
+ * */
+void analyzer_init(struct analyzer *an, const char *from, const char *to,
+		size_t mss, struct analyzer *reverse);
+
+/*
+ * Record a read of sz bytes at time now (in microseconds).
+ * */
+void analyzer_record(struct analyzer *an, size_t sz, long long now);
+
+/*
+ * Record that sz bytes were sent to the consumer at time now (in
+ * microseconds): the reads whose data is all sent count for the
+ * relay latency.
+ * */
+void analyzer_record_sent(struct analyzer *an, size_t sz, long long now);
+
+/*
+ * Print the histograms and the detected patterns.
+ * */
+void analyzer_summary_print(struct analyzer *an);
+
+/*
+ * Print how many system calls the event backend took to relay the
+ * bytes sent in both directions (an and its reverse) so the
+ * backends (see -E) can be compared.
+ * */
+void analyzer_syscalls_print(struct analyzer *an, const char *backend,
+		unsigned long long syscalls);
+
+/*
+ * Return the MSS of the socket fd or a sensible default
+ * if it cannot be retrieved.
+ * */
+size_t analyzer_get_mss(int fd);
+
+#endif
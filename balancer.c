@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "balancer.h"
+
+void balancer_init(struct balancer *bl, enum balance_policy policy,
+		struct endpoint backends[], int n) {
+	memset(bl, 0, sizeof(*bl));
+	bl->policy = policy;
+	bl->n = n;
+
+	for (int i = 0; i < n; ++i)
+		bl->backends[i].B = &backends[i];
+}
+
+static
+bool is_ejected(struct backend *be, long long now) {
+	return be->retry_at && be->retry_at > now;
+}
+
+/*
+ * Return true if the backend a is a better choice than b for
+ * the policy of the balancer.
+ * */
+static
+bool is_better(struct balancer *bl, struct backend *a, struct backend *b) {
+	switch (bl->policy) {
+		case BALANCE_LEAST_CONNS:
+			return a->conns < b->conns;
+		case BALANCE_LEAST_BYTES:
+			return a->outstanding < b->outstanding;
+		default:
+			return false;
+	}
+}
+
+int balancer_pick(struct balancer *bl, long long now) {
+	int best = -1;
+	int first = -1;
+
+	/* from the next in turn so the ties are broken in turn */
+	for (int k = 0; k < bl->n; ++k) {
+		int i = (bl->next + k) % bl->n;
+		struct backend *be = &bl->backends[i];
+
+		if (first == -1 || be->retry_at < bl->backends[first].retry_at)
+			first = i;
+
+		if (is_ejected(be, now))
+			continue;
+
+		if (best == -1 || is_better(bl, be, &bl->backends[best]))
+			best = i;
+	}
+
+	/* all are ejected: take the one that is retried first */
+	if (best == -1)
+		best = first;
+
+	bl->next = (best + 1) % bl->n;
+	bl->backends[best].conns += 1;
+	bl->backends[best].picked += 1;
+	return best;
+}
+
+bool balancer_available(struct balancer *bl, long long now) {
+	for (int i = 0; i < bl->n; ++i) {
+		if (!is_ejected(&bl->backends[i], now))
+			return true;
+	}
+
+	return false;
+}
+
+void balancer_connected(struct balancer *bl, int i) {
+	struct backend *be = &bl->backends[i];
+	if (!be->retry_at)
+		return;
+
+	be->retry_at = 0;
+	be->backoff = 0;
+	fprintf(stderr, "Backend %s:%s restored\n", be->B->host, be->B->serv);
+}
+
+void balancer_failed(struct balancer *bl, int i, long long now) {
+	struct backend *be = &bl->backends[i];
+	be->conns -= 1;
+	be->failed += 1;
+
+	/* the connections started before the ejection fail too: they do
+	 * not extend it */
+	if (is_ejected(be, now))
+		return;
+
+	if (!be->backoff)
+		be->backoff = BALANCER_BACKOFF_MIN_US;
+	else if (be->backoff * 2 < BALANCER_BACKOFF_MAX_US)
+		be->backoff *= 2;
+	else
+		be->backoff = BALANCER_BACKOFF_MAX_US;
+
+	be->retry_at = now + be->backoff;
+	be->ejected += 1;
+	fprintf(stderr, "Backend %s:%s ejected for %lli ms\n", be->B->host,
+			be->B->serv, be->backoff / 1000);
+}
+
+void balancer_release(struct balancer *bl, int i) {
+	bl->backends[i].conns -= 1;
+}
+
+void balancer_add_counters(struct balancer *total, struct balancer *bl) {
+	for (int i = 0; i < bl->n; ++i) {
+		total->backends[i].picked += bl->backends[i].picked;
+		total->backends[i].failed += bl->backends[i].failed;
+		total->backends[i].ejected += bl->backends[i].ejected;
+	}
+}
+
+void balancer_summary_print(struct balancer *bl, const char *label) {
+	for (int i = 0; i < bl->n; ++i) {
+		struct backend *be = &bl->backends[i];
+		printf("Backend %s:%s%s: %llu sessions, %llu connections failed, "
+				"%llu ejections\n", be->B->host, be->B->serv, label,
+				be->picked - be->failed, be->failed, be->ejected);
+	}
+}
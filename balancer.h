@@ -0,0 +1,116 @@
+#ifndef BALANCER_H_
+#define BALANCER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "endpoint.h"
+
+#define BALANCER_MAX_BACKENDS 16
+
+/*
+ * Backoff of a backend ejected: it starts in BALANCER_BACKOFF_MIN_US
+ * microseconds and it is doubled each time the backend fails again
+ * up to BALANCER_BACKOFF_MAX_US.
+ * */
+#define BALANCER_BACKOFF_MIN_US 1000000LL
+#define BALANCER_BACKOFF_MAX_US 30000000LL
+
+/*
+ * How the backend of a new session is selected:
+ *  - BALANCE_ROUND_ROBIN takes them in turn
+ *  - BALANCE_LEAST_CONNS takes the one with the fewest sessions
+ *  - BALANCE_LEAST_BYTES takes the one with the fewest bytes in the
+ *	buffers of its sessions (both directions), so the ones that are
+ *	slow to take or to give the data are avoided
+ *
+ * The ties are broken in turn as in BALANCE_ROUND_ROBIN.
+ * */
+enum balance_policy {
+	BALANCE_ROUND_ROBIN,
+	BALANCE_LEAST_CONNS,
+	BALANCE_LEAST_BYTES
+};
+
+struct backend {
+	struct endpoint *B;
+
+	/* the sessions (and connections in progress) to the backend;
+	 * outstanding is set by the caller before balancer_pick */
+	unsigned int conns;
+	size_t outstanding;
+
+	/* ejected until retry_at (0 if it is not ejected) */
+	long long retry_at;
+	long long backoff;
+
+	/* counters, see balancer_summary_print */
+	unsigned long long picked;
+	unsigned long long failed;
+	unsigned long long ejected;
+};
+
+/* struct balancer: the backends of B of a server among which the new
+ * sessions are spread (see enum balance_policy).
+ *
+ * A backend that fails to connect (after all the tries, see
+ * connect_options) is ejected: it is not selected until its backoff
+ * expires and then it is tried again with the next session. If it
+ * fails again, the backoff is doubled; if it connects, it is restored.
+ *
+ * If all the backends are ejected, the one that it is retried first
+ * is selected anyways: a session is not refused without trying.
+ *
+ * A balancer is not thread safe: each worker has its own.
+ * */
+struct balancer {
+	enum balance_policy policy;
+	struct backend backends[BALANCER_MAX_BACKENDS];
+	int n;
+	int next;
+};
+
+/*
+ * Initialize the balancer for the n endpoints given; it keeps
+ * references to them so they must outlive it.
+ * */
+void balancer_init(struct balancer *bl, enum balance_policy policy,
+		struct endpoint backends[], int n);
+
+/*
+ * Return the index of the backend selected for a new session and
+ * count it as a connection of the backend.
+ * */
+int balancer_pick(struct balancer *bl, long long now);
+
+/*
+ * Return true if there is a backend not ejected at time now.
+ * */
+bool balancer_available(struct balancer *bl, long long now);
+
+/*
+ * The connection to the backend i completed (restore the backend if
+ * it was ejected) or failed (eject it, the connection is not counted
+ * anymore).
+ * */
+void balancer_connected(struct balancer *bl, int i);
+void balancer_failed(struct balancer *bl, int i, long long now);
+
+/*
+ * The session of the backend i was closed.
+ * */
+void balancer_release(struct balancer *bl, int i);
+
+/*
+ * Add the counters of bl to total so the balancers of the workers
+ * can be reported together; total must be initialized as bl.
+ * */
+void balancer_add_counters(struct balancer *total, struct balancer *bl);
+
+/*
+ * Print the sessions, the failed connections and the ejections of each
+ * backend; label is appended to the name of the backends.
+ * */
+void balancer_summary_print(struct balancer *bl, const char *label);
+
+#endif
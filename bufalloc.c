@@ -0,0 +1,109 @@
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "bufalloc.h"
+
+static enum bufalloc_mode mode = BUFALLOC_MALLOC;
+
+static
+size_t huge_round_up(size_t sz) {
+	return (sz + BUFALLOC_HUGE_PAGE_SIZE - 1) & ~((size_t)BUFALLOC_HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Map the length of the buffer sz in the current mode.
+ * */
+static
+size_t mapping_length(size_t sz) {
+	return mode == BUFALLOC_LAZY? sz : huge_round_up(sz);
+}
+
+/*
+ * Map len bytes aligned to the huge pages: map more than
+ * needed and unmap the excess at both ends.
+ * */
+static
+void* mmap_huge_aligned(size_t len) {
+	size_t excess = BUFALLOC_HUGE_PAGE_SIZE;
+	char *p = (char*)mmap(NULL, len + excess, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	uintptr_t addr = (uintptr_t)p;
+	uintptr_t aligned = (addr + excess - 1) & ~((uintptr_t)excess - 1);
+	size_t head = aligned - addr;
+
+	if (head)
+		munmap(p, head);
+	if (excess - head)
+		munmap((char*)aligned + len, excess - head);
+
+	return (char*)aligned;
+}
+
+void bufalloc_set_mode(enum bufalloc_mode m) {
+	mode = m;
+}
+
+void* bufalloc_alloc(size_t sz) {
+	void *p;
+	size_t len = mapping_length(sz);
+
+	switch (mode) {
+		case BUFALLOC_MALLOC:
+			return malloc(sz);
+
+		case BUFALLOC_LAZY:
+			p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			return p == MAP_FAILED? NULL : p;
+
+		case BUFALLOC_THP:
+			p = mmap_huge_aligned(len);
+			if (p && madvise(p, len, MADV_HUGEPAGE) == -1) {
+				int last_errno = errno;
+				munmap(p, len);
+				errno = last_errno;
+				return NULL;
+			}
+			return p;
+
+		case BUFALLOC_HUGETLB:
+			p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			return p == MAP_FAILED? NULL : p;
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+void bufalloc_free(void *buf, size_t sz) {
+	if (!buf)
+		return;
+
+	if (mode == BUFALLOC_MALLOC)
+		free(buf);
+	else
+		munmap(buf, mapping_length(sz));
+}
+
+bool bufalloc_releasable() {
+	return mode == BUFALLOC_LAZY || mode == BUFALLOC_THP;
+}
+
+void bufalloc_release(void *buf, size_t sz) {
+	if (!bufalloc_releasable())
+		return;
+
+	/* MADV_FREE is since Linux 4.5; before, drop the pages now */
+	size_t len = mapping_length(sz);
+	if (madvise(buf, len, MADV_FREE) == -1 && errno == EINVAL)
+		madvise(buf, len, MADV_DONTNEED);
+}
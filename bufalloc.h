@@ -0,0 +1,60 @@
+#ifndef BUFALLOC_H_
+#define BUFALLOC_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * How the memory of the relay buffers is allocated:
+ *  - BUFALLOC_MALLOC: with malloc(3)
+ *  - BUFALLOC_LAZY: with an anonymous mmap(2); the pages are committed
+ *    when they are used for the first time and they can be given back
+ *    to the kernel when the buffer is empty (see bufalloc_release)
+ *  - BUFALLOC_THP: as BUFALLOC_LAZY but aligned to the huge pages and
+ *    advising the kernel to use transparent huge pages (MADV_HUGEPAGE)
+ *  - BUFALLOC_HUGETLB: from the pool of huge pages reserved by the
+ *    system (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages); those pages
+ *    are committed and not given back
+ *
+ * The mode is set once (see bufalloc_set_mode), before any
+ * allocation, and it is used for all the buffers.
+ * */
+enum bufalloc_mode {
+	BUFALLOC_MALLOC,
+	BUFALLOC_LAZY,
+	BUFALLOC_THP,
+	BUFALLOC_HUGETLB
+};
+
+/*
+ * The size assumed for the huge pages: the buffers allocated with
+ * huge pages are rounded up to it.
+ * */
+#define BUFALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+void bufalloc_set_mode(enum bufalloc_mode mode);
+
+/*
+ * Allocate a buffer of sz bytes.
+ *
+ * Return NULL on error (errno is set appropriately).
+ * */
+void* bufalloc_alloc(size_t sz);
+void bufalloc_free(void *buf, size_t sz);
+
+/*
+ * Return true if the memory of the buffers can be given back to the
+ * kernel while they are empty (see bufalloc_release).
+ * */
+bool bufalloc_releasable();
+
+/*
+ * Give back to the kernel the memory of the buffer buf of sz bytes:
+ * its content is discarded and the pages are freed lazily, when the
+ * kernel needs them (MADV_FREE), unless they are written again.
+ *
+ * It does nothing if the memory is not releasable.
+ * */
+void bufalloc_release(void *buf, size_t sz);
+
+#endif
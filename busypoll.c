@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "busypoll.h"
+#include "timer.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46 /* Linux 3.11 or newer */
+#endif
+
+void busypoll_init(struct busypoll *bp, int spin) {
+	memset(bp, 0, sizeof(*bp));
+	bp->spin = spin;
+}
+
+int busypoll_wait(struct busypoll *bp, int nfds, fd_set *rfds, fd_set *wfds,
+		long long deadline, const sigset_t *set) {
+	struct timespec timeout;
+	long long now = monotonic_us();
+
+	bp->waits += 1;
+	if (bp->spin) {
+		static const struct timespec zero = {0, 0};
+		fd_set r = *rfds, w = *wfds;
+
+		long long until = now + bp->spin;
+		if (deadline != TIMER_NEVER && deadline < until)
+			until = deadline;
+
+		/* pselect(2) overwrites the sets: restore them on each poll */
+		do {
+			*rfds = r;
+			*wfds = w;
+
+			int s = pselect(nfds, rfds, wfds, NULL, &zero, set);
+			bp->polls += 1;
+			if (s != 0) {
+				if (s > 0)
+					bp->spun += 1;
+				return s;
+			}
+
+			now = monotonic_us();
+		} while (now < until);
+
+		*rfds = r;
+		*wfds = w;
+	}
+
+	bp->blocked += 1;
+	return pselect(nfds, rfds, wfds, NULL,
+			timer_timeout(deadline, now, &timeout), set);
+}
+
+void busypoll_enable(int fd, int spin) {
+	static atomic_flag warned = ATOMIC_FLAG_INIT;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &spin, sizeof(spin)) == -1
+			&& !atomic_flag_test_and_set(&warned))
+		perror("SO_BUSY_POLL setup failed, the sockets are not busy polled");
+}
+
+void busypoll_add_counters(struct busypoll *total, struct busypoll *bp) {
+	total->spin = bp->spin;
+	total->waits += bp->waits;
+	total->spun += bp->spun;
+	total->blocked += bp->blocked;
+	total->polls += bp->polls;
+}
+
+void busypoll_summary_print(struct busypoll *bp) {
+	printf("Busy poll of %i us: %llu waits, %llu served spinning, "
+			"%llu blocked, %llu polls\n", bp->spin, bp->waits,
+			bp->spun, bp->blocked, bp->polls);
+}
@@ -0,0 +1,54 @@
+#ifndef BUSYPOLL_H_
+#define BUSYPOLL_H_
+
+#include <sys/select.h>
+#include <signal.h>
+
+/* struct busypoll: the spin-then-block wait of an event loop.
+ *
+ * Instead of sleeping in pselect(2) right away, the loop polls the
+ * file descriptors without blocking for up to spin microseconds and
+ * only then it sleeps: an event that arrives while spinning is served
+ * without the wake up of the thread (the scheduler's latency), at the
+ * cost of a core busy all that time.
+ *
+ * With a spin of 0 it is a plain pselect(2).
+ * */
+struct busypoll {
+	int spin;
+
+	/* counters, see busypoll_summary_print */
+	unsigned long long waits;
+	unsigned long long spun;
+	unsigned long long blocked;
+	unsigned long long polls;
+};
+
+void busypoll_init(struct busypoll *bp, int spin);
+
+/*
+ * Wait like pselect(2) until an event in rfds or wfds, a signal not in
+ * set or the deadline (in microseconds, see monotonic_us) spinning
+ * first as configured in bp.
+ *
+ * Return what pselect(2) returns.
+ * */
+int busypoll_wait(struct busypoll *bp, int nfds, fd_set *rfds, fd_set *wfds,
+		long long deadline, const sigset_t *set);
+
+/*
+ * Set SO_BUSY_POLL on the socket fd so the kernel polls the device
+ * queue for up to spin microseconds on a read that finds no data (see
+ * socket(7)). Raising it requires CAP_NET_ADMIN: it is a hint so on
+ * error the reason is printed to stderr the first time only.
+ * */
+void busypoll_enable(int fd, int spin);
+
+/*
+ * Add the counters of bp to total.
+ * */
+void busypoll_add_counters(struct busypoll *total, struct busypoll *bp);
+
+void busypoll_summary_print(struct busypoll *bp);
+
+#endif
@@ -1,4 +1,6 @@
 #include "circular_buffer.h"
+#include "bufalloc.h"
+#include "slab.h"
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -6,7 +8,7 @@
 int circular_buffer_init(struct circular_buffer_t *b, size_t sz) {
 	memset(b, 0, sizeof(*b));
 	b->sz = sz;
-	b->buf = (char*)malloc(sz);
+	b->buf = (char*)slab_buffer_alloc(sz);
 	if (!b->buf)
 		return -1;
 
@@ -14,7 +16,41 @@ int circular_buffer_init(struct circular_buffer_t *b, size_t sz) {
 }
 
 void circular_buffer_destroy(struct circular_buffer_t *b) {
-	free(b->buf);
+	slab_buffer_free(b->buf, b->sz);
+}
+
+int circular_buffer_resize(struct circular_buffer_t *b, size_t sz) {
+	size_t total = circular_buffer_get_total_ready(b);
+	assert (total <= sz);
+
+	char *buf = (char*)slab_buffer_alloc(sz);
+	if (!buf)
+		return -1;
+
+	/* copy the ready data to the begin of the new buffer: first
+	 * from the tail and then, if it wraps around, from the begin */
+	size_t ready = circular_buffer_get_ready(b);
+	memcpy(buf, &b->buf[b->tail], ready);
+	memcpy(&buf[ready], b->buf, total - ready);
+
+	slab_buffer_free(b->buf, b->sz);
+	b->buf = buf;
+	b->sz = sz;
+	b->tail = 0;
+	b->head = total;
+	b->hbehind = false;
+
+	if (b->head == b->sz) {
+		b->head = 0;
+		b->hbehind = true;
+	}
+
+	return 0;
+}
+
+void circular_buffer_release(struct circular_buffer_t *b) {
+	assert (circular_buffer_get_total_ready(b) == 0);
+	bufalloc_release(b->buf, b->sz);
 }
 
 size_t circular_buffer_get_free(struct circular_buffer_t *b) {
@@ -25,6 +61,24 @@ size_t circular_buffer_get_ready(struct circular_buffer_t *b) {
 	return b->hbehind? (b->sz - b->tail) : (b->head - b->tail);
 }
 
+size_t circular_buffer_get_total_ready(struct circular_buffer_t *b) {
+	return b->hbehind? (b->sz - b->tail + b->head) : (b->head - b->tail);
+}
+
+size_t circular_buffer_get_ready_after(struct circular_buffer_t *b,
+		size_t skip, size_t *pos) {
+	assert (skip <= circular_buffer_get_total_ready(b));
+	size_t p = b->tail + skip;
+	if (p >= b->sz) {
+		/* the skipped bytes wrapped around the end of the buffer */
+		*pos = p - b->sz;
+		return b->head - *pos;
+	}
+
+	*pos = p;
+	return b->hbehind? (b->sz - p) : (b->head - p);
+}
+
 void circular_buffer_advance_head(struct circular_buffer_t *b, size_t s) {
 	assert (s <= circular_buffer_get_free(b));
 	b->head += s;
@@ -41,4 +95,8 @@ void circular_buffer_advance_tail(struct circular_buffer_t *b, size_t s) {
 		b->tail = 0;
 		b->hbehind = false;
 	}
+
+	/* empty: start again from the begin */
+	if (b->tail == b->head && !b->hbehind)
+		b->head = b->tail = 0;
 }
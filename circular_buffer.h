@@ -19,9 +19,16 @@ void circular_buffer_destroy(struct circular_buffer_t *b);
 size_t circular_buffer_get_free(struct circular_buffer_t *b);
 size_t circular_buffer_get_ready(struct circular_buffer_t *b);
 
+size_t circular_buffer_get_total_ready(struct circular_buffer_t *b);
+size_t circular_buffer_get_ready_after(struct circular_buffer_t *b,
+		size_t skip, size_t *pos);
+
 void circular_buffer_advance_head(struct circular_buffer_t *b, size_t s);
 void circular_buffer_advance_tail(struct circular_buffer_t *b, size_t s);
 
+int circular_buffer_resize(struct circular_buffer_t *b, size_t sz);
+void circular_buffer_release(struct circular_buffer_t *b);
+
 /*
 
 struct circular_buffer is a simple but quite efficient implementation
@@ -32,6 +39,8 @@ Here is a its documentation. Enjoy it!
 First, let's load this module to play with it
 
 ```cpp
+.L bufalloc.c
+.L slab.c
 .L circular_buffer.c
 #include "circular_buffer.h"
 #include <string.h>
@@ -291,6 +300,129 @@ out:
 (bool) true
 ```
 
+Sometimes the data cannot be discarded as soon as it is read.
+
+For example, the data may be still in use by someone else
+(the kernel in the case of a zerocopy send) so the tail pointer
+cannot be moved yet.
+
+Let's discard 12 bytes and write 6 more so the ready space
+wraps around the end of the buffer:
+
+ *          /- head     /- tail
+ *         V           V
+ *   +--------------------------+
+ *   |::::::           :::::::::|
+ *   +--------------------------+
+ *
+
+The ready space is only 4 bytes long because it is
+limited by the end of the buffer but in total there are 10
+bytes ready:
+
+```cpp
+circular_buffer_advance_tail(&buf, 12);
+circular_buffer_advance_head(&buf, 6);
+
+circular_buffer_get_ready(&buf)
+circular_buffer_get_total_ready(&buf)
+
+out:
+(unsigned long) 4
+(unsigned long) 10
+```
+
+To read the data *after* the first skip bytes ready without
+moving the tail use ``circular_buffer_get_ready_after``.
+
+It returns how many *contiguous* bytes are ready after skipping
+that many bytes and where they begin.
+
+```cpp
+size_t pos;
+circular_buffer_get_ready_after(&buf, 0, &pos)
+pos
+
+circular_buffer_get_ready_after(&buf, 4, &pos)
+pos
+
+circular_buffer_get_ready_after(&buf, 7, &pos)
+pos
+
+out:
+(unsigned long) 4
+(unsigned long) 12
+(unsigned long) 6
+(unsigned long) 0
+(unsigned long) 3
+(unsigned long) 3
+```
+
+When all the data is consumed the buffer is empty and
+both pointers go back to the begin so the next data is written
+in the first bytes again.
+
+A buffer that holds a few bytes at a time uses only its first
+pages; the rest is never touched so, depending on how the memory
+was allocated, it is not committed (see bufalloc.h)
+
+```cpp
+circular_buffer_advance_tail(&buf, 4);
+circular_buffer_advance_tail(&buf, 6);
+
+buf.head
+buf.tail
+circular_buffer_get_free(&buf)
+
+out:
+(unsigned long) 0
+(unsigned long) 0
+(unsigned long) 16
+```
+
+The memory of an empty buffer can be given back to the kernel with
+``circular_buffer_release``; its content is discarded.
+
+A buffer can be resized with ``circular_buffer_resize`` as long as
+the new size can hold the data ready. The data is moved to the begin
+of a new buffer, even if it was wrapped around the end of the old one
+
+ *    /- tail        /- head
+ *   V              V
+ *   +--------------------------------+
+ *   |::::::::::::::                  |
+ *   +--------------------------------+
+ *
+
+```cpp
+circular_buffer_advance_head(&buf, 16);
+circular_buffer_advance_tail(&buf, 12);
+memcpy(&buf.buf[buf.head], "HHII", 4);
+circular_buffer_advance_head(&buf, 4);
+
+circular_buffer_get_ready(&buf)
+circular_buffer_get_total_ready(&buf)
+
+circular_buffer_resize(&buf, 32);
+
+buf.tail
+buf.head
+circular_buffer_get_ready(&buf)
+circular_buffer_get_free(&buf)
+
+out:
+(unsigned long) 4
+(unsigned long) 8
+(int) 0
+(unsigned long) 0
+(unsigned long) 8
+(unsigned long) 8
+(unsigned long) 24
+```
+
+The resize returns -1 if the new buffer cannot be allocated; the
+old one is kept untouched.
+
 Finally, do not forget to destroy the buffer
 
 ```cpp
@@ -10,10 +10,17 @@
 #include <stdint.h>
 
 #include "endpoint.h"
+#include "socket.h"
 #include "cmdline.h"
+#include "pool.h"
+#include "server.h"
+#include "resolver.h"
+#include "udp.h"
 
 #define DEFAULT_HOST "localhost"
+#define UNIX_PREFIX RESOLVER_UNIX_HOST ":"
 #define DEFAULT_BUF_SIZE (2048)
+#define DEFAULT_RESOLVER_TTL_MSECS 60000
 
 #define DEFAULT_A_TO_B_DUMPFILENAME "AtoB.dump"
 #define DEFAULT_B_TO_A_DUMPFILENAME "BtoA.dump"
@@ -29,7 +36,12 @@ static
 void parse_address(char *addr_str, char **host, char **serv) {
 	char *colon = strrchr(addr_str, ':');
 
-	if (colon) {
+	if (strncmp(addr_str, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+		/* form unix:path (the path may have colons) */
+		*host = RESOLVER_UNIX_HOST;
+		*serv = addr_str + sizeof(UNIX_PREFIX) - 1;
+	}
+	else if (colon) {
 		*colon = 0;
 
 		if (addr_str[0]) {
@@ -50,6 +62,43 @@ void parse_address(char *addr_str, char **host, char **serv) {
 	}
 }
 
+/*
+ * Parse the list of backends of B separated by commas; B is set as
+ * the first one.
+ * */
+static
+int parse_backends(char *list_str, struct endpoint *B,
+		struct options *opts) {
+	char *saveptr;
+	opts->nbackends = 0;
+
+	for (char *addr = strtok_r(list_str, ",", &saveptr); addr;
+			addr = strtok_r(NULL, ",", &saveptr)) {
+		if (opts->nbackends == BALANCER_MAX_BACKENDS)
+			return -1;
+
+		struct endpoint *be = &opts->backends[opts->nbackends++];
+		parse_address(addr, &be->host, &be->serv);
+	}
+
+	if (opts->nbackends == 0)
+		return -1;
+
+	B->host = opts->backends[0].host;
+	B->serv = opts->backends[0].serv;
+	return 0;
+}
+
+static
+bool has_unix_backend(struct options *opts) {
+	for (int i = 0; i < opts->nbackends; ++i) {
+		if (resolver_is_unix(opts->backends[i].host))
+			return true;
+	}
+
+	return false;
+}
+
 static
 int parse_buffer_sizes(char *sz_str, size_t buf_sizes[2]) {
 	char *colon = strrchr(sz_str, ':');
@@ -70,7 +119,7 @@ int parse_buffer_sizes(char *sz_str, size_t buf_sizes[2]) {
 		if (values[i] == LLONG_MIN || values[i] == LLONG_MAX)
 			return -1;
 
-		if (values[i] <= 0 || values[i] > SIZE_MAX) {
+		if (values[i] <= 0 || (unsigned long long) values[i] > SIZE_MAX) {
 			errno = ERANGE;
 			return -1;
 		}
@@ -81,6 +130,269 @@ int parse_buffer_sizes(char *sz_str, size_t buf_sizes[2]) {
 	return 0;
 }
 
+static
+int parse_size(char *str, size_t *sz) {
+	char *end;
+	errno = 0;
+	long long int value = strtoll(str, &end, 0);
+
+	if (errno || *end != 0 || end == str)
+		return -1;
+
+	if (value <= 0 || (unsigned long long) value > SIZE_MAX) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	*sz = (size_t) value;
+	return 0;
+}
+
+/*
+ * Return a pointer to the field of the tuning named name or
+ * NULL if there is no such option.
+ * For the boolean options, set *is_bool to 1.
+ * */
+static
+int* tcp_tuning_field(struct tcp_tuning *tuning, const char *name,
+		int *is_bool) {
+	*is_bool = 1;
+	if (strcmp(name, "nodelay") == 0)
+		return &tuning->nodelay;
+	if (strcmp(name, "cork") == 0)
+		return &tuning->cork;
+	if (strcmp(name, "quickack") == 0)
+		return &tuning->quickack;
+
+	*is_bool = 0;
+	if (strcmp(name, "notsent_lowat") == 0)
+		return &tuning->notsent_lowat;
+	if (strcmp(name, "rcvlowat") == 0)
+		return &tuning->rcvlowat;
+
+	return NULL;
+}
+
+static
+int parse_tcp_tuning(char *opt_str, struct tcp_tuning tuning[2]) {
+	int first = 0, last = 1;
+
+	/* form A:option or B:option, otherwise apply it to both legs */
+	if ((opt_str[0] == 'A' || opt_str[0] == 'B') && opt_str[1] == ':') {
+		first = last = (opt_str[0] == 'A')? 0 : 1;
+		opt_str += 2;
+	}
+
+	long long int value = -1;
+	char *equal = strchr(opt_str, '=');
+
+	if (equal) {
+		char *end = NULL;
+		*equal = 0;
+		value = strtoll(equal+1, &end, 0);
+		if (end == equal+1 || *end != 0 || value < 0 || value > INT_MAX) {
+			errno = ERANGE;
+			return -1;
+		}
+	}
+
+	for (int i = first; i <= last; ++i) {
+		int is_bool;
+		int *field = tcp_tuning_field(&tuning[i], opt_str, &is_bool);
+
+		if (!field) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (is_bool) {
+			/* option or option=0/1 */
+			if (value > 1) {
+				errno = ERANGE;
+				return -1;
+			}
+			*field = (value == -1)? 1 : (int)value;
+		}
+		else {
+			/* option=num, the value is mandatory */
+			if (value == -1) {
+				errno = EINVAL;
+				return -1;
+			}
+			*field = (int)value;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a time interval in milliseconds; it must be
+ * a positive number.
+ * */
+static
+int parse_interval(char *str, int *interval) {
+	char *end = NULL;
+	long long int value = strtoll(str, &end, 0);
+
+	if (end == str || *end != 0 || value <= 0 || value > INT_MAX) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	*interval = (int)value;
+	return 0;
+}
+
+/*
+ * Parse a file descriptor: a number of 0 or more.
+ * */
+static
+int parse_fd(char *str, int *fd) {
+	char *end = NULL;
+	long long int value = strtoll(str, &end, 10);
+
+	if (end == str || *end != 0 || value < 0 || value > INT_MAX) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	*fd = (int)value;
+	return 0;
+}
+
+/*
+ * Parse the retries of the connection of the form
+ * tries[:base[:max]] where base and max are the initial and the
+ * maximum backoff between tries in milliseconds.
+ * */
+static
+int parse_connect_retries(char *str, struct connect_options *copts) {
+	int values[3] = {
+		copts->tries, copts->backoff_base, copts->backoff_max
+	};
+
+	for (int i = 0; i < 3 && str; ++i) {
+		char *colon = strchr(str, ':');
+		if (colon)
+			*colon = 0;
+
+		if (parse_interval(str, &values[i]) != 0)
+			return -1;
+
+		str = colon? colon + 1 : NULL;
+	}
+
+	if (str || values[1] > values[2]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	copts->tries = values[0];
+	copts->backoff_base = values[1];
+	copts->backoff_max = values[2];
+	return 0;
+}
+
+/*
+ * Parse a list of CPUs of the form 0,2-3,... into cpus
+ * setting *ncpus.
+ * */
+static
+int parse_cpu_list(char *str, int cpus[], int *ncpus) {
+	int n = 0;
+
+	while (1) {
+		char *end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+
+		if (end == str || first < 0 || first > INT_MAX)
+			goto invalid;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first || last > INT_MAX)
+				goto invalid;
+		}
+
+		for (long cpu = first; cpu <= last; ++cpu) {
+			if (n == AFFINITY_MAX_CPUS)
+				goto invalid;
+			cpus[n++] = (int)cpu;
+		}
+
+		if (*end == 0)
+			break;
+
+		if (*end != ',')
+			goto invalid;
+		str = end + 1;
+	}
+
+	*ncpus = n;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+static
+int parse_buffer_mode(const char *str, enum bufalloc_mode *mode) {
+	static const char *names[] = { "malloc", "lazy", "thp", "hugetlb" };
+	static const enum bufalloc_mode modes[] = {
+		BUFALLOC_MALLOC, BUFALLOC_LAZY, BUFALLOC_THP, BUFALLOC_HUGETLB
+	};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(str, names[i]) == 0) {
+			*mode = modes[i];
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static
+int parse_balance_policy(const char *str, enum balance_policy *policy) {
+	static const char *names[] = { "rr", "conns", "bytes" };
+	static const enum balance_policy policies[] = {
+		BALANCE_ROUND_ROBIN, BALANCE_LEAST_CONNS, BALANCE_LEAST_BYTES
+	};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(str, names[i]) == 0) {
+			*policy = policies[i];
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static
+int parse_event_backend(const char *str, enum event_backend *backend) {
+	static const char *names[] = { "select", "uring" };
+	static const enum event_backend backends[] = {
+		BACKEND_SELECT, BACKEND_URING
+	};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(str, names[i]) == 0) {
+			*backend = backends[i];
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
 static
 int parse_output_filenames(char *prefix, char *out_filenames[]) {
 	int prefix_len = strlen(prefix);
@@ -123,20 +435,48 @@ int save_default_output_filenames(char *out_filenames[]) {
 }
 
 int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
-		struct endpoint *B, size_t buf_sizes[2],
-		size_t skt_buf_sizes[2], char *out_filenames[2],
-		int *colorless) {
+		struct endpoint *B, struct options *opts) {
 	int ret = -1;
 	int opt;
 	int opt_found = 0;
 
 	/* default values */
-	buf_sizes[0] = buf_sizes[1] = DEFAULT_BUF_SIZE;
-	skt_buf_sizes[0] = skt_buf_sizes[1] = 0;
-	out_filenames[0] = out_filenames[1] = 0;
-	*colorless = 0;
+	opts->buf_sizes[0] = opts->buf_sizes[1] = DEFAULT_BUF_SIZE;
+	opts->skt_buf_sizes[0] = opts->skt_buf_sizes[1] = 0;
+	tcp_tuning_init(&opts->tuning[0]);
+	tcp_tuning_init(&opts->tuning[1]);
+	connect_options_init(&opts->copts);
+	opts->out_filenames[0] = opts->out_filenames[1] = 0;
+	opts->colorless = 0;
+	opts->zerocopy = 0;
+	opts->tcpinfo_interval = 0;
+	opts->queues_interval = 0;
+	opts->stall_threshold = 0;
+	opts->analyze = 0;
+	opts->multi = 0;
+	opts->pool_size = 0;
+	opts->workers = 1;
+	opts->pipeline = 0;
+	opts->ncpus = 0;
+	opts->buf_mode = BUFALLOC_MALLOC;
+	opts->buf_max[0] = opts->buf_max[1] = 0;
+	opts->buf_budget = 0;
+	opts->resolver_ttl = DEFAULT_RESOLVER_TTL_MSECS;
+	opts->udp = 0;
+	opts->drain_timeout = 0;
+	opts->busy_poll = 0;
+	opts->backend = BACKEND_SELECT;
+	opts->nbackends = 0;
+	opts->balance = BALANCE_ROUND_ROBIN;
+	opts->shadow.host = opts->shadow.serv = NULL;
+	opts->shadow_lag = 0;
+	opts->listen_fd = -1;
+	opts->handoff = NULL;
+	A->host = A->serv = NULL;
+	opts->config = NULL;
+	opts->route = NULL;
 
-	while ((opt = getopt(argc, argv, "A:B:b:z:ochf:")) != -1) {
+	while ((opt = getopt(argc, argv, "A:B:L:S:W:C:F:b:g:G:z:t:r:T:d:D:H:k:E:Zi:q:s:nmp:j:uPa:M:ochf:")) != -1) {
 		switch (opt) {
 			case 'A':
 				/* A configuration */
@@ -145,27 +485,239 @@ int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
 				break;
 
 			case 'B':
-				/* B configuration */
-				parse_address(optarg, &B->host, &B->serv);
+				/* B configuration, one or more backends */
+				if (parse_backends(optarg, B, opts) != 0) {
+					fprintf(stderr, "Invalid list of backends.\n");
+					return ret;
+				}
 				opt_found |= 2;
 				break;
 
+			case 'F':
+				/* listening socket of A inherited */
+				if (parse_fd(optarg, &opts->listen_fd) != 0) {
+					fprintf(stderr, "Invalid file descriptor.\n");
+					return ret;
+				}
+				break;
+
+			case 'L':
+				/* balancing policy among the backends */
+				if (parse_balance_policy(optarg, &opts->balance) != 0) {
+					fprintf(stderr, "Invalid balancing policy.\n");
+					return ret;
+				}
+				opt_found |= 16;
+				break;
+
+			case 'S':
+				/* shadow B, mirror of A -> B */
+				parse_address(optarg, &opts->shadow.host, &opts->shadow.serv);
+				break;
+
+			case 'W':
+				/* lag budget of the shadow */
+				if (parse_size(optarg, &opts->shadow_lag) != 0
+						|| opts->shadow_lag == 0) {
+					fprintf(stderr, "Invalid mirror lag budget.\n");
+					return ret;
+				}
+				opt_found |= 32;
+				break;
+
+			case 'C':
+				/* routes' file */
+				opts->config = optarg;
+				break;
+
 			case 'b':
 				/* buffer sizes configuration */
-				if (parse_buffer_sizes(optarg, buf_sizes) != 0) {
+				if (parse_buffer_sizes(optarg, opts->buf_sizes) != 0) {
 					fprintf(stderr, "Invalid buffer size.\n");
 					return ret;
 				}
 				break;
 
+			case 'g':
+				/* buffer maximum sizes, adaptive sizing */
+				if (parse_buffer_sizes(optarg, opts->buf_max) != 0) {
+					fprintf(stderr, "Invalid buffer maximum size.\n");
+					return ret;
+				}
+				break;
+
+			case 'G':
+				/* memory budget of the buffers */
+				if (parse_size(optarg, &opts->buf_budget) != 0) {
+					fprintf(stderr, "Invalid buffer memory budget.\n");
+					return ret;
+				}
+				break;
+
 			case 'z':
 				/* socket's buffer sizes configuration */
-				if (parse_buffer_sizes(optarg, skt_buf_sizes) != 0) {
+				if (parse_buffer_sizes(optarg, opts->skt_buf_sizes) != 0) {
 					fprintf(stderr, "Invalid socket buffer size.\n");
 					return ret;
 				}
 				break;
 
+			case 't':
+				/* TCP tuning for one or both legs */
+				if (parse_tcp_tuning(optarg, opts->tuning) != 0) {
+					fprintf(stderr, "Invalid TCP tuning option.\n");
+					return ret;
+				}
+				break;
+
+			case 'r':
+				/* connection retries and backoff */
+				if (parse_connect_retries(optarg, &opts->copts) != 0) {
+					fprintf(stderr, "Invalid connection retries.\n");
+					return ret;
+				}
+				break;
+
+			case 'T':
+				/* connection attempt timeout */
+				if (parse_interval(optarg, &opts->copts.attempt_timeout) != 0) {
+					fprintf(stderr, "Invalid connection timeout.\n");
+					return ret;
+				}
+				break;
+
+			case 'd':
+				/* TTL of the resolver's cache */
+				if (parse_interval(optarg, &opts->resolver_ttl) != 0) {
+					fprintf(stderr, "Invalid resolver cache TTL.\n");
+					return ret;
+				}
+				break;
+
+			case 'D':
+				/* drain deadline on SIGTERM */
+				if (parse_interval(optarg, &opts->drain_timeout) != 0) {
+					fprintf(stderr, "Invalid drain deadline.\n");
+					return ret;
+				}
+				break;
+
+			case 'H':
+				/* Unix socket of the handoff */
+				opts->handoff = optarg;
+				break;
+
+			case 'k':
+				/* spin before blocking */
+				if (parse_interval(optarg, &opts->busy_poll) != 0) {
+					fprintf(stderr, "Invalid busy poll time.\n");
+					return ret;
+				}
+				break;
+
+			case 'E':
+				/* event backend */
+				if (parse_event_backend(optarg, &opts->backend) != 0) {
+					fprintf(stderr, "Invalid event backend.\n");
+					return ret;
+				}
+				break;
+
+			case 'Z':
+				/* send with MSG_ZEROCOPY */
+				opts->zerocopy = 1;
+				break;
+
+			case 'i':
+				/* TCP_INFO sampling interval */
+				if (parse_interval(optarg, &opts->tcpinfo_interval) != 0) {
+					fprintf(stderr, "Invalid TCP info sampling interval.\n");
+					return ret;
+				}
+				break;
+
+			case 'q':
+				/* queues sampling interval */
+				if (parse_interval(optarg, &opts->queues_interval) != 0) {
+					fprintf(stderr, "Invalid queues sampling interval.\n");
+					return ret;
+				}
+				break;
+
+			case 's':
+				/* stall detection threshold */
+				if (parse_interval(optarg, &opts->stall_threshold) != 0) {
+					fprintf(stderr, "Invalid stall threshold.\n");
+					return ret;
+				}
+				break;
+
+			case 'n':
+				/* small-write / Nagle analyzer */
+				opts->analyze = 1;
+				break;
+
+			case 'm':
+				/* multiple sessions */
+				opts->multi = 1;
+				break;
+
+			case 'p':
+				/* pool of connections to B, implies -m */
+				if (parse_interval(optarg, &opts->pool_size) != 0
+						|| opts->pool_size > POOL_MAX_SIZE) {
+					fprintf(stderr, "Invalid pool size.\n");
+					return ret;
+				}
+				opts->multi = 1;
+				break;
+
+			case 'j':
+				/* worker threads, implies -m */
+				if (parse_interval(optarg, &opts->workers) != 0
+						|| opts->workers > SERVER_MAX_WORKERS) {
+					fprintf(stderr, "Invalid number of workers.\n");
+					return ret;
+				}
+				opts->multi = 1;
+				break;
+
+			case 'u':
+				/* datagram mode */
+				opts->udp = 1;
+				break;
+
+			case 'P':
+				/* thread per endpoint */
+				opts->pipeline = 1;
+				break;
+
+			case 'a':
+				/* CPU affinity */
+				if (parse_cpu_list(optarg, opts->cpus, &opts->ncpus) != 0) {
+					fprintf(stderr, "Invalid list of CPUs.\n");
+					return ret;
+				}
+
+				/* fail now instead of in the middle of the
+				 * start of the workers */
+				for (int i = 0; i < opts->ncpus; ++i) {
+					if (!affinity_allowed(opts->cpus[i])) {
+						fprintf(stderr, "CPU %i is not available.\n",
+								opts->cpus[i]);
+						return ret;
+					}
+				}
+				break;
+
+			case 'M':
+				/* how the buffers are allocated */
+				if (parse_buffer_mode(optarg, &opts->buf_mode) != 0) {
+					fprintf(stderr, "Invalid buffer memory mode.\n");
+					return ret;
+				}
+				break;
+
 			case 'o':
 				/* save capture onto the output files */
 				opt_found |= 8;
@@ -173,7 +725,7 @@ int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
 					fprintf(stderr, "Options -o and -f are incompatible.\n");
 					return ret;
 				}
-				if (save_default_output_filenames(out_filenames)) {
+				if (save_default_output_filenames(opts->out_filenames)) {
 					fprintf(stderr, "Error while saving default output filenames.\n");
 					return ret;
 				}
@@ -186,7 +738,7 @@ int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
 					fprintf(stderr, "Options -o and -f are incompatible.\n");
 					return ret;
 				}
-				if (parse_output_filenames(optarg, out_filenames) != 0) {
+				if (parse_output_filenames(optarg, opts->out_filenames) != 0) {
 					fprintf(stderr, "Invalid output filenames prefix.\n");
 					return ret;
 				}
@@ -194,7 +746,7 @@ int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
 
 			case 'c':
 				/* color less */
-				*colorless = 1;
+				opts->colorless = 1;
 				break;
 
 			case 'h':
@@ -207,16 +759,153 @@ int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
 		}
 	}
 
-	if ((opt_found & (1 | 2)) != (1 | 2)) {
+	/* without -F, the socket passed by the supervisor, if any; the
+	 * routes (-C) do not inherit it */
+	int inherited = inherited_listening_fd();
+	if (opts->listen_fd == -1 && !opts->config && !opts->udp
+			&& !opts->handoff)
+		opts->listen_fd = inherited;
+
+	if (opts->config) {
+		if (opt_found & (1 | 2)) {
+			fprintf(stderr, "Option -C is incompatible with -A and -B.\n");
+			return ret;
+		}
+
+		if (opts->udp || opts->pipeline) {
+			fprintf(stderr, "Option -C is incompatible with -u and -P.\n");
+			return ret;
+		}
+
+		opts->multi = 1;
+	}
+	else if (!(opt_found & 2) || (!(opt_found & 1) && opts->listen_fd == -1)) {
 		fprintf(stderr, "Missing arguments. You need to pass -A and -B flags.\n");
 		return ret;
 	}
 
+	if (opts->listen_fd != -1 && (opts->config || opts->udp
+				|| opts->handoff)) {
+		fprintf(stderr, "Option -F is incompatible with -C, -u and -H.\n");
+		return ret;
+	}
+
+	if (opts->zerocopy && (((opt_found & 1) && resolver_is_unix(A->host))
+				|| has_unix_backend(opts))) {
+		fprintf(stderr, "Option -Z is incompatible with Unix sockets "
+				"(unix:path).\n");
+		return ret;
+	}
+
+	if (opts->pipeline && (opts->multi || opts->udp || opts->zerocopy
+				|| opts->analyze || opts->stall_threshold
+				|| opts->tcpinfo_interval || opts->queues_interval
+				|| opts->buf_max[0] || opts->shadow.host)) {
+		fprintf(stderr, "Option -P is incompatible with -m, -p, -j, -u, "
+				"-Z, -n, -s, -i, -q, -g and -S.\n");
+		return ret;
+	}
+
+	if (opts->drain_timeout && (opts->udp || opts->pipeline)) {
+		fprintf(stderr, "Option -D is incompatible with -u and -P.\n");
+		return ret;
+	}
+
+	if (opts->busy_poll && (opts->udp || opts->pipeline)) {
+		fprintf(stderr, "Option -k is incompatible with -u and -P.\n");
+		return ret;
+	}
+
+	if (opts->backend == BACKEND_URING && (opts->multi || opts->udp
+				|| opts->pipeline || opts->zerocopy || opts->stall_threshold
+				|| opts->tcpinfo_interval || opts->queues_interval
+				|| opts->buf_max[0] || opts->shadow.host
+				|| opts->drain_timeout || opts->busy_poll)) {
+		fprintf(stderr, "Option -E uring is incompatible with -m, -p, -j, "
+				"-C, -u, -P, -Z, -s, -i, -q, -g, -S, -D and -k.\n");
+		return ret;
+	}
+
+	if (opts->handoff && (!opts->multi || opts->config || opts->workers > 1
+				|| opts->udp || opts->zerocopy || opts->shadow.host)) {
+		fprintf(stderr, "Option -H requires -m and it is incompatible "
+				"with -C, -j, -u, -Z and -S.\n");
+		return ret;
+	}
+
+	if (!opts->shadow.host && (opt_found & 32)) {
+		fprintf(stderr, "Option -W requires -S.\n");
+		return ret;
+	}
+
+	if (opts->shadow.host && opts->zerocopy) {
+		fprintf(stderr, "Options -S and -Z are incompatible.\n");
+		return ret;
+	}
+
+	if (opts->nbackends > 1) {
+		if (!opts->multi || opts->udp) {
+			fprintf(stderr, "A list of backends (-B) requires -m and "
+					"it is incompatible with -u.\n");
+			return ret;
+		}
+
+		if (opts->pool_size) {
+			fprintf(stderr, "Option -p is incompatible with a list of "
+					"backends (-B).\n");
+			return ret;
+		}
+	}
+	else if (opt_found & 16) {
+		fprintf(stderr, "Option -L requires a list of backends (-B).\n");
+		return ret;
+	}
+
+	if (opts->buf_max[0]) {
+		if (opts->zerocopy) {
+			fprintf(stderr, "Options -g and -Z are incompatible.\n");
+			return ret;
+		}
+
+		if (opts->buf_max[0] < opts->buf_sizes[0]
+				|| opts->buf_max[1] < opts->buf_sizes[1]) {
+			fprintf(stderr, "The buffer maximum size (-g) cannot be "
+					"smaller than the buffer size (-b).\n");
+			return ret;
+		}
+	}
+	else if (opts->buf_budget) {
+		fprintf(stderr, "Option -G requires -g.\n");
+		return ret;
+	}
+
 	ret = 0;
 	return ret;
 }
 
-void what(char *argv[]) {
+int parse_route_cmd_line(int argc, char *argv[], struct endpoint *A,
+		struct endpoint *B, struct options *opts) {
+	/* start the scan of getopt again */
+	optind = 1;
+	if (parse_cmd_line(argc, argv, A, B, opts) != 0)
+		return -1;
+
+	if (opts->config || opts->udp || opts->pipeline || opts->workers != 1
+			|| opts->ncpus || opts->buf_mode != BUFALLOC_MALLOC
+			|| opts->buf_budget || opts->drain_timeout || opts->handoff
+			|| opts->listen_fd != -1 || opts->busy_poll
+			|| opts->backend != BACKEND_SELECT
+			|| opts->resolver_ttl != DEFAULT_RESOLVER_TTL_MSECS) {
+		fprintf(stderr, "Options -C, -u, -P, -j, -a, -M, -G, -d, -D, -H, -F, "
+				"-k and -E cannot be set in a route.\n");
+		return -1;
+	}
+
+	opts->multi = 1;
+	return 0;
+}
+
+void what() {
 	printf
 		("tiburoncin\n"
 		 "==========\n"
@@ -234,15 +923,28 @@ void what(char *argv[]) {
 }
 
 void usage(char *argv[]) {
+	struct connect_options copts;
+	connect_options_init(&copts);
+
 	printf
-		("%s -A <addr> -B <addr> [-b <bsz>] [-z <bsz>] [-o | -f <prefix>] [-c]\n"
+		("%s -A <addr> -B <addr>[,<addr>...] [-L <policy>] [-b <bsz>] [-g <bsz>]\n"
+		 "    [-G <bytes>] [-z <bsz>] [-o | -f <prefix>] [-c] [-t <topt>]\n"
+		 "    [-r <retries>] [-T <ms>] [-d <ms>] [-Z] [-i <ms>] [-q <ms>] [-s <ms>]\n"
+		 "    [-n] [-m] [-p <n>] [-j <n>] [-u] [-P] [-a <cpus>] [-M <mode>]\n"
+		 "    [-S <addr> [-W <bytes>]] [-D <ms>] [-H <path>] [-F <fd>] [-k <us>]\n"
+		 "    [-E <backend>]\n"
+		 "%s -C <file> [-j <n>] [-a <cpus>] [-M <mode>] [-G <bytes>] [-d <ms>]\n"
+		 "    [-D <ms>] [-k <us>]\n"
 		 " where <addr> can be of the form:\n"
 		 "  - host:serv\n"
 		 "  - :serv\n"
 		 "  - serv\n"
+		 "  - unix:path\n"
 		 " If it is not specified, host will be %s.\n"
 		 " In all the cases the host can be a hostname or an IP;\n"
 		 " for the service it can be a servicename or a port number.\n"
+		 " The last form is a Unix socket; if the path starts with @\n"
+		 " it is an abstract socket. See man unix(7)\n"
 		 " \n"
 		 " -b <bsz> sets the buffer size of tiburocin\n"
 		 " where <bsz> is a size in bytes of the form:\n"
@@ -250,13 +952,163 @@ void usage(char *argv[]) {
 		 "  - num:num  sets sizes for A->B and B->A buffers\n"
 		 " by default, both buffers are of %i bytes\n"
 		 " \n"
+		 " -g <bsz> lets the buffers grow up to <bsz> (of the form of -b):\n"
+		 " each one starts with the size of -b and it is doubled when its\n"
+		 " producer fills it again and again while the consumer is ready;\n"
+		 " it is halved back when it holds little data for a while.\n"
+		 " The resizes are printed. It is incompatible with -Z\n"
+		 " \n"
+		 " -G <bytes> limits the memory of all the buffers together to\n"
+		 " <bytes>: beyond it the buffers do not grow. It requires -g\n"
+		 " \n"
+		 " -M <mode> sets how the memory of the buffers is allocated:\n"
+		 "  - malloc   from the heap, the default\n"
+		 "  - lazy     committed as it is used and given back to the kernel\n"
+		 "             when the buffer stays empty (MADV_FREE)\n"
+		 "  - thp      like lazy but with transparent huge pages\n"
+		 "  - hugetlb  from the huge pages reserved in the system\n"
+		 " See man madvise(2) and mmap(2)\n"
+		 " \n"
 		 " -z <bsz> sets the buffer size of the sockets\n"
 		 " where <bsz> is a size in bytes of the form:\n"
 		 "  - num      sets the size of both buffers SND and RCV to that value\n"
 		 "  - num:num  sets sizes for SND and RCV buffers\n"
 		 " by default, both buffers are not changed. See man socket(7)\n"
 		 " \n"
-		 " -o save the received data onto two files:\n"
+		 " -t <topt> sets a TCP option in the sockets; it can be repeated\n"
+		 " where <topt> is of the form [A:|B:]<name>[=<num>]:\n"
+		 "  - A: or B: sets the option for that leg only; both legs by default\n"
+		 "  - nodelay, cork, quickack enable (or disable with =0) the option\n"
+		 "  - notsent_lowat=<num>, rcvlowat=<num> set the option in bytes\n"
+		 " by default, the options are not changed. See man tcp(7) and socket(7)\n"
+		 " \n"
+		 " -r <retries> sets how many times tiburoncin tries to connect to B\n"
+		 " where <retries> is of the form tries[:base[:max]]: between each\n"
+		 " try it waits base milliseconds, doubling it each time up to max\n"
+		 " by default, it tries %i times waiting from %i up to %i milliseconds\n"
+		 " All the addresses of B are tried concurrently, %i milliseconds apart\n"
+		 " \n"
+		 " -T <ms> cancels each connection attempt to B after <ms> milliseconds\n"
+		 " by default, the timeout of the operative system is used\n"
+		 " \n"
+		 " -d <ms> keeps the addresses of B resolved for <ms> milliseconds\n"
+		 " so the next connections reuse them; the resolution is done in\n"
+		 " background. By default, they are kept for %i milliseconds\n"
+		 " \n"
+		 " -Z send the data with MSG_ZEROCOPY avoiding the copy to the kernel\n"
+		 " the data is kept in the buffers until the kernel is done with it\n"
+		 " so it is useful only with large buffers (-b). Linux 4.14 or newer\n"
+		 " \n"
+		 " -i <ms> samples the TCP_INFO of both legs every <ms> milliseconds\n"
+		 " and prints the RTT, congestion window, retransmissions, pacing\n"
+		 " and delivery rates and the bytes acknowledged. See man tcp(7)\n"
+		 " \n"
+		 " -q <ms> samples every <ms> milliseconds where the bytes of each\n"
+		 " direction are queued: in the producer's receive queue, in the\n"
+		 " buffer of tiburoncin and in the consumer's send queue\n"
+		 " \n"
+		 " -s <ms> reports a stall when, for longer than <ms> milliseconds,\n"
+		 " the buffer of a direction stays full or its data is not sent;\n"
+		 " the totals are printed at the exit\n"
+		 " \n"
+		 " -n analyzes the sizes of the reads and the gaps between them;\n"
+		 " at the exit, prints their histograms and flags small-write\n"
+		 " patterns like Nagle's algorithm waiting for a delayed ACK\n"
+		 " \n",
+		argv[0], argv[0], DEFAULT_HOST, DEFAULT_BUF_SIZE,
+		copts.tries, copts.backoff_base, copts.backoff_max,
+		copts.attempt_delay, DEFAULT_RESOLVER_TTL_MSECS);
+
+	printf
+		(" -m accepts many connections from A, each one relayed to its own\n"
+		 " connection to B; the endpoints are named A#<n> and B#<n> and the\n"
+		 " output files (-o, -f) are suffixed with .<n>\n"
+		 " \n"
+		 " -p <n> keeps a pool of <n> connections to B (up to %i) established\n"
+		 " in advance and refilled as they are used; it implies -m\n"
+		 " \n"
+		 " -B with a list of addresses (up to %i) spreads the sessions of -m\n"
+		 " among them; -L <policy> selects the backend of each one:\n"
+		 "  - rr     in turn, the default\n"
+		 "  - conns  the one with the fewest sessions\n"
+		 "  - bytes  the one with the fewest bytes in the buffers\n"
+		 " A backend that fails to connect is ejected for a while, doubled\n"
+		 " each time it fails again up to %i seconds. It is incompatible\n"
+		 " with -p\n"
+		 " \n"
+		 " -S <addr> mirrors the data from A to a shadow B at <addr> too;\n"
+		 " its responses are discarded and compared with the ones of B\n"
+		 " at the end. The data stays in the buffer until both B and the\n"
+		 " shadow took it: while the shadow lags behind by -W <bytes> (the\n"
+		 " whole buffer by default) A is not read. It is incompatible with -Z\n"
+		 " \n"
+		 " -j <n> runs <n> worker threads (up to %i), each one accepting\n"
+		 " connections from A on its own socket (SO_REUSEPORT) and relaying\n"
+		 " them with its own pool (-p); the counters of the workers are\n"
+		 " printed and merged on exit. It implies -m\n"
+		 " \n"
+		 " -C <file> relays the routes listed in <file>, one per line of the\n"
+		 " form <name> -A <addr> -B <addr> [<options>] with the options of\n"
+		 " a session (-b, -g, -z, -t, -r, -T, -o, -f, -c, -p...). All of them\n"
+		 " are served by the same event loop (or workers, -j); the names of\n"
+		 " their endpoints and output files are prefixed with <name>.\n"
+		 " Empty lines and lines starting with # are ignored\n"
+		 " \n"
+		 " -P relays the single session with a thread for A and another for B\n"
+		 " so each flow is read by one thread and written by the other one\n"
+		 " and a bulk transfer can use two cores. It is incompatible with\n"
+		 " -m, -p, -j, -u, -Z, -n, -s, -i, -q and -g\n"
+		 " \n"
+		 " -D <ms> drains on SIGTERM: the sessions stop reading from A and\n"
+		 " B (and accepting new ones) but the data in the buffers is still\n"
+		 " sent and then closed as usual, for up to <ms> milliseconds.\n"
+		 " A second signal closes everything right away\n"
+		 " \n"
+		 " -H <path> hands off on restart: a new tiburoncin with the same\n"
+		 " -H <path> (a Unix socket) takes over the listening socket and\n"
+		 " the sessions in flight, with the data in their buffers, from the\n"
+		 " running one which then exits; the clients do not notice it.\n"
+		 " It requires -m and it is incompatible with -C, -j, -u, -Z and -S\n"
+		 " \n"
+		 " -F <fd> accepts the connections from A on the socket <fd>, bound\n"
+		 " and listening already, inherited from the parent process: the\n"
+		 " clients that connect before tiburoncin starts wait in its queue.\n"
+		 " -A is optional then. Without -F, the first socket passed by the\n"
+		 " supervisor is used, if any (LISTEN_FDS, see sd_listen_fds(3)).\n"
+		 " It is incompatible with -C, -u and -H\n"
+		 " \n"
+		 " -k <us> busy polls: the event loop polls the sockets for up to\n"
+		 " <us> microseconds before it sleeps and SO_BUSY_POLL is set on\n"
+		 " them (it may require CAP_NET_ADMIN), trading a busy core for a\n"
+		 " lower latency; see the relay latency of -n. It is incompatible\n"
+		 " with -u and -P\n"
+		 " \n"
+		 " -E <backend> sets how the single session waits for and does\n"
+		 " the reads and writes:\n"
+		 "  - select  waits until the sockets are ready, the default\n"
+		 "  - uring   posts them to an io_uring and waits until they are\n"
+		 "            done, a system call for many of them (see -n).\n"
+		 "            Linux 6.0 or newer\n"
+		 " It is incompatible with -m, -p, -j, -C, -u, -P, -Z, -s, -i, -q,\n"
+		 " -g, -S, -D and -k\n"
+		 " \n"
+		 " -a <cpus> pins the threads that relay the data to the CPUs listed,\n"
+		 " of the form 0,2-3,...: the main thread to the first one and the\n"
+		 " workers (-j) or the threads of -P to the CPUs in turn. Each thread\n"
+		 " touches its buffers first so they are in its NUMA node\n"
+		 " \n"
+		 " -u relays UDP datagrams keeping their boundaries; each source\n"
+		 " address of A is a flow with its own socket to B, named like\n"
+		 " the sessions of -m, and closed after %i seconds without traffic.\n"
+		 " Only -z, -o, -f and -c apply to this mode\n"
+		 " \n",
+		POOL_MAX_SIZE, BALANCER_MAX_BACKENDS,
+		(int)(BALANCER_BACKOFF_MAX_US / 1000000),
+		SERVER_MAX_WORKERS,
+		UDP_FLOW_TIMEOUT_MSECS / 1000);
+
+	printf
+		(" -o save the received data onto two files:\n"
 		 "  %s for the data received from A\n"
 		 "  %s for the data received from B\n"
 		 " in both cases a raw hexdump is saved which can be recovered later\n"
@@ -267,7 +1119,6 @@ void usage(char *argv[]) {
 		 " This option is incompatible with -o option\n"
 		 " \n"
 		 " -c disable the color in the output (colorless)\n",
-		argv[0], DEFAULT_HOST, DEFAULT_BUF_SIZE,
 		DEFAULT_A_TO_B_DUMPFILENAME, DEFAULT_B_TO_A_DUMPFILENAME);
 }
 
@@ -1,14 +1,101 @@
 #ifndef CMDLINE_H_
 #define CMDLINE_H_
 
-struct endpoint;
+#include <stddef.h>
+
+#include "socket.h"
+#include "affinity.h"
+#include "bufalloc.h"
+#include "balancer.h"
+#include "uring.h"
+
+/*
+ * Options of tiburoncin given in the command line.
+ * See usage() for a description of each one.
+ * */
+struct options {
+	size_t buf_sizes[2];
+	enum bufalloc_mode buf_mode;
+
+	/* the buffers grow up to buf_max (0 means they don't) sharing
+	 * buf_budget bytes (0 means no limit) */
+	size_t buf_max[2];
+	size_t buf_budget;
+	size_t skt_buf_sizes[2];
+	struct tcp_tuning tuning[2];
+	struct connect_options copts;
+	char *out_filenames[2];
+	int colorless;
+	int zerocopy;
+
+	/* sampling intervals in milliseconds, 0 means disabled */
+	int tcpinfo_interval;
+	int queues_interval;
+
+	/* stall threshold in milliseconds, 0 means disabled */
+	int stall_threshold;
+
+	int analyze;
+	int multi;
+	int pool_size;
+	int workers;
+	int pipeline;
+
+	/* CPUs to pin the threads to, none if ncpus is 0 */
+	int cpus[AFFINITY_MAX_CPUS];
+	int ncpus;
+	int resolver_ttl;
+	int udp;
+
+	/* how many microseconds the event loop spins before blocking
+	 * (see struct busypoll), 0 means that it blocks right away */
+	int busy_poll;
+
+	/* how the event loop of the single session waits and relays */
+	enum event_backend backend;
+
+	/* deadline in milliseconds of the drain on SIGTERM, 0 means
+	 * that there is no drain: the program is closed right away */
+	int drain_timeout;
+
+	/* the backends of B (the first one is B) among which the
+	 * sessions are balanced, see struct balancer */
+	struct endpoint backends[BALANCER_MAX_BACKENDS];
+	int nbackends;
+	enum balance_policy balance;
+
+	/* the shadow B to mirror the data of A to, none if its host is
+	 * NULL, and how many bytes it can lag behind, 0 if the buffer is
+	 * the only limit (see struct mirror) */
+	struct endpoint shadow;
+	size_t shadow_lag;
+
+	/* the listening socket of A inherited from the parent process
+	 * (see inherit_listening), -1 if there is none */
+	int listen_fd;
+
+	/* the Unix socket to hand off the sessions to a new tiburoncin
+	 * through (see handoff.h), none if it is NULL */
+	char *handoff;
+
+	/* the file of the routes (-C), if any, and the name of the
+	 * route of these options, NULL if they are not of a route */
+	char *config;
+	const char *route;
+};
 
 int parse_cmd_line(int argc, char *argv[], struct endpoint *A,
-		struct endpoint *B, size_t buf_sizes[2],
-		size_t skt_buf_sizes[2], char *out_filenames[2],
-		int *colorless);
+		struct endpoint *B, struct options *opts);
+
+/*
+ * Parse the options of a route (see config_load): like parse_cmd_line
+ * but the options that apply to all the routes are not allowed and
+ * the multiple sessions mode is implied.
+ * */
+int parse_route_cmd_line(int argc, char *argv[], struct endpoint *A,
+		struct endpoint *B, struct options *opts);
 
-void what(char *argv[]);
+void what();
 void usage(char *argv[]);
 
 
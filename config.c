@@ -0,0 +1,191 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "config.h"
+
+/*
+ * Maximum number of words in the line of a route.
+ * */
+#define CONFIG_MAX_WORDS 64
+
+static
+int valid_name(const char *name) {
+	size_t len = strlen(name);
+	if (len == 0 || len > CONFIG_MAX_NAME)
+		return 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_'
+				&& name[i] != '-')
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Prefix the output filename *filename with the name of the route;
+ * if the filename has a directory the prefix goes after it.
+ * */
+static
+int prefix_filename(const char *name, char **filename) {
+	if (!*filename)
+		return 0;
+
+	size_t sz = strlen(name) + strlen(*filename) + 2;
+	char *prefixed = malloc(sz);
+	if (!prefixed)
+		return -1;
+
+	char *slash = strrchr(*filename, '/');
+	int dirlen = slash? (int)(slash - *filename + 1) : 0;
+
+	snprintf(prefixed, sz, "%.*s%s.%s", dirlen, *filename, name,
+			*filename + dirlen);
+	free(*filename);
+	*filename = prefixed;
+	return 0;
+}
+
+/*
+ * Parse the line of a route; the line is owned by the route from now on.
+ * */
+static
+int parse_route(struct route *r, char *line, char *argv0,
+		struct route *routes, int nroutes) {
+	char *argv[CONFIG_MAX_WORDS + 1];
+	int argc = 0;
+	char *saveptr;
+
+	memset(r, 0, sizeof(*r));
+	r->line = line;
+	r->name = strtok_r(line, " \t\r\n", &saveptr);
+
+	if (!valid_name(r->name)) {
+		fprintf(stderr, "Invalid route name '%s'.\n", r->name);
+		return -1;
+	}
+
+	for (int i = 0; i < nroutes; ++i) {
+		if (strcmp(routes[i].name, r->name) == 0) {
+			fprintf(stderr, "Duplicated route name '%s'.\n", r->name);
+			return -1;
+		}
+	}
+
+	/* the options are parsed as a command line */
+	argv[argc++] = argv0;
+	for (char *w; (w = strtok_r(NULL, " \t\r\n", &saveptr)); ) {
+		if (argc == CONFIG_MAX_WORDS) {
+			fprintf(stderr, "Too many options in the route '%s'.\n", r->name);
+			return -1;
+		}
+
+		argv[argc++] = w;
+	}
+	argv[argc] = NULL;
+
+	if (parse_route_cmd_line(argc, argv, &r->A, &r->B, &r->opts) != 0) {
+		fprintf(stderr, "Invalid options in the route '%s'.\n", r->name);
+		return -1;
+	}
+
+	r->opts.route = r->name;
+	if (prefix_filename(r->name, &r->opts.out_filenames[0]) != 0
+		|| prefix_filename(r->name, &r->opts.out_filenames[1]) != 0) {
+		perror("Output filenames allocation failed");
+		return -1;
+	}
+
+	r->colors[0] = r->opts.colorless? NULL : "\x1b[91m";
+	r->colors[1] = r->opts.colorless? NULL : "\x1b[94m";
+	return 0;
+}
+
+static
+void route_free(struct route *r) {
+	free(r->opts.out_filenames[0]);
+	free(r->opts.out_filenames[1]);
+	free(r->line);
+}
+
+int config_load(const char *path, char *argv0, struct route **routes,
+		int *nroutes) {
+	struct route *rs = NULL;
+	int n = 0;
+	int lineno = 0;
+
+	char *line = NULL;
+	size_t sz = 0;
+
+	FILE *f = fopen(path, "rt");
+	if (!f) {
+		perror("Open the routes' file failed");
+		return -1;
+	}
+
+	while (getline(&line, &sz, f) != -1) {
+		lineno += 1;
+
+		char *p = line;
+		while (isspace((unsigned char)*p))
+			++p;
+
+		if (*p == 0 || *p == '#')
+			continue;
+
+		struct route *more = realloc(rs, (n + 1) * sizeof(*rs));
+		if (!more) {
+			perror("Routes allocation failed");
+			goto failed;
+		}
+		rs = more;
+
+		/* the route keeps the line, take a new one for the next */
+		if (parse_route(&rs[n], line, argv0, rs, n) != 0) {
+			fprintf(stderr, "%s:%i: invalid route.\n", path, lineno);
+			route_free(&rs[n]);
+			line = NULL;
+			goto failed;
+		}
+
+		n += 1;
+		line = NULL;
+		sz = 0;
+	}
+
+	if (ferror(f)) {
+		perror("Read the routes' file failed");
+		goto failed;
+	}
+
+	if (n == 0) {
+		fprintf(stderr, "There are no routes in %s.\n", path);
+		goto failed;
+	}
+
+	free(line);
+	fclose(f);
+
+	*routes = rs;
+	*nroutes = n;
+	return 0;
+
+failed:
+	free(line);
+	fclose(f);
+	config_free(rs, n);
+	return -1;
+}
+
+void config_free(struct route *routes, int nroutes) {
+	for (int i = 0; i < nroutes; ++i)
+		route_free(&routes[i]);
+
+	free(routes);
+}
@@ -0,0 +1,51 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include "endpoint.h"
+#include "cmdline.h"
+
+/*
+ * Maximum length of the name of a route.
+ * */
+#define CONFIG_MAX_NAME 15
+
+/* struct route: a pair of A and B relayed in the multiple sessions
+ * mode with its own options (see server_run).
+ *
+ * The routes come from a file (see config_load) or, without it, there
+ * is a single route made of the command line; its name is NULL.
+ * */
+struct route {
+	const char *name;
+	struct endpoint A;
+	struct endpoint B;
+	struct options opts;
+	const char *colors[2];
+
+	/* the line of the route: A, B and the options point to it */
+	char *line;
+};
+
+/*
+ * Load the routes of the file path: one per line, of the form
+ *
+ *	<name> -A <addr> -B <addr> [<options>]
+ *
+ * where the options are the ones of the command line that apply to
+ * a session (see parse_route_cmd_line) separated by blanks. The empty
+ * lines and the ones starting with # are ignored.
+ *
+ * The output files (-o, -f) of each route are prefixed with its
+ * name: [<dir>/]<name>.<filename>
+ *
+ * Set *routes to an array of *nroutes routes that the caller must
+ * free with config_free.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int config_load(const char *path, char *argv0, struct route **routes,
+		int *nroutes);
+
+void config_free(struct route *routes, int nroutes);
+
+#endif
@@ -111,3 +111,89 @@ def check_transfer(src, dst):
             return
 
     print("mismatch!!")
+
+
+def echo_server(listen_on, family=socket.AF_INET, transform=None):
+    ''' Listen on the given port (or Unix socket path) and echo back
+        what each connection sends, each one in its own thread,
+        until the connection is shutdown for writing.
+        If given, the data echoed is transform(data) instead. '''
+    import threading
+
+    srv = socket.socket(family)
+    if family == socket.AF_INET:
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(('127.0.0.1', int(listen_on)))
+    else:
+        srv.bind(listen_on)
+    srv.listen(16)
+
+    def echo(skt):
+        while True:
+            chunk = skt.recv(65536)
+            if not chunk:
+                break
+            skt.sendall(transform(chunk) if transform else chunk)
+        skt.shutdown(socket.SHUT_WR)
+        skt.close()
+
+    def serve():
+        while True:
+            try:
+                skt, _ = srv.accept()
+            except OSError:
+                return
+            threading.Thread(target=echo, args=(skt,), daemon=True).start()
+
+    threading.Thread(target=serve, daemon=True).start()
+    return srv
+
+
+def connect(connect_to, family=socket.AF_INET, timeout=2):
+    ''' Connect to the given port (or Unix socket path) retrying
+        until it is listening or the timeout expires. '''
+    address = ('127.0.0.1', int(connect_to)) if family == socket.AF_INET \
+                else connect_to
+
+    deadline = time.time() + timeout
+    while True:
+        skt = socket.socket(family)
+        try:
+            skt.connect(address)
+            return skt
+        except OSError:
+            skt.close()
+            if time.time() > deadline:
+                raise
+            time.sleep(0.05)
+
+
+def roundtrip(connect_to, size, family=socket.AF_INET):
+    ''' Send size random bytes to an echo server through the given
+        port (or Unix socket path), shutdown for writing and read the
+        echo until the end. Print if all of it came back. '''
+    import threading, os
+
+    data = os.urandom(size)
+    skt = connect(connect_to, family)
+
+    echoed = []
+    def reader():
+        while True:
+            chunk = skt.recv(65536)
+            if not chunk:
+                break
+            echoed.append(chunk)
+
+    th = threading.Thread(target=reader)
+    th.start()
+    skt.sendall(data)
+    skt.shutdown(socket.SHUT_WR)
+    th.join(30)
+    skt.close()
+
+    echoed = b''.join(echoed)
+    if echoed == data:
+        print("%d bytes echoed correctly." % len(data))
+    else:
+        print("%d bytes sent but %d bytes echoed!!" % (len(data), len(echoed)))
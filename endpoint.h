@@ -7,6 +7,7 @@ struct endpoint {
 
 	int fd;
 	int eof;
+	int quickack;
 };
 
 #endif
@@ -0,0 +1,421 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "handoff.h"
+#include "relay.h"
+#include "socket.h"
+#include "resolver.h"
+#include "adapt.h"
+
+#include "signal.h"
+
+#define HANDOFF_MAGIC 0x54494255u /* TIBU */
+#define HANDOFF_VERSION 1u
+#define HANDOFF_ACK 'K'
+
+struct handoff_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nsessions;
+	uint32_t next_id;
+};
+
+/*
+ * Bound the time that the blocking operations on the socket can take
+ * (see HANDOFF_TIMEOUT_MSECS).
+ * */
+static
+int set_timeouts(int fd) {
+	struct timeval tv = {
+		.tv_sec = HANDOFF_TIMEOUT_MSECS / 1000,
+		.tv_usec = (HANDOFF_TIMEOUT_MSECS % 1000) * 1000
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Close the socket fd on error keeping the errno.
+ * */
+static
+int close_on_error(int fd) {
+	int s;
+	int last_errno = errno;
+	EINTR_RETRY(close(fd));
+	errno = last_errno;
+	return -1;
+}
+
+int handoff_listen(const char *path) {
+	struct endpoint ep;
+	size_t skt_buf_sizes[2] = {0, 0};
+
+	memset(&ep, 0, sizeof(ep));
+	ep.host = RESOLVER_UNIX_HOST;
+	ep.serv = (char*)path;
+
+	if (set_listening(&ep, skt_buf_sizes, 1, false) != 0)
+		return -1;
+
+	return ep.fd;
+}
+
+void handoff_unlink(const char *path) {
+	struct endpoint ep;
+
+	memset(&ep, 0, sizeof(ep));
+	ep.host = RESOLVER_UNIX_HOST;
+	ep.serv = (char*)path;
+
+	unlink_listening(&ep);
+}
+
+int handoff_connect(const char *path) {
+	int s;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	if (resolver_unix_address(path, &addr, &addrlen) != 0)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	EINTR_RETRY(connect(fd, (struct sockaddr*) &addr, addrlen));
+	if (s == -1 || set_timeouts(fd) != 0)
+		return close_on_error(fd);
+
+	return fd;
+}
+
+int handoff_accept(int listener) {
+	int s;
+	EINTR_RETRY(accept(listener, NULL, NULL));
+	if (s == -1)
+		return -1;
+
+	int fd = s;
+	if (set_timeouts(fd) != 0)
+		return close_on_error(fd);
+
+	return fd;
+}
+
+/*
+ * Send all the sz bytes of data with the nfds file descriptors fds
+ * attached, if any.
+ * */
+static
+int send_all(int fd, const void *data, size_t sz, int *fds, int nfds) {
+	int s;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+		struct cmsghdr align;
+	} ctl;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void*)data;
+	iov.iov_len = sz;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds) {
+		memset(&ctl, 0, sizeof(ctl));
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	/* the descriptors go with the first bytes only */
+	const char *p = data;
+	while (sz) {
+		EINTR_RETRY(sendmsg(fd, &msg, 0));
+		if (s == -1)
+			return -1;
+
+		p += s;
+		sz -= s;
+		iov.iov_base = (void*)p;
+		iov.iov_len = sz;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive all the sz bytes of data and the nfds file descriptors
+ * attached to them (fds may be NULL if nfds is 0).
+ * */
+static
+int recv_all(int fd, void *data, size_t sz, int *fds, int nfds) {
+	int s;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+		struct cmsghdr align;
+	} ctl;
+	int got = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = sz;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	char *p = data;
+	while (sz) {
+		EINTR_RETRY(recvmsg(fd, &msg, 0));
+		if (s == -1)
+			goto failed;
+
+		if (s == 0) {
+			errno = ECONNRESET;
+			goto failed;
+		}
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET
+					|| cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+
+			int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int *received = (int*)CMSG_DATA(cmsg);
+			for (int i = 0; i < n; ++i) {
+				if (got < nfds)
+					fds[got++] = received[i];
+				else
+					EINTR_RETRY(close(received[i]));
+			}
+		}
+
+		p += s;
+		sz -= s;
+		iov.iov_base = p;
+		iov.iov_len = sz;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+	}
+
+	if (got == nfds)
+		return 0;
+
+	errno = EPROTO;
+
+failed:
+	{
+		int last_errno = errno;
+		for (int i = 0; i < got; ++i)
+			EINTR_RETRY(close(fds[i]));
+		errno = last_errno;
+	}
+	return -1;
+}
+
+int handoff_send_hello(int fd, int listener, unsigned int nsessions,
+		unsigned int next_id) {
+	struct handoff_hello hello = {
+		.magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+		.nsessions = nsessions, .next_id = next_id
+	};
+
+	return send_all(fd, &hello, sizeof(hello), &listener, 1);
+}
+
+int handoff_recv_hello(int fd, int *listener, unsigned int *nsessions,
+		unsigned int *next_id) {
+	int s;
+	struct handoff_hello hello;
+
+	if (recv_all(fd, &hello, sizeof(hello), listener, 1) != 0)
+		return -1;
+
+	if (hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION) {
+		EINTR_RETRY(close(*listener));
+		errno = EPROTO;
+		return -1;
+	}
+
+	*nsessions = hello.nsessions;
+	*next_id = hello.next_id;
+	return 0;
+}
+
+/*
+ * Send the data of the buffer: from the tail and then, if it wraps
+ * around, from the begin.
+ * */
+static
+int send_buffer(int fd, struct circular_buffer_t *b) {
+	size_t total = circular_buffer_get_total_ready(b);
+	size_t ready = circular_buffer_get_ready(b);
+
+	if (ready && send_all(fd, &b->buf[b->tail], ready, NULL, 0) != 0)
+		return -1;
+
+	if (total > ready && send_all(fd, b->buf, total - ready, NULL, 0) != 0)
+		return -1;
+
+	return 0;
+}
+
+int handoff_send_session(int fd, struct session *ss) {
+	struct flow *flows[2] = { &ss->AtoB, &ss->BtoA };
+	struct handoff_session hs;
+	int fds[2] = { ss->A.fd, ss->B.fd };
+
+	memset(&hs, 0, sizeof(hs));
+	hs.id = ss->id;
+	hs.backend = ss->backend;
+	hs.eof[0] = ss->A.eof;
+	hs.eof[1] = ss->B.eof;
+
+	for (int i = 0; i < 2; ++i) {
+		hs.status[i] = flows[i]->status;
+		hs.ready[i] = circular_buffer_get_total_ready(&flows[i]->buf);
+		hs.offsets[i][0] = flows[i]->hd.offset;
+		hs.offsets[i][1] = flows[i]->hd.offset_consumer;
+
+		/* the new tiburoncin appends to the same output files */
+		if (flows[i]->hd.out_file)
+			fflush(flows[i]->hd.out_file);
+	}
+
+	if (send_all(fd, &hs, sizeof(hs), fds, 2) != 0
+			|| send_buffer(fd, &ss->AtoB.buf) != 0
+			|| send_buffer(fd, &ss->BtoA.buf) != 0)
+		return -1;
+
+	return 0;
+}
+
+int handoff_send_pending(int fd, unsigned int id, int backend,
+		struct endpoint *A) {
+	struct handoff_session hs;
+
+	memset(&hs, 0, sizeof(hs));
+	hs.id = id;
+	hs.backend = backend;
+	hs.pending = 1;
+	hs.eof[0] = A->eof;
+
+	return send_all(fd, &hs, sizeof(hs), &A->fd, 1);
+}
+
+int handoff_recv_session(int fd, struct handoff_session *hs,
+		struct endpoint *A, struct endpoint *B) {
+	int s;
+	int fds[2];
+
+	/* peek the header first to know how many sockets come */
+	EINTR_RETRY(recv(fd, hs, sizeof(hs->id) + sizeof(hs->pending),
+				MSG_PEEK | MSG_WAITALL));
+	if (s != (int)(sizeof(hs->id) + sizeof(hs->pending))) {
+		errno = s == -1? errno : ECONNRESET;
+		return -1;
+	}
+
+	int nfds = hs->pending? 1 : 2;
+	if (recv_all(fd, hs, sizeof(*hs), fds, nfds) != 0)
+		return -1;
+
+	memset(A, 0, sizeof(*A));
+	A->fd = fds[0];
+	A->eof = hs->eof[0];
+
+	if (!hs->pending) {
+		memset(B, 0, sizeof(*B));
+		B->fd = fds[1];
+		B->eof = hs->eof[1];
+	}
+
+	return 0;
+}
+
+/*
+ * Receive sz bytes into the empty buffer b of the flow f, growing it
+ * if they do not fit.
+ * */
+static
+int recv_buffer(int fd, struct flow *f, size_t sz) {
+	struct circular_buffer_t *b = &f->buf;
+
+	if (sz > b->sz) {
+		size_t old_sz = b->sz;
+		if (circular_buffer_resize(b, sz) != 0)
+			return -1;
+
+		if (f->ad)
+			adapt_charge(b->sz - old_sz);
+	}
+
+	if (sz && recv_all(fd, b->buf, sz, NULL, 0) != 0)
+		return -1;
+
+	circular_buffer_advance_head(b, sz);
+	return 0;
+}
+
+int handoff_recv_buffers(int fd, struct handoff_session *hs,
+		struct session *ss) {
+	struct flow *flows[2] = { &ss->AtoB, &ss->BtoA };
+
+	for (int i = 0; i < 2; ++i) {
+		struct flow *f = flows[i];
+		if (recv_buffer(fd, f, hs->ready[i]) != 0)
+			return -1;
+
+		f->status = hs->status[i];
+		f->hd.offset = hs->offsets[i][0];
+		f->hd.offset_consumer = hs->offsets[i][1];
+		f->consumed = f->hd.offset_consumer;
+		f->idle_offset = f->hd.offset;
+	}
+
+	return 0;
+}
+
+int handoff_send_ack(int fd) {
+	char ack = HANDOFF_ACK;
+	return send_all(fd, &ack, 1, NULL, 0);
+}
+
+int handoff_recv_ack(int fd) {
+	char ack;
+	if (recv_all(fd, &ack, 1, NULL, 0) != 0)
+		return -1;
+
+	if (ack != HANDOFF_ACK) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
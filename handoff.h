@@ -0,0 +1,126 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <stdint.h>
+
+#include "endpoint.h"
+
+struct session;
+
+/*
+ * How long a handoff waits for the other tiburoncin at each step before
+ * it gives up.
+ * */
+#define HANDOFF_TIMEOUT_MSECS 5000
+
+/*
+ * The handoff of a running tiburoncin to a new one, both with
+ * -H <path>, so the options can be changed without closing the
+ * connections in flight.
+ *
+ * The running tiburoncin listens on the Unix socket <path>; the new
+ * one connects to it and the running one sends, in order:
+ *
+ *  - the hello: the number of sessions and the next session id with
+ *    the listening socket of A (see SCM_RIGHTS in unix(7))
+ *  - each session: its state (struct handoff_session) with the sockets
+ *    of A and B followed by the data in its buffers, A -> B first;
+ *    a connection from A still waiting for B (pending) has no B
+ *    nor data
+ *
+ * The new one answers with an ack once it has all of them and only
+ * then the running one closes its copies of the sockets (without
+ * shutting them down, see shutdown(2)) and exits. Without the ack
+ * it keeps relaying as if nothing had happened.
+ * */
+struct handoff_session {
+	uint32_t id;
+	uint32_t pending;
+
+	/* the backend of B (see struct balancer) */
+	uint32_t backend;
+
+	/* the eof of A and B and the status of A -> B and B -> A */
+	uint32_t eof[2];
+	uint32_t status[2];
+
+	/* the bytes in the buffers and the offsets of the hexdumps
+	 * (produced and consumed) of A -> B and B -> A */
+	uint64_t ready[2];
+	uint64_t offsets[2][2];
+};
+
+/*
+ * Listen on the Unix socket path for a new tiburoncin; a stale
+ * socket file is replaced (see set_listening).
+ *
+ * Return the listening socket or -1 on error (errno is set
+ * appropriately).
+ * */
+int handoff_listen(const char *path);
+
+/*
+ * Remove the file of the Unix socket path (see handoff_listen): by
+ * the tiburoncin that listened on it when it stops listening without
+ * handing off and by the one that took over, which listens on it
+ * next, as the previous one may be still there.
+ * */
+void handoff_unlink(const char *path);
+
+/*
+ * Connect to the tiburoncin that listens on the Unix socket path.
+ * The socket returned is blocking.
+ *
+ * Return the connected socket or -1 if there is none or on error
+ * (errno is set appropriately).
+ * */
+int handoff_connect(const char *path);
+
+/*
+ * Accept the connection of the new tiburoncin; the socket returned is
+ * blocking. Return -1 on error (errno is set appropriately).
+ * */
+int handoff_accept(int listener);
+
+/*
+ * Send (receive) the hello of the handoff through the socket fd.
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int handoff_send_hello(int fd, int listener, unsigned int nsessions,
+		unsigned int next_id);
+int handoff_recv_hello(int fd, int *listener, unsigned int *nsessions,
+		unsigned int *next_id);
+
+/*
+ * Send the session ss (the pending connection from A of the given id
+ * and backend) through the socket fd.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int handoff_send_session(int fd, struct session *ss);
+int handoff_send_pending(int fd, unsigned int id, int backend,
+		struct endpoint *A);
+
+/*
+ * Receive the state of a session and its sockets into hs, A and B
+ * (B only if it is not a pending connection).
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int handoff_recv_session(int fd, struct handoff_session *hs,
+		struct endpoint *A, struct endpoint *B);
+
+/*
+ * Receive the data of the buffers of the session described by hs
+ * into the session ss, already initialized (see session_init), and
+ * restore its state. The buffers grow if the data does not fit.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int handoff_recv_buffers(int fd, struct handoff_session *hs,
+		struct session *ss);
+
+int handoff_send_ack(int fd);
+int handoff_recv_ack(int fd);
+
+#endif
@@ -1,11 +1,15 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "hexdump.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
-int hexdump_init(struct hexdump *hd, const char *from, const char *to,
-		const char *color_escape, const char *out_filename) {
+static
+int hexdump_open(struct hexdump *hd, const char *from, const char *to,
+		const char *color_escape, const char *out_filename,
+		const char *mode) {
 	memset(hd, 0, sizeof(*hd));
 	hd->from = from;
 	hd->to = to;
@@ -14,13 +18,23 @@ int hexdump_init(struct hexdump *hd, const char *from, const char *to,
 	if (!out_filename)
 		return 0;
 
-	hd->out_file = fopen(out_filename, "wt");
+	hd->out_file = fopen(out_filename, mode);
 	if (!hd->out_file)
 		return -1;
 
 	return 0;
 }
 
+int hexdump_init(struct hexdump *hd, const char *from, const char *to,
+		const char *color_escape, const char *out_filename) {
+	return hexdump_open(hd, from, to, color_escape, out_filename, "wt");
+}
+
+int hexdump_init_append(struct hexdump *hd, const char *from, const char *to,
+		const char *color_escape, const char *out_filename) {
+	return hexdump_open(hd, from, to, color_escape, out_filename, "at");
+}
+
 void hexdump_destroy(struct hexdump *hd) {
 	if (hd->out_file)
 		fclose(hd->out_file);
@@ -105,6 +119,8 @@ void hexdump_sent_print(struct hexdump *hd, const char *buf, unsigned int sz) {
 	if (!sz)
 		return;
 
+	/* do not mix the lines with the output of other threads */
+	flockfile(stdout);
 	if (hd->color_escape)
 		printf("%s", hd->color_escape);
 
@@ -133,9 +149,11 @@ void hexdump_sent_print(struct hexdump *hd, const char *buf, unsigned int sz) {
 	if (hd->color_escape)
 		printf("%s", "\x1b[0m"); /* reset */
 	fflush(stdout);
+	funlockfile(stdout);
 }
 
 void hexdump_remain_print(struct hexdump *hd, unsigned int sz_consumed) {
+	flockfile(stdout);
 	if (hd->color_escape)
 		printf("%s", hd->color_escape);
 
@@ -152,9 +170,11 @@ void hexdump_remain_print(struct hexdump *hd, unsigned int sz_consumed) {
 	if (hd->color_escape)
 		printf("%s", "\x1b[0m"); /* reset */
 	fflush(stdout);
+	funlockfile(stdout);
 }
 
 void hexdump_shutdown_print(struct hexdump *hd) {
+	flockfile(stdout);
 	if (hd->color_escape)
 		printf("%s", hd->color_escape);
 
@@ -163,4 +183,5 @@ void hexdump_shutdown_print(struct hexdump *hd) {
 	if (hd->color_escape)
 		printf("%s", "\x1b[0m"); /* reset */
 	fflush(stdout);
+	funlockfile(stdout);
 }
@@ -15,6 +15,8 @@ struct hexdump {
 
 int hexdump_init(struct hexdump *hd, const char *from, const char *to,
 		const char *color_escape, const char *out_filename);
+int hexdump_init_append(struct hexdump *hd, const char *from, const char *to,
+		const char *color_escape, const char *out_filename);
 void hexdump_sent_print(struct hexdump *hd, const char *buf, unsigned int sz);
 void hexdump_remain_print(struct hexdump *hd, unsigned int sz);
 void hexdump_shutdown_print(struct hexdump *hd);
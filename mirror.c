@@ -0,0 +1,303 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mirror.h"
+#include "cmdline.h"
+
+/*
+ * How many bytes of the responses of the shadow are read at once;
+ * they are discarded so they do not need a buffer of their own.
+ * */
+#define MIRROR_READ_SZ 4096
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static
+uint64_t hash_update(uint64_t h, const char *data, size_t sz) {
+	for (size_t i = 0; i < sz; ++i) {
+		h ^= (unsigned char)data[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+void mirror_init(struct mirror *m, struct endpoint *A,
+		struct circular_buffer_t *buf, struct options *opts,
+		const char *from, const char *name, const char *color_escape,
+		long long start, long long now) {
+	memset(m, 0, sizeof(*m));
+	m->A = A;
+	m->S.host = opts->shadow.host;
+	m->S.serv = opts->shadow.serv;
+	m->S.fd = -1;
+	m->buf = buf;
+	m->lag = opts->shadow_lag;
+	m->from = from;
+	m->color_escape = color_escape;
+	m->start = start;
+	m->hashes[0] = m->hashes[1] = FNV_OFFSET;
+	snprintf(m->name, sizeof(m->name), "%s", name);
+
+	m->state = MIRROR_CONNECTING;
+	connector_start(&m->c, &m->S, opts->skt_buf_sizes, &opts->tuning[1],
+			&opts->copts, now);
+}
+
+/*
+ * The data of A is kept for the shadow until it is sent to it.
+ * */
+static
+bool mirror_holds(struct mirror *m) {
+	return (m->state == MIRROR_CONNECTING || m->state == MIRROR_OPEN)
+		&& !is_write_eof(&m->S);
+}
+
+/*
+ * How many bytes are in the buffer and were not sent to the shadow.
+ * */
+static
+size_t mirror_get_shadow_unsent(struct mirror *m) {
+	return circular_buffer_get_total_ready(m->buf) - m->sent[1];
+}
+
+/*
+ * Discard from the buffer the data sent to both B and the shadow
+ * (to B only if the shadow is not held any more).
+ * */
+static
+void mirror_advance(struct mirror *m) {
+	if (!mirror_holds(m))
+		m->sent[1] = circular_buffer_get_total_ready(m->buf);
+
+	size_t n = m->sent[0] < m->sent[1]? m->sent[0] : m->sent[1];
+	m->sent[0] -= n;
+	m->sent[1] -= n;
+
+	/* the data may wrap around the end of the buffer */
+	while (n) {
+		size_t ready = circular_buffer_get_ready(m->buf);
+		if (ready > n)
+			ready = n;
+
+		circular_buffer_advance_tail(m->buf, ready);
+		n -= ready;
+	}
+}
+
+size_t mirror_get_free(struct mirror *m) {
+	size_t room = circular_buffer_get_free(m->buf);
+	if (!m->lag || !mirror_holds(m))
+		return room;
+
+	size_t behind = mirror_get_shadow_unsent(m);
+	if (behind >= m->lag)
+		return 0;
+
+	return room < m->lag - behind? room : m->lag - behind;
+}
+
+size_t mirror_get_unsent(struct mirror *m) {
+	return circular_buffer_get_total_ready(m->buf) - m->sent[0];
+}
+
+size_t mirror_get_ready(struct mirror *m, size_t *pos) {
+	return circular_buffer_get_ready_after(m->buf, m->sent[0], pos);
+}
+
+void mirror_consumed(struct mirror *m, size_t s) {
+	m->sent[0] += s;
+	mirror_advance(m);
+}
+
+static
+void mirror_print(struct mirror *m, long long now, const char *what,
+		const char *reason) {
+	flockfile(stdout);
+	if (m->color_escape)
+		printf("%s", m->color_escape);
+
+	printf("[%10.3f] %s -> %s mirror %s%s%s\n", (now - m->start) / 1000000.0,
+			m->from, m->name, what, reason? ": " : "",
+			reason? reason : "");
+
+	if (m->color_escape)
+		printf("%s", "\x1b[0m"); /* reset */
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+/*
+ * Stop mirroring: the data not sent to the shadow and the data to
+ * come is dropped and the buffer is B's only.
+ * */
+static
+void mirror_drop(struct mirror *m, long long now, const char *reason) {
+	if (mirror_holds(m))
+		m->dropped += mirror_get_shadow_unsent(m);
+
+	if (m->state == MIRROR_CONNECTING)
+		connector_cancel(&m->c);
+	else if (m->state == MIRROR_OPEN)
+		shutdown_and_close(&m->S);
+
+	m->state = MIRROR_DROPPED;
+	mirror_advance(m);
+	mirror_print(m, now, "dropped", reason);
+}
+
+void mirror_fill(struct mirror *m, fd_set *rfds, fd_set *wfds, int *nfds,
+		long long *deadline) {
+	if (m->state == MIRROR_CONNECTING) {
+		connector_fill(&m->c, rfds, wfds, nfds, deadline);
+		return;
+	}
+
+	if (m->state != MIRROR_OPEN)
+		return;
+
+	/* A is done and the shadow has all its data: let it know */
+	if (is_read_eof(m->A) && !mirror_get_shadow_unsent(m)
+			&& !is_write_eof(&m->S)) {
+		partial_shutdown(&m->S, SHUT_WR);
+		mirror_advance(m);
+	}
+
+	if (!is_read_eof(&m->S))
+		FD_SET(m->S.fd, rfds);
+
+	if (mirror_get_shadow_unsent(m) && !is_write_eof(&m->S))
+		FD_SET(m->S.fd, wfds);
+
+	if (m->S.fd >= *nfds)
+		*nfds = m->S.fd + 1;
+}
+
+/*
+ * Complete the connection to the shadow.
+ * */
+static
+void mirror_connect(struct mirror *m, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	enum connector_state state = connector_process(&m->c, rfds, wfds, now);
+
+	if (state == CONNECTOR_FAILED) {
+		mirror_drop(m, now, strerror(m->c.last_errno));
+		return;
+	}
+
+	if (state != CONNECTOR_DONE)
+		return;
+
+	m->S.fd = m->c.fd;
+	m->S.eof = 0;
+	m->S.quickack = 0;
+	m->state = MIRROR_OPEN;
+	m->connected = true;
+
+	/* we use select(2) so we cannot handle higher descriptors */
+	if (m->S.fd >= FD_SETSIZE)
+		mirror_drop(m, now, "too many connections");
+}
+
+void mirror_process(struct mirror *m, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	int s;
+
+	if (m->state == MIRROR_CONNECTING) {
+		mirror_connect(m, rfds, wfds, now);
+		return;
+	}
+
+	if (m->state != MIRROR_OPEN)
+		return;
+
+	if (FD_ISSET(m->S.fd, wfds)) {
+		size_t pos;
+		size_t ready = circular_buffer_get_ready_after(m->buf, m->sent[1],
+				&pos);
+		EINTR_RETRY(write(m->S.fd, &m->buf->buf[pos], ready));
+
+		if (s < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			mirror_drop(m, now, strerror(errno));
+			return;
+		}
+
+		if (s > 0) {
+			m->mirrored += s;
+			m->sent[1] += s;
+			mirror_advance(m);
+		}
+	}
+
+	if (FD_ISSET(m->S.fd, rfds)) {
+		char data[MIRROR_READ_SZ];
+		EINTR_RETRY(read(m->S.fd, data, sizeof(data)));
+
+		if (s < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			mirror_drop(m, now, strerror(errno));
+			return;
+		}
+
+		if (s == 0) {
+			partial_shutdown(&m->S, SHUT_RD);
+		}
+		else if (s > 0) {
+			m->responses[1] += s;
+			m->hashes[1] = hash_update(m->hashes[1], data, s);
+		}
+	}
+
+	if (is_read_eof(&m->S) && is_write_eof(&m->S)) {
+		EINTR_RETRY(close(m->S.fd));
+		m->state = MIRROR_CLOSED;
+	}
+}
+
+void mirror_record(struct mirror *m, struct endpoint *producer,
+		const char *data, size_t sz) {
+	if (producer != m->A) {
+		m->responses[0] += sz;
+		m->hashes[0] = hash_update(m->hashes[0], data, sz);
+		return;
+	}
+
+	/* else it is in the buffer, see struct mirror */
+	if (!mirror_holds(m))
+		m->dropped += sz;
+}
+
+void mirror_summary_print(struct mirror *m) {
+	unsigned long long unsent = mirror_holds(m)?
+				mirror_get_shadow_unsent(m) : 0;
+
+	printf("Mirror %s -> %s: %llu bytes mirrored, %llu bytes not mirrored; "
+			"%llu bytes of responses from B and %llu from the shadow",
+			m->from, m->name, m->mirrored, m->dropped + unsent,
+			m->responses[0], m->responses[1]);
+
+	if (!m->connected)
+		printf(", shadow unreachable, not compared\n");
+	else if (m->state == MIRROR_DROPPED)
+		printf(", not compared (dropped)\n");
+	else if (m->responses[0] == m->responses[1]
+			&& m->hashes[0] == m->hashes[1])
+		printf(", identical\n");
+	else
+		printf(", different\n");
+}
+
+void mirror_destroy(struct mirror *m) {
+	if (m->state == MIRROR_CONNECTING)
+		connector_cancel(&m->c);
+	else if (m->state == MIRROR_OPEN)
+		shutdown_and_close(&m->S);
+}
@@ -0,0 +1,140 @@
+#ifndef MIRROR_H_
+#define MIRROR_H_
+
+#include <sys/select.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "endpoint.h"
+#include "socket.h"
+#include "circular_buffer.h"
+
+struct options;
+
+/*
+ * State of the mirror:
+ *  - MIRROR_CONNECTING while the connection to the shadow is
+ *	in progress (see struct connector)
+ *  - MIRROR_OPEN while the data of A is sent to the shadow
+ *  - MIRROR_CLOSED once the shadow was shutdown in both directions
+ *  - MIRROR_DROPPED if the connection to the shadow or the shadow
+ *	failed: the rest of the data is not mirrored
+ * */
+enum mirror_state {
+	MIRROR_CONNECTING,
+	MIRROR_OPEN,
+	MIRROR_CLOSED,
+	MIRROR_DROPPED
+};
+
+/* struct mirror: a copy of the A -> B flow of a session sent to
+ * a shadow B.
+ *
+ * The shadow is a second consumer of the buffer of A -> B: the data
+ * is not copied but sent to B and to the shadow from the same buffer,
+ * each one from its own position. The tail of the buffer is the data
+ * not sent to one of them yet, whichever is behind; sent[0] and
+ * sent[1] are how many bytes after the tail were sent to B and to
+ * the shadow respectively (one of them is always 0).
+ *
+ * While the shadow lags behind by lag bytes (0 if there is no
+ * limit other than the buffer), A is not read until it catches up
+ * (see mirror_get_free). Once the mirror is dropped or closed the
+ * buffer is B's only.
+ *
+ * The responses of the shadow are read and discarded; they are only
+ * compared with the ones of B by their size and hash at the end.
+ * */
+struct mirror {
+	struct endpoint *A;
+	struct endpoint S;
+	struct connector c;
+	enum mirror_state state;
+
+	/* the connection to the shadow was established */
+	bool connected;
+
+	struct circular_buffer_t *buf;
+	size_t sent[2];
+	size_t lag;
+
+	char name[32];
+	const char *from;
+	const char *color_escape;
+	long long start;
+
+	/* counters, see mirror_summary_print */
+	unsigned long long mirrored;
+	unsigned long long dropped;
+	unsigned long long responses[2];
+	uint64_t hashes[2];
+};
+
+/*
+ * Initialize the mirror of the flow from A (named from), with the
+ * buffer buf, to the shadow of opts (named name) and start connecting
+ * to it at time now.
+ *
+ * The mirror keeps references to the endpoint A, the buffer and the
+ * options so they must outlive it.
+ * */
+void mirror_init(struct mirror *m, struct endpoint *A,
+		struct circular_buffer_t *buf, struct options *opts,
+		const char *from, const char *name, const char *color_escape,
+		long long start, long long now);
+
+/*
+ * Set the file descriptors to wait for in rfds and wfds and update
+ * *nfds (highest file descriptor plus one) and *deadline.
+ * */
+void mirror_fill(struct mirror *m, fd_set *rfds, fd_set *wfds, int *nfds,
+		long long *deadline);
+
+/*
+ * Connect to, write to and read from the shadow as ready in rfds
+ * and wfds. The shadow is never an error of the session: if it
+ * fails, the mirror is dropped.
+ * */
+void mirror_process(struct mirror *m, fd_set *rfds, fd_set *wfds,
+		long long now);
+
+/*
+ * How many contiguous bytes can be read from A into the buffer
+ * without overwriting the data not sent to the shadow yet nor
+ * lagging the shadow behind by more than its budget.
+ * */
+size_t mirror_get_free(struct mirror *m);
+
+/*
+ * How many bytes are in the buffer and were not sent to B yet.
+ * */
+size_t mirror_get_unsent(struct mirror *m);
+
+/*
+ * How many contiguous bytes are ready to be sent to B and where
+ * they begin (*pos) in the buffer.
+ * */
+size_t mirror_get_ready(struct mirror *m, size_t *pos);
+
+/*
+ * Take note that s bytes were sent to B: the data already sent to
+ * the shadow too is discarded from the buffer, moving its tail.
+ * */
+void mirror_consumed(struct mirror *m, size_t s);
+
+/*
+ * Record sz bytes of data read from the producer: from A they are
+ * counted as not mirrored if the mirror was dropped, from B they are
+ * the responses to compare.
+ * */
+void mirror_record(struct mirror *m, struct endpoint *producer,
+		const char *data, size_t sz);
+
+void mirror_summary_print(struct mirror *m);
+
+/*
+ * Cancel the connection in progress or close the shadow.
+ * */
+void mirror_destroy(struct mirror *m);
+
+#endif
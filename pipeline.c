@@ -0,0 +1,525 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/select.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "pipeline.h"
+#include "spsc_buffer.h"
+#include "hexdump.h"
+#include "endpoint.h"
+#include "socket.h"
+#include "cmdline.h"
+#include "affinity.h"
+
+#include "signal.h"
+
+struct side;
+
+/*
+ * One direction, from the producer to the consumer. It is read
+ * by the thread of the producer (the reader) and written by the
+ * thread of the consumer (the writer).
+ *
+ * Each thread has its own hexdump: the reader prints what it
+ * receives, the writer how much is still in the buffer.
+ *
+ * The flags are set by one thread and read by the other:
+ *  - eof: the producer was shutdown, no more data will be in the buffer
+ *  - closed: the consumer was shutdown, nobody will take the data
+ *  - producer_waiting / consumer_waiting: the reader is waiting for
+ *    free space or the writer is waiting for data; who moves the
+ *    tail or the head must notify it (see side_notify).
+ * */
+struct flow {
+	struct endpoint *producer;
+	struct endpoint *consumer;
+
+	struct spsc_buffer_t buf;
+	struct hexdump hd;
+	struct hexdump whd;
+
+	atomic_bool eof;
+	atomic_bool closed;
+	atomic_bool producer_waiting;
+	atomic_bool consumer_waiting;
+
+	struct side *reader;
+	struct side *writer;
+};
+
+/*
+ * The thread of an endpoint: it reads the flow in and writes the
+ * flow out. It is woken up by the other thread through its
+ * notification pipe.
+ * */
+struct side {
+	struct endpoint *ep;
+	struct flow *in;
+	struct flow *out;
+
+	int notify[2];
+	pthread_t thread;
+	struct pipeline *pl;
+
+	/* CPU to pin the thread to, -1 for none */
+	int cpu;
+};
+
+struct pipeline {
+	struct flow flows[2];
+	struct side sides[2];
+
+	atomic_bool stop;
+	atomic_bool failed;
+	atomic_int running;
+
+	pthread_t main_thread;
+	sigset_t wakeset;
+};
+
+static
+void side_notify(struct side *sd) {
+	int s;
+	char c = 0;
+
+	/* if the pipe is full there are notifications pending anyway */
+	EINTR_RETRY(write(sd->notify[1], &c, 1));
+}
+
+static
+void side_drain(struct side *sd) {
+	int s;
+	char buf[64];
+
+	do {
+		EINTR_RETRY(read(sd->notify[0], buf, sizeof(buf)));
+	} while (s > 0);
+}
+
+/*
+ * Mark that we are going to wait and check again the condition:
+ * the other thread could have changed it just before. With the
+ * sequentially consistent order either we see its change or it sees
+ * our flag and notifies us.
+ * */
+static
+bool wait_for(atomic_bool *waiting, struct spsc_buffer_t *b, bool for_data) {
+	size_t pos;
+
+	atomic_store(waiting, true);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	size_t n = for_data? spsc_buffer_get_ready(b, &pos)
+				: spsc_buffer_get_free(b, &pos);
+	if (n == 0)
+		return true;
+
+	atomic_store(waiting, false);
+	return false;
+}
+
+/*
+ * Wake up the other thread if it is waiting for what we just did.
+ * */
+static
+void wake_up(atomic_bool *waiting, struct side *sd) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(waiting, false))
+		side_notify(sd);
+}
+
+/*
+ * Set rfds to read the flow in if there is room in its buffer.
+ * Return false if the reading is done.
+ * */
+static
+bool side_fill_read(struct side *sd, fd_set *rfds, int *nfds) {
+	struct flow *f = sd->in;
+	size_t pos;
+
+	if (is_read_eof(sd->ep))
+		return false;
+
+	/* the consumer is gone: close the producer as soon as possible */
+	if (atomic_load(&f->closed)) {
+		partial_shutdown(sd->ep, SHUT_RD);
+		return false;
+	}
+
+	if (spsc_buffer_get_free(&f->buf, &pos) == 0
+			&& wait_for(&f->producer_waiting, &f->buf, false))
+		return true;
+
+	FD_SET(sd->ep->fd, rfds);
+	if (sd->ep->fd >= *nfds)
+		*nfds = sd->ep->fd + 1;
+	return true;
+}
+
+/*
+ * Set wfds to write the flow out if there is data in its buffer.
+ * Return false if the writing is done.
+ * */
+static
+bool side_fill_write(struct side *sd, fd_set *wfds, int *nfds) {
+	struct flow *f = sd->out;
+	size_t pos;
+
+	if (is_write_eof(sd->ep))
+		return false;
+
+	/* the eof is set after the last data so check it first */
+	bool eof = atomic_load(&f->eof);
+	if (spsc_buffer_get_ready(&f->buf, &pos) == 0) {
+		if (eof) {
+			/* the producer is done and the buffer is empty */
+			partial_shutdown(sd->ep, SHUT_WR);
+			atomic_store(&f->closed, true);
+			side_notify(f->reader);
+			return false;
+		}
+
+		if (wait_for(&f->consumer_waiting, &f->buf, true))
+			return true;
+	}
+
+	FD_SET(sd->ep->fd, wfds);
+	if (sd->ep->fd >= *nfds)
+		*nfds = sd->ep->fd + 1;
+	return true;
+}
+
+static
+int side_read(struct side *sd, fd_set *rfds) {
+	struct flow *f = sd->in;
+	size_t pos;
+	int s;
+
+	if (!FD_ISSET(sd->ep->fd, rfds))
+		return 0;
+
+	size_t room = spsc_buffer_get_free(&f->buf, &pos);
+	EINTR_RETRY(read(sd->ep->fd, &f->buf.buf[pos], room));
+
+	if (s < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK)? 0 : -1;
+
+	if (s == 0) {
+		/* ack to the other end that we received the shutdown */
+		partial_shutdown(sd->ep, SHUT_RD);
+		hexdump_shutdown_print(&f->hd);
+
+		atomic_store(&f->eof, true);
+		side_notify(f->writer);
+		return 0;
+	}
+
+	/* print what we got before the writer can take it */
+	hexdump_sent_print(&f->hd, &f->buf.buf[pos], s);
+	rearm_quickack(sd->ep);
+
+	spsc_buffer_advance_head(&f->buf, s);
+	wake_up(&f->consumer_waiting, f->writer);
+	return 0;
+}
+
+static
+int side_write(struct side *sd, fd_set *wfds) {
+	struct flow *f = sd->out;
+	size_t pos;
+	int s;
+
+	if (!FD_ISSET(sd->ep->fd, wfds))
+		return 0;
+
+	size_t total = spsc_buffer_get_total_ready(&f->buf);
+	size_t ready = spsc_buffer_get_ready(&f->buf, &pos);
+	EINTR_RETRY(write(sd->ep->fd, &f->buf.buf[pos], ready));
+
+	if (s < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK)? 0 : -1;
+
+	if (s == 0) {
+		/* ack to the other end that we received the shutdown */
+		partial_shutdown(sd->ep, SHUT_WR);
+		hexdump_shutdown_print(&f->whd);
+
+		atomic_store(&f->closed, true);
+		side_notify(f->reader);
+		return 0;
+	}
+
+	/* the writer's hexdump does not see the reader's offset:
+	 * set it from what was in the buffer */
+	f->whd.offset = f->whd.offset_consumer + total;
+	hexdump_remain_print(&f->whd, s);
+
+	spsc_buffer_advance_tail(&f->buf, s);
+	wake_up(&f->producer_waiting, f->reader);
+	return 0;
+}
+
+static
+void* side_thread(void *arg) {
+	struct side *sd = arg;
+	struct pipeline *pl = sd->pl;
+	int s;
+
+	if (sd->cpu != -1) {
+		if (affinity_pin(sd->cpu) != 0) {
+			perror("CPU affinity setup failed");
+			goto failed;
+		}
+
+		/* we are the producer: get the buffer in our NUMA node
+		 * before the first read touches it */
+		affinity_touch(sd->in->buf.buf, sd->in->buf.sz);
+	}
+
+	while (!atomic_load(&pl->stop) && !atomic_load(&pl->failed)) {
+		fd_set rfds, wfds;
+		int nfds = sd->notify[0] + 1;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(sd->notify[0], &rfds);
+
+		bool reading = side_fill_read(sd, &rfds, &nfds);
+		bool writing = side_fill_write(sd, &wfds, &nfds);
+		if (!reading && !writing)
+			break;	/* we finished: A and B are shutdown */
+
+		/* on EINTR check again if we were stopped */
+		s = pselect(nfds, &rfds, &wfds, NULL, NULL, &pl->wakeset);
+		if (s == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("select call failed");
+			goto failed;
+		}
+
+		if (FD_ISSET(sd->notify[0], &rfds))
+			side_drain(sd);
+
+		if (side_read(sd, &rfds) != 0) {
+			fprintf(stderr, "Passthrough from %s to %s failed: %s\n",
+					sd->in->hd.from, sd->in->hd.to, strerror(errno));
+			goto failed;
+		}
+
+		if (side_write(sd, &wfds) != 0) {
+			fprintf(stderr, "Passthrough from %s to %s failed: %s\n",
+					sd->out->hd.from, sd->out->hd.to, strerror(errno));
+			goto failed;
+		}
+	}
+
+	goto done;
+
+failed:
+	/* stop the other thread too */
+	atomic_store(&pl->failed, true);
+	side_notify(sd->in->writer);
+
+done:
+	/* wake up the main thread: maybe we were the last one */
+	atomic_fetch_sub(&pl->running, 1);
+	pthread_kill(pl->main_thread, SIGUSR1);
+	return NULL;
+}
+
+static
+int flow_init(struct flow *f, struct endpoint *producer,
+		struct endpoint *consumer, struct side *reader,
+		struct side *writer, size_t buf_size, const char *from,
+		const char *to, const char *color, const char *out_filename) {
+	memset(f, 0, sizeof(*f));
+	f->producer = producer;
+	f->consumer = consumer;
+	f->reader = reader;
+	f->writer = writer;
+
+	atomic_init(&f->eof, false);
+	atomic_init(&f->closed, false);
+	atomic_init(&f->producer_waiting, false);
+	atomic_init(&f->consumer_waiting, false);
+
+	if (spsc_buffer_init(&f->buf, buf_size) != 0)
+		goto buffer_failed;
+
+	if (hexdump_init(&f->hd, from, to, color, out_filename) != 0)
+		goto hexdump_failed;
+
+	/* the writer's hexdump does not save anything */
+	hexdump_init(&f->whd, from, to, color, NULL);
+	return 0;
+
+hexdump_failed:
+	spsc_buffer_destroy(&f->buf);
+
+buffer_failed:
+	return -1;
+}
+
+static
+void flow_destroy(struct flow *f) {
+	hexdump_destroy(&f->whd);
+	hexdump_destroy(&f->hd);
+	spsc_buffer_destroy(&f->buf);
+}
+
+static
+int side_init(struct side *sd, struct endpoint *ep, struct flow *in,
+		struct flow *out, struct pipeline *pl, int cpu) {
+	int s;
+
+	sd->cpu = cpu;
+	sd->ep = ep;
+	sd->in = in;
+	sd->out = out;
+	sd->pl = pl;
+
+	if (pipe(sd->notify) == -1)
+		return -1;
+
+	if (fcntl(sd->notify[0], F_SETFL, O_NONBLOCK) == -1
+			|| fcntl(sd->notify[1], F_SETFL, O_NONBLOCK) == -1) {
+		int last_errno = errno;
+		EINTR_RETRY(close(sd->notify[0]));
+		EINTR_RETRY(close(sd->notify[1]));
+		errno = last_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+static
+void side_destroy(struct side *sd) {
+	int s;
+	EINTR_RETRY(close(sd->notify[0]));
+	EINTR_RETRY(close(sd->notify[1]));
+}
+
+int pipeline_run(struct endpoint *A, struct endpoint *B, struct options *opts,
+		const char *colors[2], sigset_t *set) {
+	int ret = -1;
+	int s;
+	int started = 0;
+	sigset_t mainset;
+
+	/* the buffers' counters are aligned to the cache lines */
+	struct pipeline *pl = aligned_alloc(_Alignof(struct pipeline), sizeof(*pl));
+	if (!pl) {
+		perror("Pipeline allocation failed");
+		goto alloc_failed;
+	}
+	memset(pl, 0, sizeof(*pl));
+
+	struct flow *AtoB = &pl->flows[0];
+	struct flow *BtoA = &pl->flows[1];
+	struct side *sA = &pl->sides[0];
+	struct side *sB = &pl->sides[1];
+
+	if (flow_init(AtoB, A, B, sA, sB, opts->buf_sizes[0], "A", "B",
+				colors[0], opts->out_filenames[0]) != 0) {
+		perror("Buffer allocation for A->B failed");
+		goto flow_AtoB_failed;
+	}
+
+	if (flow_init(BtoA, B, A, sB, sA, opts->buf_sizes[1], "B", "A",
+				colors[1], opts->out_filenames[1]) != 0) {
+		perror("Buffer allocation for B->A failed");
+		goto flow_BtoA_failed;
+	}
+
+	int cpus[2] = { -1, -1 };
+	if (opts->ncpus) {
+		cpus[0] = affinity_cpu(opts->cpus, opts->ncpus, 0);
+		cpus[1] = affinity_cpu(opts->cpus, opts->ncpus, 1);
+	}
+
+	if (side_init(sA, A, AtoB, BtoA, pl, cpus[0]) != 0) {
+		perror("Pipeline setup failed");
+		goto side_A_failed;
+	}
+
+	if (side_init(sB, B, BtoA, AtoB, pl, cpus[1]) != 0) {
+		perror("Pipeline setup failed");
+		goto side_B_failed;
+	}
+
+	/*
+	 * The user's signals are handled here while the threads wait
+	 * with the wakeup mask: to stop them, set the stop flag and
+	 * wake them up with SIGUSR1. They wake us up in the same way
+	 * when they end.
+	 * */
+	if (initialize_wakeup_sigset(&pl->wakeset) != 0) {
+		perror("Setup signal handling failed");
+		goto threads_failed;
+	}
+
+	mainset = *set;
+	sigdelset(&mainset, SIGUSR1);
+
+	atomic_init(&pl->stop, false);
+	atomic_init(&pl->failed, false);
+	atomic_init(&pl->running, 2);
+	pl->main_thread = pthread_self();
+
+	for (; started < 2; ++started) {
+		struct side *sd = &pl->sides[started];
+		if ((s = pthread_create(&sd->thread, NULL, side_thread, sd)) != 0) {
+			errno = s;
+			perror("Pipeline thread start failed");
+			atomic_store(&pl->failed, true);
+			break;
+		}
+	}
+
+	while (!interrupted && started == 2 && atomic_load(&pl->running) > 0)
+		sigsuspend(&mainset);
+
+	atomic_store(&pl->stop, true);
+	for (int i = 0; i < started; ++i)
+		pthread_kill(pl->sides[i].thread, SIGUSR1);
+
+	for (int i = 0; i < started; ++i)
+		pthread_join(pl->sides[i].thread, NULL);
+
+	ret = atomic_load(&pl->failed)? -1 : 0;
+
+threads_failed:
+	side_destroy(sB);
+
+side_B_failed:
+	side_destroy(sA);
+
+side_A_failed:
+	flow_destroy(BtoA);
+
+flow_BtoA_failed:
+	flow_destroy(AtoB);
+
+flow_AtoB_failed:
+	free(pl);
+
+alloc_failed:
+	shutdown_and_close(A);
+	shutdown_and_close(B);
+	return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "signal.h"
+
+struct endpoint;
+struct options;
+
+/*
+ * Relay the data between A and B (both already connected) with
+ * a thread per endpoint: the thread of A reads from A and writes
+ * to A, the thread of B does the same with B.
+ *
+ * So each flow (A -> B and B -> A) is read by a thread and written by
+ * the other one, decoupled by a lock-free buffer (see struct
+ * spsc_buffer_t), and a single session can use two cores.
+ *
+ * The shutdowns are propagated as in the single thread relay (see
+ * enable_read_write): when the producer is done and the buffer is
+ * empty the consumer is shutdown for writing; when the consumer is
+ * shutdown for writing, the producer is shutdown for reading.
+ *
+ * Wait for the threads setting the signal mask set atomically and
+ * return when both finish or the program is interrupted.
+ * A and B are closed on return.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int pipeline_run(struct endpoint *A, struct endpoint *B, struct options *opts,
+		const char *colors[2], sigset_t *set);
+
+#endif
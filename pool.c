@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pool.h"
+#include "socket.h"
+#include "timer.h"
+
+#include "signal.h"
+
+static
+void pool_slot_start(struct pool *p, struct pool_slot *slot, long long now) {
+	slot->B.host = p->B->host;
+	slot->B.serv = p->B->serv;
+	slot->B.fd = -1;
+	slot->B.eof = 0;
+	slot->B.quickack = 0;
+
+	slot->state = POOL_SLOT_CONNECTING;
+	connector_start(&slot->c, &slot->B, p->skt_buf_sizes, p->tuning,
+			p->copts, now);
+}
+
+static
+void pool_slot_drop(struct pool *p, struct pool_slot *slot, long long now) {
+	shutdown_and_close(&slot->B);
+	slot->state = POOL_SLOT_EMPTY;
+	slot->refill_at = now;
+	p->dropped += 1;
+}
+
+void pool_init(struct pool *p, int size, struct endpoint *B,
+		size_t skt_buf_sizes[2], struct tcp_tuning *tuning,
+		struct connect_options *copts, long long now) {
+	memset(p, 0, sizeof(*p));
+	p->B = B;
+	p->skt_buf_sizes = skt_buf_sizes;
+	p->tuning = tuning;
+	p->copts = copts;
+	p->size = size < POOL_MAX_SIZE? size : POOL_MAX_SIZE;
+
+	for (int i = 0; i < p->size; ++i)
+		pool_slot_start(p, &p->slots[i], now);
+}
+
+void pool_fill(struct pool *p, fd_set *rfds, fd_set *wfds, int *nfds,
+		long long *deadline) {
+	for (int i = 0; i < p->size; ++i) {
+		struct pool_slot *slot = &p->slots[i];
+
+		switch (slot->state) {
+			case POOL_SLOT_EMPTY:
+				timer_update_deadline(deadline, slot->refill_at);
+				break;
+
+			case POOL_SLOT_CONNECTING:
+				connector_fill(&slot->c, rfds, wfds, nfds, deadline);
+				break;
+
+			case POOL_SLOT_IDLE:
+				if (!slot->watched)
+					break;
+
+				/* a read event means that B closed the
+				 * connection or that it sent data */
+				FD_SET(slot->B.fd, rfds);
+				if (slot->B.fd >= *nfds)
+					*nfds = slot->B.fd + 1;
+				break;
+		}
+	}
+}
+
+void pool_process(struct pool *p, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	int s;
+	char c;
+
+	for (int i = 0; i < p->size; ++i) {
+		struct pool_slot *slot = &p->slots[i];
+
+		switch (slot->state) {
+			case POOL_SLOT_EMPTY:
+				if (now >= slot->refill_at)
+					pool_slot_start(p, slot, now);
+				break;
+
+			case POOL_SLOT_CONNECTING:
+				switch (connector_process(&slot->c, rfds, wfds, now)) {
+					case CONNECTOR_DONE:
+						slot->B.fd = slot->c.fd;
+						slot->B.quickack = (p->tuning->quickack == 1);
+						slot->state = POOL_SLOT_IDLE;
+						slot->watched = true;
+						p->opened += 1;
+						break;
+
+					case CONNECTOR_FAILED:
+						fprintf(stderr, "Pool connection to B %s:%s failed: %s\n",
+								slot->B.host, slot->B.serv,
+								strerror(slot->c.last_errno));
+						slot->state = POOL_SLOT_EMPTY;
+						slot->refill_at = now + p->copts->backoff_max * 1000LL;
+						p->failed += 1;
+						break;
+
+					default:
+						break;
+				}
+				break;
+
+			case POOL_SLOT_IDLE:
+				if (!slot->watched || !FD_ISSET(slot->B.fd, rfds))
+					break;
+
+				/*
+				 * Peek so any data sent by B is kept for A.
+				 * */
+				EINTR_RETRY(recv(slot->B.fd, &c, 1, MSG_PEEK));
+				if (s == 0 || (s == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+					pool_slot_drop(p, slot, now);
+				else if (s > 0)
+					slot->watched = false;
+				break;
+		}
+	}
+}
+
+int pool_take(struct pool *p, struct endpoint *B) {
+	for (int i = 0; i < p->size; ++i) {
+		struct pool_slot *slot = &p->slots[i];
+		if (slot->state != POOL_SLOT_IDLE)
+			continue;
+
+		B->fd = slot->B.fd;
+		B->eof = 0;
+		B->quickack = slot->B.quickack;
+
+		/* refill it in the next round */
+		slot->state = POOL_SLOT_EMPTY;
+		slot->refill_at = 0;
+		p->taken += 1;
+		return 0;
+	}
+
+	return -1;
+}
+
+void pool_summary_print(struct pool *p) {
+	printf("Pool to B: %llu connections opened, %llu taken, "
+			"%llu dropped while idle, %llu failed\n",
+			p->opened, p->taken, p->dropped, p->failed);
+}
+
+void pool_add_counters(struct pool *total, struct pool *p) {
+	total->opened += p->opened;
+	total->taken += p->taken;
+	total->dropped += p->dropped;
+	total->failed += p->failed;
+}
+
+void pool_destroy(struct pool *p) {
+	for (int i = 0; i < p->size; ++i) {
+		struct pool_slot *slot = &p->slots[i];
+
+		if (slot->state == POOL_SLOT_CONNECTING)
+			connector_cancel(&slot->c);
+		else if (slot->state == POOL_SLOT_IDLE)
+			shutdown_and_close(&slot->B);
+
+		slot->state = POOL_SLOT_EMPTY;
+	}
+}
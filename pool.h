@@ -0,0 +1,107 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <sys/select.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "endpoint.h"
+#include "socket.h"
+
+#define POOL_MAX_SIZE 64
+
+/*
+ * A pool of connections to B established in advance so a new
+ * connection from A does not have to wait for the connection to B
+ * (the DNS resolution plus the TCP handshake).
+ *
+ * Each slot of the pool is either empty, connecting (see struct
+ * connector) or idle (connected and ready to be taken).
+ *
+ * The idle connections are health-checked while they wait: if B
+ * closes one or resets it, it is dropped and the slot is refilled.
+ * If B sends data first (like a banner), the connection is kept
+ * as is (the data stays in the socket) but it is not watched anymore.
+ *
+ * If a slot fails to connect (after all the tries, see
+ * connect_options), it is not refilled until backoff_max milliseconds
+ * later.
+ * */
+enum pool_slot_state {
+	POOL_SLOT_EMPTY,
+	POOL_SLOT_CONNECTING,
+	POOL_SLOT_IDLE
+};
+
+struct pool_slot {
+	enum pool_slot_state state;
+	struct endpoint B;
+	struct connector c;
+	bool watched;
+	long long refill_at;
+};
+
+struct pool {
+	struct endpoint *B;
+	size_t *skt_buf_sizes;
+	struct tcp_tuning *tuning;
+	struct connect_options *copts;
+
+	int size;
+	struct pool_slot slots[POOL_MAX_SIZE];
+
+	unsigned long long opened;
+	unsigned long long taken;
+	unsigned long long dropped;
+	unsigned long long failed;
+};
+
+/*
+ * Initialize the pool of size connections to the endpoint B
+ * and start connecting all of them at time now.
+ *
+ * The pool keeps references to the endpoint and the options
+ * given so they must outlive it.
+ * */
+void pool_init(struct pool *p, int size, struct endpoint *B,
+		size_t skt_buf_sizes[2], struct tcp_tuning *tuning,
+		struct connect_options *copts, long long now);
+
+/*
+ * Set the file descriptors to wait for in rfds and wfds and update
+ * *nfds (highest file descriptor plus one) and *deadline.
+ * */
+void pool_fill(struct pool *p, fd_set *rfds, fd_set *wfds, int *nfds,
+		long long *deadline);
+
+/*
+ * Advance the pool: complete the connections in progress, check
+ * the idle ones and refill the empty slots.
+ * */
+void pool_process(struct pool *p, fd_set *rfds, fd_set *wfds,
+		long long now);
+
+/*
+ * Take an idle connection from the pool and save it into B.
+ *
+ * Return 0 on success, -1 if there is no idle connection.
+ * */
+int pool_take(struct pool *p, struct endpoint *B);
+
+/*
+ * Print how many connections were opened, taken and dropped.
+ * */
+void pool_summary_print(struct pool *p);
+
+/*
+ * Add the counters of the pool p to the ones of total so the pools
+ * of many workers can be summarized as one.
+ * */
+void pool_add_counters(struct pool *total, struct pool *p);
+
+/*
+ * Cancel the connections in progress and close the idle ones.
+ * */
+void pool_destroy(struct pool *p);
+
+#endif
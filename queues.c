@@ -0,0 +1,47 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include <stdio.h>
+#include <errno.h>
+
+#include "queues.h"
+
+int queues_print(const char *from, const char *to,
+		int producer_fd, size_t buffered, size_t buf_sz,
+		int consumer_fd, double elapsed, const char *color_escape) {
+	int inq = 0, outq = 0, outq_notsent = 0;
+
+	if (ioctl(producer_fd, SIOCINQ, &inq) == -1
+			|| ioctl(consumer_fd, SIOCOUTQ, &outq) == -1)
+		return -1;
+
+	if (ioctl(consumer_fd, SIOCOUTQNSD, &outq_notsent) == -1) {
+		if (errno != EINVAL && errno != ENOTTY && errno != EOPNOTSUPP)
+			return -1;
+
+		/* not a TCP socket (Unix socket): nothing is sent until
+		 * the peer reads it */
+		outq_notsent = outq;
+	}
+
+	flockfile(stdout);
+	if (color_escape)
+		printf("%s", color_escape);
+
+	printf("[%10.3f] %s -> %s queued: %s rcvq %i, buffer %zu/%zu, "
+			"%s sndq %i (%i not sent)\n",
+			elapsed, from, to,
+			from, inq,
+			buffered, buf_sz,
+			to, outq, outq_notsent);
+
+	if (color_escape)
+		printf("%s", "\x1b[0m"); /* reset */
+	fflush(stdout);
+	funlockfile(stdout);
+
+	return 0;
+}
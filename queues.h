@@ -0,0 +1,35 @@
+#ifndef QUEUES_H_
+#define QUEUES_H_
+
+#include <stddef.h>
+
+/*
+ * Print where the bytes of one direction (from -> to) are queued:
+ *  - in the receive queue of the producer's socket (not read by us yet),
+ *    see SIOCINQ
+ *  - in our buffer: buffered bytes of a buffer of size buf_sz
+ *  - in the send queue of the consumer's socket, not acknowledged
+ *    by the consumer yet (SIOCOUTQ) and, of those, how many were not
+ *    even sent (SIOCOUTQNSD)
+ *
+ * A slow consumer fills up the consumer's send queue first (and then
+ * our buffer and the producer's receive queue); a full buffer with an
+ * empty send queue means that the buffer is too small; a send queue
+ * with data sent but not acknowledged means that the network path
+ * is full.
+ *
+ * The line is prefixed with the time elapsed (in seconds) so the output
+ * can be read as a time series.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ *
+ * For a Unix socket, the send queue has the bytes not read by the
+ * consumer yet and all of them are reported as not sent.
+ *
+ * See tcp(7) and unix(7).
+ * */
+int queues_print(const char *from, const char *to,
+		int producer_fd, size_t buffered, size_t buf_sz,
+		int consumer_fd, double elapsed, const char *color_escape);
+
+#endif
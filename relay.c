@@ -0,0 +1,734 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/select.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "relay.h"
+#include "socket.h"
+#include "cmdline.h"
+#include "tcpinfo.h"
+#include "queues.h"
+#include "timer.h"
+#include "affinity.h"
+#include "bufalloc.h"
+#include "busypoll.h"
+
+#include "signal.h"
+
+/*
+ * How long a buffer stays empty before its memory is released.
+ * */
+#define RELEASE_DELAY_US 1000000LL
+
+static
+int passthrough(struct endpoint *ep_producer, struct endpoint *ep_consumer,
+		fd_set *rfds, fd_set *wfds,
+		struct circular_buffer_t *b,
+		struct hexdump *hd,
+		struct zerocopy *zc,
+		struct analyzer *an,
+		struct mirror *mr) {
+	int producer = ep_producer->fd;
+	int consumer = ep_consumer->fd;
+	int s;
+
+	/* the data of A is kept in the buffer for the shadow too
+	 * (see struct mirror) */
+	struct mirror *shadow = (mr && ep_producer == mr->A)? mr : NULL;
+
+	if (FD_ISSET(producer, rfds)) {	 // ready to produce
+		EINTR_RETRY(read(producer, &b->buf[b->head],
+					shadow? mirror_get_free(shadow) :
+					circular_buffer_get_free(b)));
+
+		if (s < 0) {
+			/*
+			 * Despite that we use some sort of select/poll multiplexer
+			 * the read/write it could block.
+			 *
+			 * For example, if the fd is a socket and it receives data,
+			 * that would mark it "ready for reading" but if the packet
+			 * received is corrupted, it will be discarded and the read call will
+			 * block because there is not more data.
+			 *
+			 * To workaround this, the fd must have the O_NONBLOCK flag.
+			 * See select(2).
+			 * */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				FD_CLR(producer, rfds);
+				goto read_would_block;
+			}
+
+			return -1;
+		}
+		else if (s == 0) {
+			/* ack to the other end that we received the shutdown */
+			partial_shutdown(ep_producer, SHUT_RD);
+			hexdump_shutdown_print(hd);
+		}
+		else {
+			/* print what we got */
+			hexdump_sent_print(hd, &b->buf[b->head], s);
+			rearm_quickack(ep_producer);
+
+			if (an)
+				analyzer_record(an, s, monotonic_us());
+
+			if (mr)
+				mirror_record(mr, ep_producer, &b->buf[b->head], s);
+		}
+
+		/* update our head pointer */
+		circular_buffer_advance_head(b, s);
+	}
+
+read_would_block:
+
+	if (FD_ISSET(consumer, wfds)) {	 // ready to consume
+		if (zc) {
+			s = zerocopy_send(zc, consumer, b);
+		}
+		else if (shadow) {
+			size_t pos;
+			size_t ready = mirror_get_ready(shadow, &pos);
+			EINTR_RETRY(write(consumer, &b->buf[pos], ready));
+		}
+		else {
+			EINTR_RETRY(write(consumer, &b->buf[b->tail], circular_buffer_get_ready(b)));
+		}
+
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				FD_CLR(consumer, wfds);
+				goto write_would_block;
+			}
+
+			return -1;
+		}
+		else if (s == 0) {
+			/* a zerocopy send of 0 bytes means that there are
+			 * too many sends in flight, try later */
+			if (zc)
+				goto write_would_block;
+
+			/* ack to the other end that we received the shutdown */
+			partial_shutdown(ep_consumer, SHUT_WR);
+			hexdump_shutdown_print(hd);
+		}
+		else {
+			/* print how many is still here and we couldn't send */
+			hexdump_remain_print(hd, s);
+
+			if (an)
+				analyzer_record_sent(an, s, monotonic_us());
+		}
+
+		/* update our tail pointer; the data sent with zerocopy
+		 * is discarded later, when the kernel is done with it
+		 * (see zerocopy_reap), and the data sent to B only when
+		 * the shadow got it too */
+		if (shadow)
+			mirror_consumed(shadow, s);
+		else if (!zc)
+			circular_buffer_advance_tail(b, s);
+
+	}
+	else if (FD_ISSET(producer, rfds)) {
+		/* print how many is still here and we couldn't send */
+		hexdump_remain_print(hd, 0);
+	}
+
+write_would_block:
+	return 0;
+}
+
+/*
+ * Set the file descriptors sets rfds and wfds for
+ * reading/writing based on the available free space or
+ * data ready in the buffer buf and based on if the producer
+ * and or the consumer are not closed.
+ *
+ * With a mirror (of A -> B), the data kept in the buffer only for the
+ * shadow does not count (see struct mirror).
+ *
+ * Return the status of the pipe, see enum pipe_status.
+ *  */
+static
+enum pipe_status enable_read_write(struct endpoint *ep_producer,
+		struct endpoint *ep_consumer,
+		fd_set *rfds, fd_set *wfds,
+		struct circular_buffer_t *buf,
+		struct zerocopy *zc,
+		struct mirror *mr) {
+
+	int producer = ep_producer->fd;
+	int consumer = ep_consumer->fd;
+
+	size_t pending = mr? mirror_get_unsent(mr) : circular_buffer_get_ready(buf);
+
+	/*
+	 * Are our both endpoints, the consumer and the producer
+	 * closed? If we have data in the pipe means that the pipe
+	 * is broken, otherwise means that we are done, close the
+	 * pipe
+	 * */
+	if (is_write_eof(ep_consumer) && is_read_eof(ep_producer)) {
+		if (pending)
+			return PIPE_BROKEN;
+		else
+			return PIPE_CLOSED;
+	}
+
+	/*
+	 * If our consumer closed his side of the pipe means that we cannot
+	 * write any data any more.
+	 * If we still have data in the pipe that means that the
+	 * pipe is broken, otherwise means that the pipe was closed
+	 * by the consumer and this may be ok.
+	 *
+	 * In any case, a close by the consumer will imply a close
+	 * for the producer as soon as possible.
+	 *
+	 * This may produce a broken pipe in the producer but we cannot
+	 * know it because the producer didn't send us that data so from
+	 * our point of view, everything is working normal.
+	 * */
+	if (is_write_eof(ep_consumer)) {
+		partial_shutdown(ep_producer, SHUT_RD);
+
+		if (pending)
+			return PIPE_BROKEN;
+		else
+			return PIPE_CLOSED;
+	}
+
+	/*
+	 * If the producer closed his side of the pipe means that we will
+	 * not have more data in the pipe.
+	 * If the pipe is already empty, close the consumer, closing the
+	 * pipe, acknowling to the consumer that we are closing.
+	 * If we still have data, keep the pipe alive as usual, we need to
+	 * wait until the data in the pipe is flushed away to the consumer
+	 * only then we need to close the pipe.
+	 * */
+	if (is_read_eof(ep_producer)) {
+		if (!pending) {
+			partial_shutdown(ep_consumer, SHUT_WR);
+			return PIPE_CLOSED;
+		}
+		else {
+			/* keep the pipe and don't close the consumer
+			 * we want to keep flushing all the data that
+			 * we have in the pipe before closing it
+			 * */
+		}
+	}
+
+	/*
+	 * If we have room in the buffer and the producer is not closed,
+	 * enable it for reading, he may have more data for us.
+	 * */
+	size_t room = mr? mirror_get_free(mr) : circular_buffer_get_free(buf);
+	if (room && !is_read_eof(ep_producer))
+		FD_SET(producer, rfds);
+
+	/*
+	 * If we have fresh data in the buffer to be sent to the consumer
+	 * and the consumer is not closed, enable it for writing, he may
+	 * want this data.
+	 *
+	 * With zerocopy, the data already sent is still in the buffer
+	 * (the kernel is using it) so only the data not sent yet counts.
+	 * */
+	size_t unsent = zc? zerocopy_get_unsent(zc, buf) : pending;
+
+	if (unsent && !is_write_eof(ep_consumer))
+		FD_SET(consumer, wfds);
+
+	return PIPE_OPEN;
+}
+
+char* session_filename(const char *filename, unsigned int id) {
+	if (!filename)
+		return NULL;
+
+	size_t sz = strlen(filename) + 16;
+	char *name = malloc(sz);
+	if (name)
+		snprintf(name, sz, "%s.%u", filename, id);
+
+	return name;
+}
+
+static
+void flow_init(struct flow *f, struct endpoint *producer,
+		struct endpoint *consumer) {
+	memset(f, 0, sizeof(*f));
+	f->producer = producer;
+	f->consumer = consumer;
+	f->status = PIPE_OPEN;
+	f->idle_since = TIMER_NEVER;
+}
+
+int session_init(struct session *ss, unsigned int id, struct options *opts,
+		const char *colors[2], long long start) {
+	ss->id = id;
+	ss->opts = opts;
+	ss->start = start;
+	ss->colors[0] = colors[0];
+	ss->colors[1] = colors[1];
+	ss->mr = NULL;
+
+	char shadow[32];
+	flow_init(&ss->AtoB, &ss->A, &ss->B);
+	flow_init(&ss->BtoA, &ss->B, &ss->A);
+
+	if (id) {
+		/* the sessions of a route are prefixed with its name */
+		const char *route = opts->route? opts->route : "";
+		const char *sep = opts->route? ":" : "";
+		snprintf(ss->names[0], sizeof(ss->names[0]), "%s%sA#%u", route, sep, id);
+		snprintf(ss->names[1], sizeof(ss->names[1]), "%s%sB#%u", route, sep, id);
+		ss->out_filenames[0] = session_filename(opts->out_filenames[0], id);
+		ss->out_filenames[1] = session_filename(opts->out_filenames[1], id);
+		snprintf(shadow, sizeof(shadow), "%s%sS#%u", route, sep, id);
+	}
+	else {
+		snprintf(ss->names[0], sizeof(ss->names[0]), "A");
+		snprintf(ss->names[1], sizeof(ss->names[1]), "B");
+		ss->out_filenames[0] = ss->out_filenames[1] = NULL;
+		snprintf(shadow, sizeof(shadow), "S");
+	}
+
+	const char *A = ss->names[0];
+	const char *B = ss->names[1];
+	char **out_filenames = id? ss->out_filenames : opts->out_filenames;
+
+	if (circular_buffer_init(&ss->AtoB.buf, opts->buf_sizes[0]) != 0) {
+		perror("Buffer allocation for A->B failed");
+		goto buf_AtoB_failed;
+	}
+
+	if (circular_buffer_init(&ss->BtoA.buf, opts->buf_sizes[1]) != 0) {
+		perror("Buffer allocation for B->A failed");
+		goto buf_BtoA_failed;
+	}
+
+	/* we are pinned: get the buffers in our NUMA node */
+	if (opts->ncpus) {
+		affinity_touch(ss->AtoB.buf.buf, ss->AtoB.buf.sz);
+		affinity_touch(ss->BtoA.buf.buf, ss->BtoA.buf.sz);
+	}
+
+	int (*open_hexdump)(struct hexdump*, const char*, const char*,
+			const char*, const char*) =
+		ss->resumed? hexdump_init_append : hexdump_init;
+
+	if (open_hexdump(&ss->AtoB.hd, A, B, colors[0], out_filenames[0]) != 0) {
+		perror("Hexdump A->B allocation failed");
+		goto hd_A_to_B_failed;
+	}
+
+	if (open_hexdump(&ss->BtoA.hd, B, A, colors[1], out_filenames[1]) != 0) {
+		perror("Hexdump B->A allocation failed");
+		goto hd_B_to_A_failed;
+	}
+
+	if (opts->zerocopy) {
+		if (zerocopy_enable(ss->A.fd) != 0 || zerocopy_enable(ss->B.fd) != 0) {
+			perror("Zerocopy setup failed");
+			goto zerocopy_failed;
+		}
+
+		zerocopy_init(&ss->AtoB.zc_state);
+		zerocopy_init(&ss->BtoA.zc_state);
+		ss->AtoB.zc = &ss->AtoB.zc_state;
+		ss->BtoA.zc = &ss->BtoA.zc_state;
+	}
+
+	if (opts->busy_poll) {
+		busypoll_enable(ss->A.fd, opts->busy_poll);
+		busypoll_enable(ss->B.fd, opts->busy_poll);
+	}
+
+	if (opts->analyze) {
+		analyzer_init(&ss->AtoB.an_state, A, B,
+				analyzer_get_mss(ss->A.fd), &ss->BtoA.an_state);
+		analyzer_init(&ss->BtoA.an_state, B, A,
+				analyzer_get_mss(ss->B.fd), &ss->AtoB.an_state);
+		ss->AtoB.an = &ss->AtoB.an_state;
+		ss->BtoA.an = &ss->BtoA.an_state;
+	}
+
+	long long stall_threshold = opts->stall_threshold * 1000LL;
+	stall_init(&ss->AtoB.full, A, B, "buffer full", colors[0], stall_threshold);
+	stall_init(&ss->BtoA.full, B, A, "buffer full", colors[1], stall_threshold);
+	stall_init(&ss->AtoB.unsent, A, B, "data unsent", colors[0], stall_threshold);
+	stall_init(&ss->BtoA.unsent, B, A, "data unsent", colors[1], stall_threshold);
+
+	if (opts->buf_max[0]) {
+		long long now = monotonic_us();
+		adapt_charge(ss->AtoB.buf.sz + ss->BtoA.buf.sz);
+		adapt_init(&ss->AtoB.ad_state, A, B, colors[0],
+				opts->buf_sizes[0], opts->buf_max[0], now);
+		adapt_init(&ss->BtoA.ad_state, B, A, colors[1],
+				opts->buf_sizes[1], opts->buf_max[1], now);
+		ss->AtoB.ad = &ss->AtoB.ad_state;
+		ss->BtoA.ad = &ss->BtoA.ad_state;
+	}
+
+	if (opts->shadow.host) {
+		mirror_init(&ss->mr_state, &ss->A, &ss->AtoB.buf, opts, A, shadow,
+				colors[0], start, monotonic_us());
+		ss->mr = ss->AtoB.mr = &ss->mr_state;
+	}
+
+	return 0;
+
+zerocopy_failed:
+	hexdump_destroy(&ss->BtoA.hd);
+
+hd_B_to_A_failed:
+	hexdump_destroy(&ss->AtoB.hd);
+
+hd_A_to_B_failed:
+	circular_buffer_destroy(&ss->BtoA.buf);
+
+buf_BtoA_failed:
+	circular_buffer_destroy(&ss->AtoB.buf);
+
+buf_AtoB_failed:
+	free(ss->out_filenames[0]);
+	free(ss->out_filenames[1]);
+	return -1;
+}
+
+static
+void flow_fill(struct flow *f, fd_set *rfds, fd_set *wfds,
+		long long *deadline) {
+	if (f->status == PIPE_OPEN)
+		f->status = enable_read_write(f->producer, f->consumer,
+				rfds, wfds, &f->buf, f->zc, f->mr);
+
+	f->read_requested = FD_ISSET(f->producer->fd, rfds);
+
+	if (f->full.threshold) {
+		timer_update_deadline(deadline, stall_deadline(&f->full));
+		timer_update_deadline(deadline, stall_deadline(&f->unsent));
+	}
+
+	if (f->idle_since != TIMER_NEVER)
+		timer_update_deadline(deadline, f->idle_since + RELEASE_DELAY_US);
+
+	if (f->ad)
+		timer_update_deadline(deadline, adapt_deadline(f->ad, f->buf.sz));
+}
+
+bool session_fill(struct session *ss, fd_set *rfds, fd_set *wfds,
+		int *nfds, long long *deadline) {
+	struct flow *flows[2] = { &ss->AtoB, &ss->BtoA };
+
+	flow_fill(&ss->AtoB, rfds, wfds, deadline);
+	flow_fill(&ss->BtoA, rfds, wfds, deadline);
+
+	/*
+	 * The zerocopy notifications are queued in the error queue
+	 * of the consumer which select reports as ready for reading
+	 * so we wait for them too, even if we don't want to read
+	 * from it.
+	 *
+	 * The consumer of a flow is the producer of the other one:
+	 * set them only after both flows took note of the reads that
+	 * they requested (see flow_fill).
+	 * */
+	for (int i = 0; i < 2; ++i) {
+		struct flow *f = flows[i];
+		if (f->zc && zerocopy_pending(f->zc))
+			FD_SET(f->consumer->fd, rfds);
+	}
+
+	if (ss->A.fd >= *nfds)
+		*nfds = ss->A.fd + 1;
+
+	if (ss->B.fd >= *nfds)
+		*nfds = ss->B.fd + 1;
+
+	/* we finished: no data can be sent from A to B nor B to A.
+	 * The shadow does not keep the session alive */
+	bool open = ss->AtoB.status == PIPE_OPEN || ss->BtoA.status == PIPE_OPEN;
+	if (open && ss->mr)
+		mirror_fill(ss->mr, rfds, wfds, nfds, deadline);
+
+	return open;
+}
+
+/*
+ * Update the stall detectors of a flow:
+ *  - full: the buffer is full so the producer cannot send us more data
+ *  - unsent: there is data in the buffer but the consumer is not
+ *    taking it (no progress since the last time)
+ *
+ * The consumer progress is tracked with how many bytes the consumer
+ * took so far (see struct hexdump); f->consumed is the last value seen.
+ * */
+static
+void update_stalls(struct flow *f, long long now, double elapsed) {
+	bool open = (f->status == PIPE_OPEN);
+	size_t ready = circular_buffer_get_total_ready(&f->buf);
+
+	stall_update(&f->full, open && circular_buffer_get_free(&f->buf) == 0,
+			ready, now, elapsed);
+
+	if (f->consumed != f->hd.offset_consumer) {
+		/* progress: any stall is cleared and a new one may start now */
+		f->consumed = f->hd.offset_consumer;
+		stall_update(&f->unsent, false, ready, now, elapsed);
+	}
+
+	stall_update(&f->unsent, open && ready > 0, ready, now, elapsed);
+}
+
+/*
+ * Release the memory of the buffer of a flow once it stays empty for
+ * RELEASE_DELAY_US so the memory used follows the data in flight
+ * (see bufalloc_release).
+ *
+ * The buffer could be filled and emptied between two calls so the
+ * bytes produced (see struct hexdump) tell if it was used meanwhile.
+ * */
+static
+void update_idle(struct flow *f, long long now) {
+	bool empty = circular_buffer_get_total_ready(&f->buf) == 0;
+
+	if (!empty || f->idle_offset != f->hd.offset) {
+		f->committed = true;
+		f->idle_offset = f->hd.offset;
+		f->idle_since = empty? now : TIMER_NEVER;
+		return;
+	}
+
+	if (!f->committed)
+		return;
+
+	if (f->idle_since == TIMER_NEVER) {
+		f->idle_since = now;
+	}
+	else if (now - f->idle_since >= RELEASE_DELAY_US) {
+		circular_buffer_release(&f->buf);
+		f->committed = false;
+		f->idle_since = TIMER_NEVER;
+	}
+}
+
+/*
+ * How a flow was before relaying its data (see update_adapt):
+ *  - offered: how many bytes could be read from the producer
+ *  - held: how many bytes were in the buffer
+ *  - produced: how many bytes were read so far (see struct hexdump)
+ *  - writing: if the consumer was going to be written
+ * */
+struct round {
+	size_t offered;
+	size_t held;
+	unsigned int produced;
+	bool writing;
+};
+
+static
+void round_begin(struct flow *f, struct round *r, fd_set *rfds,
+		fd_set *wfds) {
+	r->offered = FD_ISSET(f->producer->fd, rfds)?
+				circular_buffer_get_free(&f->buf) : 0;
+	r->held = circular_buffer_get_total_ready(&f->buf);
+	r->produced = f->hd.offset;
+	r->writing = FD_ISSET(f->consumer->fd, wfds);
+}
+
+/*
+ * Size the buffer of a flow after the round r (see struct adapt).
+ *
+ * The buffer was filled if the producer gave us all the bytes offered;
+ * it is the buffer what limits the flow only if the consumer was
+ * not blocked: its last write did not fail with EAGAIN (passthrough
+ * removes it from wfds then).
+ * */
+static
+void update_adapt(struct flow *f, struct round *r, fd_set *wfds,
+		long long now, double elapsed) {
+	size_t got = f->hd.offset - r->produced;
+
+	if (r->writing)
+		f->consumer_blocked = !FD_ISSET(f->consumer->fd, wfds);
+
+	bool read = r->offered && got;
+	bool filled = read && got == r->offered && !f->consumer_blocked;
+	adapt_update(f->ad, &f->buf, read, filled, r->held + got, now, elapsed);
+}
+
+int session_process(struct session *ss, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	struct flow *flows[2] = { &ss->AtoB, &ss->BtoA };
+	struct round rounds[2];
+
+	for (int i = 0; i < 2; ++i) {
+		struct flow *f = flows[i];
+		if (f->zc && zerocopy_pending(f->zc)
+				&& zerocopy_reap(f->zc, f->consumer->fd, &f->buf) == -1) {
+			fprintf(stderr, "Zerocopy notifications from %s failed: %s\n",
+					f->hd.to, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* drop the read events that we didn't ask for (see flow_fill) */
+	for (int i = 0; i < 2; ++i) {
+		struct flow *f = flows[i];
+		if (!f->read_requested)
+			FD_CLR(f->producer->fd, rfds);
+	}
+
+	if (ss->AtoB.ad) {
+		round_begin(&ss->AtoB, &rounds[0], rfds, wfds);
+		round_begin(&ss->BtoA, &rounds[1], rfds, wfds);
+	}
+
+	if (passthrough(&ss->A, &ss->B, rfds, wfds, &ss->AtoB.buf,
+				&ss->AtoB.hd, ss->AtoB.zc, ss->AtoB.an, ss->mr) != 0) {
+		fprintf(stderr, "Passthrough from %s to %s failed: %s\n",
+				ss->names[0], ss->names[1], strerror(errno));
+		return -1;
+	}
+
+	if (passthrough(&ss->B, &ss->A, rfds, wfds, &ss->BtoA.buf,
+				&ss->BtoA.hd, ss->BtoA.zc, ss->BtoA.an, ss->mr) != 0) {
+		fprintf(stderr, "Passthrough from %s to %s failed: %s\n",
+				ss->names[1], ss->names[0], strerror(errno));
+		return -1;
+	}
+
+	if (ss->mr)
+		mirror_process(ss->mr, rfds, wfds, now);
+
+	if (ss->opts->stall_threshold) {
+		double elapsed = (now - ss->start) / 1000000.0;
+		update_stalls(&ss->AtoB, now, elapsed);
+		update_stalls(&ss->BtoA, now, elapsed);
+	}
+
+	if (ss->AtoB.ad) {
+		double elapsed = (now - ss->start) / 1000000.0;
+		update_adapt(&ss->AtoB, &rounds[0], wfds, now, elapsed);
+		update_adapt(&ss->BtoA, &rounds[1], wfds, now, elapsed);
+	}
+
+	if (bufalloc_releasable()) {
+		update_idle(&ss->AtoB, now);
+		update_idle(&ss->BtoA, now);
+	}
+
+	return 0;
+}
+
+void session_drain(struct session *ss) {
+	if (!is_read_eof(&ss->A))
+		partial_shutdown(&ss->A, SHUT_RD);
+
+	if (!is_read_eof(&ss->B))
+		partial_shutdown(&ss->B, SHUT_RD);
+}
+
+int session_print_tcpinfo(struct session *ss, long long now) {
+	double elapsed = (now - ss->start) / 1000000.0;
+	if (tcpinfo_print(ss->names[0], ss->A.fd, elapsed, ss->colors[0]) != 0
+		|| tcpinfo_print(ss->names[1], ss->B.fd, elapsed, ss->colors[1]) != 0) {
+		perror("TCP info sampling failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+int session_print_queues(struct session *ss, long long now) {
+	double elapsed = (now - ss->start) / 1000000.0;
+	if (queues_print(ss->names[0], ss->names[1], ss->A.fd,
+			circular_buffer_get_total_ready(&ss->AtoB.buf),
+			ss->AtoB.buf.sz, ss->B.fd, elapsed, ss->colors[0]) != 0
+		|| queues_print(ss->names[1], ss->names[0], ss->B.fd,
+			circular_buffer_get_total_ready(&ss->BtoA.buf),
+			ss->BtoA.buf.sz, ss->A.fd, elapsed, ss->colors[1]) != 0) {
+		perror("Queues sampling failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+void session_summary_print(struct session *ss, long long now) {
+	struct flow *flows[2] = { &ss->AtoB, &ss->BtoA };
+
+	if (ss->opts->stall_threshold) {
+		/* close any stall in progress so it is accounted */
+		double elapsed = (now - ss->start) / 1000000.0;
+		for (int i = 0; i < 2; ++i) {
+			stall_update(&flows[i]->full, false, 0, now, elapsed);
+			stall_update(&flows[i]->unsent, false, 0, now, elapsed);
+		}
+
+		for (int i = 0; i < 2; ++i) {
+			stall_summary_print(&flows[i]->full);
+			stall_summary_print(&flows[i]->unsent);
+		}
+	}
+
+	if (ss->opts->analyze) {
+		analyzer_summary_print(&ss->AtoB.an_state);
+		analyzer_summary_print(&ss->BtoA.an_state);
+	}
+
+	if (ss->AtoB.ad) {
+		adapt_summary_print(&ss->AtoB.ad_state);
+		adapt_summary_print(&ss->BtoA.ad_state);
+	}
+
+	if (ss->mr)
+		mirror_summary_print(ss->mr);
+
+	if (ss->opts->zerocopy) {
+		for (int i = 0; i < 2; ++i) {
+			printf("Zerocopy %s -> %s: %llu sends of %llu bytes, "
+					"%llu bytes copied by the kernel\n",
+					flows[i]->hd.from, flows[i]->hd.to,
+					flows[i]->zc_state.sends,
+					flows[i]->zc_state.bytes,
+					flows[i]->zc_state.copied);
+		}
+	}
+}
+
+void session_destroy(struct session *ss) {
+	if (ss->AtoB.ad)
+		adapt_uncharge(ss->AtoB.buf.sz + ss->BtoA.buf.sz);
+
+	if (ss->mr)
+		mirror_destroy(ss->mr);
+
+	hexdump_destroy(&ss->BtoA.hd);
+	hexdump_destroy(&ss->AtoB.hd);
+	circular_buffer_destroy(&ss->BtoA.buf);
+	circular_buffer_destroy(&ss->AtoB.buf);
+
+	free(ss->out_filenames[0]);
+	free(ss->out_filenames[1]);
+
+	shutdown_and_close(&ss->A);
+	shutdown_and_close(&ss->B);
+}
@@ -0,0 +1,189 @@
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#include <sys/select.h>
+#include <stdbool.h>
+
+#include "endpoint.h"
+#include "circular_buffer.h"
+#include "hexdump.h"
+#include "zerocopy.h"
+#include "stall.h"
+#include "analyzer.h"
+#include "adapt.h"
+#include "mirror.h"
+
+struct options;
+
+/*
+ * Status of a pipe (flow) returned by enable_read_write:
+ *  - PIPE_OPEN means that the pipe is still alive
+ *  - PIPE_CLOSED means that the producer is closed and no more data
+ *	is ready to send (buffer is empty): shutdown the consumer
+ *  - PIPE_BROKEN means that the we have data ready to send but the
+ *	consumer is closed so the pipe is broken: shutdown the producer
+ *  */
+enum pipe_status {
+	PIPE_OPEN,
+	PIPE_CLOSED,
+	PIPE_BROKEN
+};
+
+/* struct flow: one direction of a session, from the producer
+ * to the consumer, with its buffer and hexdump.
+ *
+ * The zerocopy, analyzer and adapt pointers are NULL if they are
+ * disabled otherwise they point to the zc_state, an_state and
+ * ad_state respectively. The mirror pointer is the session's mirror
+ * in the flow A -> B, if any, as its buffer is shared with the
+ * shadow; NULL otherwise.
+ * */
+struct flow {
+	struct endpoint *producer;
+	struct endpoint *consumer;
+	enum pipe_status status;
+	bool read_requested;
+
+	struct circular_buffer_t buf;
+	struct hexdump hd;
+
+	struct zerocopy *zc;
+	struct zerocopy zc_state;
+
+	struct analyzer *an;
+	struct analyzer an_state;
+
+	struct adapt *ad;
+	struct adapt ad_state;
+
+	struct mirror *mr;
+
+	/* the consumer could not take more data the last time that
+	 * it was written (see update_adapt) */
+	bool consumer_blocked;
+
+	struct stall full;
+	struct stall unsent;
+	unsigned int consumed;
+
+	/* the buffer was used since its memory was released (committed),
+	 * it is empty since idle_since (TIMER_NEVER if it is not) and
+	 * idle_offset is how many bytes were produced by then
+	 * (see update_idle) */
+	bool committed;
+	long long idle_since;
+	unsigned int idle_offset;
+};
+
+/* struct session: a channel between A and B made of two flows,
+ * A -> B and B -> A.
+ *
+ * In the single session mode the endpoints are named A and B; with
+ * multiple sessions they are named A#<id> and B#<id>.
+ *
+ * The mirror pointer is NULL if there is no shadow B (see
+ * struct mirror) otherwise it points to mr_state; the shadow is
+ * named S or S#<id>.
+ * */
+struct session {
+	unsigned int id;
+	struct endpoint A;
+	struct endpoint B;
+
+	struct flow AtoB;
+	struct flow BtoA;
+
+	struct options *opts;
+	long long start;
+	const char *colors[2];
+
+	char names[2][32];
+	char *out_filenames[2];
+
+	struct mirror *mr;
+	struct mirror mr_state;
+
+	/* the backend of B of the session (see struct balancer), set
+	 * by the server */
+	int backend;
+
+	/* the session was taken over from another tiburoncin (see
+	 * handoff.h): its output files are appended to, not truncated.
+	 * Set before session_init */
+	bool resumed;
+
+	struct session *next;
+};
+
+/*
+ * Build the name of an output file for the session id
+ * suffixing it with the id: <filename>.<id>
+ *
+ * Return NULL if filename is NULL or on error; otherwise the caller
+ * must free the name returned.
+ * */
+char* session_filename(const char *filename, unsigned int id);
+
+/*
+ * Initialize the session once both endpoints A and B are connected:
+ * allocate the buffers and hexdumps and set up the optional
+ * zerocopy, analyzer and stall detectors as configured in opts.
+ *
+ * An id of 0 means the single session mode; otherwise, the names of
+ * the endpoints and the output files (if any) are suffixed with it.
+ *
+ * The times of the events are relative to start (in microseconds).
+ *
+ * On error, print the reason to stderr, free any allocated resource
+ * (but it does not close A nor B) and return -1.
+ * */
+int session_init(struct session *ss, unsigned int id, struct options *opts,
+		const char *colors[2], long long start);
+
+/*
+ * Set the file descriptors to wait for in rfds and wfds and update
+ * *nfds (highest file descriptor plus one) and *deadline.
+ *
+ * Return false if the session finished: no data can be sent from
+ * A to B nor B to A.
+ * */
+bool session_fill(struct session *ss, fd_set *rfds, fd_set *wfds,
+		int *nfds, long long *deadline);
+
+/*
+ * Relay the data between A and B for the file descriptors ready in
+ * rfds and wfds.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int session_process(struct session *ss, fd_set *rfds, fd_set *wfds,
+		long long now);
+
+/*
+ * Stop reading from A and B: each flow finishes once the data in its
+ * buffer is sent and then the consumer is shutdown for writing, as
+ * when the producer closes (see enum pipe_status).
+ * */
+void session_drain(struct session *ss);
+
+/*
+ * Print the TCP_INFO of both legs and the queues of both directions.
+ * See tcpinfo_print and queues_print.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int session_print_tcpinfo(struct session *ss, long long now);
+int session_print_queues(struct session *ss, long long now);
+
+/*
+ * Print the summary of the session (stalls, analyzer, zerocopy)
+ * as configured in its options.
+ * */
+void session_summary_print(struct session *ss, long long now);
+
+/*
+ * Free the buffers and hexdumps, shutdown and close both endpoints.
+ * */
+void session_destroy(struct session *ss);
+
+#endif
@@ -0,0 +1,492 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "resolver.h"
+#include "timer.h"
+
+#include "signal.h"
+
+/*
+ * An entry of the cache. It is referenced by the cache (while it is
+ * in the cache) and by each query that has it as its result.
+ *
+ * The entries of Unix sockets are not in the cache and their result
+ * is a struct unix_addrinfo.
+ * */
+struct resolver_entry {
+	char *host;
+	char *serv;
+	struct addrinfo *result;
+	bool is_unix;
+	long long expires_at;
+
+	int refs;
+	struct resolver_entry *next;
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool stop;
+	bool busy;	/* a lookup is in progress */
+
+	long long ttl;
+	struct resolver_query *queue;
+	struct resolver_query **queue_tail;
+	struct resolver_entry *cache;
+
+	unsigned long long lookups;
+	unsigned long long hits;
+	unsigned long long failed;
+} resolver;
+
+/*
+ * Notification pipe of the calling thread (see resolver_attach): the
+ * resolver thread writes, the event loop of the thread reads.
+ * */
+static _Thread_local int notify_pipe[2] = { -1, -1 };
+
+struct unix_addrinfo {
+	struct addrinfo ai;
+	struct sockaddr_un addr;
+};
+
+static
+void entry_unref(struct resolver_entry *e) {
+	if (--e->refs > 0)
+		return;
+
+	if (e->is_unix)
+		free(e->result);
+	else
+		freeaddrinfo(e->result);
+
+	free(e->host);
+	free(e->serv);
+	free(e);
+}
+
+static
+void query_free(struct resolver_query *q) {
+	if (q->entry)
+		entry_unref(q->entry);
+
+	free(q->host);
+	free(q->serv);
+	free(q);
+}
+
+/*
+ * Find host:serv in the cache evicting the entries expired.
+ * Must be called with the mutex locked.
+ * */
+static
+struct resolver_entry* cache_lookup(const char *host, const char *serv,
+		long long now) {
+	struct resolver_entry **ep = &resolver.cache;
+	struct resolver_entry *found = NULL;
+
+	while (*ep) {
+		struct resolver_entry *e = *ep;
+
+		if (now >= e->expires_at) {
+			*ep = e->next;
+			entry_unref(e);
+			continue;
+		}
+
+		if (strcmp(e->host, host) == 0 && strcmp(e->serv, serv) == 0)
+			found = e;
+
+		ep = &e->next;
+	}
+
+	return found;
+}
+
+/*
+ * Save the result of a lookup into the cache.
+ * Must be called with the mutex locked.
+ * */
+static
+struct resolver_entry* cache_insert(const char *host, const char *serv,
+		struct addrinfo *result, long long now) {
+	struct resolver_entry *e = malloc(sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->host = strdup(host);
+	e->serv = strdup(serv);
+	if (!e->host || !e->serv) {
+		free(e->host);
+		free(e->serv);
+		free(e);
+		return NULL;
+	}
+
+	e->result = result;
+	e->is_unix = false;
+	e->expires_at = now + resolver.ttl;
+	e->refs = 1;	/* the cache's reference */
+
+	e->next = resolver.cache;
+	resolver.cache = e;
+	return e;
+}
+
+/*
+ * Free the queries queued and the cache once the resolver stopped (see
+ * resolver_destroy). The queries not released yet are completed with
+ * ECANCELED instead.
+ * Must be called with the mutex locked.
+ * */
+static
+void resolver_clear() {
+	while (resolver.queue) {
+		struct resolver_query *q = resolver.queue;
+		resolver.queue = q->next;
+
+		if (q->cancelled) {
+			query_free(q);
+		}
+		else {
+			q->error = EAI_SYSTEM;
+			q->last_errno = ECANCELED;
+			q->done = true;
+		}
+	}
+	resolver.queue_tail = &resolver.queue;
+
+	while (resolver.cache) {
+		struct resolver_entry *e = resolver.cache;
+		resolver.cache = e->next;
+		entry_unref(e);
+	}
+}
+
+static
+void notify(struct resolver_query *q) {
+	int s;
+	char c = 0;
+
+	/* if the pipe is full there are notifications pending anyway */
+	EINTR_RETRY(write(q->notify_fd, &c, 1));
+}
+
+static
+void* resolver_thread(void *arg) {
+	struct addrinfo hints;
+	(void)arg;	/* the state of the resolver is global */
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pthread_mutex_lock(&resolver.mutex);
+	while (1) {
+		while (!resolver.queue && !resolver.stop)
+			pthread_cond_wait(&resolver.cond, &resolver.mutex);
+
+		if (resolver.stop)
+			break;
+
+		struct resolver_query *q = resolver.queue;
+		resolver.queue = q->next;
+		if (!resolver.queue)
+			resolver.queue_tail = &resolver.queue;
+
+		/* the lookup is done without the lock */
+		resolver.busy = true;
+		pthread_mutex_unlock(&resolver.mutex);
+
+		struct addrinfo *result = NULL;
+		int error = getaddrinfo(q->host, q->serv, &hints, &result);
+		int last_errno = errno;
+
+		pthread_mutex_lock(&resolver.mutex);
+		resolver.busy = false;
+
+		/* resolver_destroy did not wait for us: the notification
+		 * pipe may be closed already, drop the result */
+		if (resolver.stop) {
+			if (error == 0)
+				freeaddrinfo(result);
+
+			q->next = resolver.queue;
+			resolver.queue = q;
+			break;
+		}
+
+		if (error == 0) {
+			struct resolver_entry *e = cache_insert(q->host, q->serv,
+					result, monotonic_us());
+			if (e) {
+				e->refs += 1;	/* the query's reference */
+				q->entry = e;
+			}
+			else {
+				freeaddrinfo(result);
+				error = EAI_MEMORY;
+			}
+		}
+		else {
+			resolver.failed += 1;
+		}
+
+		q->error = error;
+		q->last_errno = last_errno;
+		q->done = true;
+
+		if (q->cancelled)
+			query_free(q);
+		else
+			notify(q);
+	}
+
+	resolver_clear();
+	pthread_mutex_unlock(&resolver.mutex);
+
+	return NULL;
+}
+
+bool resolver_is_unix(const char *host) {
+	return strcmp(host, RESOLVER_UNIX_HOST) == 0;
+}
+
+int resolver_unix_address(const char *path, struct sockaddr_un *addr,
+		socklen_t *len) {
+	size_t pathlen = strlen(path);
+
+	/* the path must fit with its '\0' except for the abstract
+	 * sockets that use the leading '\0' instead */
+	if (pathlen == 0 || pathlen >= sizeof(addr->sun_path)
+			|| (path[0] == '@' && pathlen == 1)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, pathlen);
+
+	if (path[0] == '@') {
+		/* abstract socket: the name is not null terminated */
+		addr->sun_path[0] = 0;
+		*len = offsetof(struct sockaddr_un, sun_path) + pathlen;
+	}
+	else {
+		*len = offsetof(struct sockaddr_un, sun_path) + pathlen + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve the Unix socket of the query right away.
+ * */
+static
+void resolve_unix(struct resolver_query *q) {
+	struct resolver_entry *e = calloc(1, sizeof(*e));
+	struct unix_addrinfo *uai = calloc(1, sizeof(*uai));
+	socklen_t len;
+
+	q->done = true;
+	if (!e || !uai) {
+		free(e);
+		free(uai);
+		q->error = EAI_MEMORY;
+		return;
+	}
+
+	if (resolver_unix_address(q->serv, &uai->addr, &len) != 0) {
+		free(e);
+		free(uai);
+		q->error = EAI_SYSTEM;
+		q->last_errno = errno;
+		return;
+	}
+
+	uai->ai.ai_family = AF_UNIX;
+	uai->ai.ai_socktype = SOCK_STREAM;
+	uai->ai.ai_addr = (struct sockaddr*) &uai->addr;
+	uai->ai.ai_addrlen = len;
+
+	e->result = &uai->ai;
+	e->is_unix = true;
+	e->refs = 1;	/* the query's reference only */
+	q->entry = e;
+}
+
+int resolver_init(int ttl) {
+	int s;
+
+	memset(&resolver, 0, sizeof(resolver));
+	resolver.ttl = ttl * 1000LL;
+	resolver.queue_tail = &resolver.queue;
+
+	if (resolver_attach() != 0)
+		return -1;
+
+	pthread_mutex_init(&resolver.mutex, NULL);
+	pthread_cond_init(&resolver.cond, NULL);
+
+	/* the thread inherits the signal mask: all of them blocked */
+	if ((s = pthread_create(&resolver.thread, NULL, resolver_thread, NULL)) != 0) {
+		resolver_detach();
+		errno = s;
+		return -1;
+	}
+
+	return 0;
+}
+
+int resolver_attach() {
+	if (pipe(notify_pipe) == -1)
+		return -1;
+
+	if (fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK) == -1
+			|| fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		int last_errno = errno;
+		resolver_detach();
+		errno = last_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+void resolver_detach() {
+	int s;
+
+	if (notify_pipe[0] == -1)
+		return;
+
+	EINTR_RETRY(close(notify_pipe[0]));
+	EINTR_RETRY(close(notify_pipe[1]));
+	notify_pipe[0] = notify_pipe[1] = -1;
+}
+
+int resolver_fd() {
+	return notify_pipe[0];
+}
+
+void resolver_drain() {
+	int s;
+	char buf[64];
+
+	do {
+		EINTR_RETRY(read(notify_pipe[0], buf, sizeof(buf)));
+	} while (s > 0);
+}
+
+struct resolver_query* resolver_submit(const char *host, const char *serv) {
+	struct resolver_query *q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->host = strdup(host);
+	q->serv = strdup(serv);
+	if (!q->host || !q->serv) {
+		query_free(q);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (resolver_is_unix(host)) {
+		resolve_unix(q);
+		return q;
+	}
+
+	q->notify_fd = notify_pipe[1];
+
+	pthread_mutex_lock(&resolver.mutex);
+	resolver.lookups += 1;
+
+	struct resolver_entry *e = cache_lookup(host, serv, monotonic_us());
+	if (e) {
+		resolver.hits += 1;
+		e->refs += 1;
+		q->entry = e;
+		q->done = true;
+	}
+	else {
+		*resolver.queue_tail = q;
+		resolver.queue_tail = &q->next;
+		pthread_cond_signal(&resolver.cond);
+	}
+
+	pthread_mutex_unlock(&resolver.mutex);
+	return q;
+}
+
+bool resolver_query_done(struct resolver_query *q, int *error,
+		struct addrinfo **result) {
+	pthread_mutex_lock(&resolver.mutex);
+	bool done = q->done;
+	pthread_mutex_unlock(&resolver.mutex);
+
+	if (done) {
+		*error = q->error;
+		if (q->error == EAI_SYSTEM)
+			errno = q->last_errno;
+
+		*result = q->entry? q->entry->result : NULL;
+	}
+
+	return done;
+}
+
+void resolver_release(struct resolver_query *q) {
+	pthread_mutex_lock(&resolver.mutex);
+
+	if (q->done) {
+		query_free(q);
+	}
+	else {
+		/* still queued or in progress: the thread will free it */
+		q->cancelled = true;
+	}
+
+	pthread_mutex_unlock(&resolver.mutex);
+}
+
+void resolver_summary_print() {
+	pthread_mutex_lock(&resolver.mutex);
+	printf("Resolver: %llu lookups, %llu from the cache, %llu failed\n",
+			resolver.lookups, resolver.hits, resolver.failed);
+	pthread_mutex_unlock(&resolver.mutex);
+}
+
+void resolver_destroy() {
+	pthread_mutex_lock(&resolver.mutex);
+	resolver.stop = true;
+	bool busy = resolver.busy;
+	pthread_cond_signal(&resolver.cond);
+	pthread_mutex_unlock(&resolver.mutex);
+
+	/*
+	 * A lookup in progress may take a while (see resolv.conf(5)):
+	 * do not wait for it. Either way, the thread frees the queue and
+	 * the cache and it does not notify anymore.
+	 * */
+	if (busy)
+		pthread_detach(resolver.thread);
+	else
+		pthread_join(resolver.thread, NULL);
+
+	resolver_detach();
+}
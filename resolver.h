@@ -0,0 +1,139 @@
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdbool.h>
+
+/*
+ * The host of the endpoints that are Unix sockets (unix:<path>):
+ * the service is the path of the socket or, if it starts with '@',
+ * the name of an abstract socket (see unix(7)).
+ * */
+#define RESOLVER_UNIX_HOST "unix"
+
+/*
+ * Asynchronous resolution of host:serv addresses.
+ *
+ * getaddrinfo(3) blocks and a slow resolver would stall the relay of
+ * all the sessions so the lookups are done by a resolver thread.
+ * The thread notifies the completion of a query making readable the
+ * file descriptor returned by resolver_fd: the event loop waits for
+ * it and calls resolver_drain when it is ready.
+ *
+ * The results are kept in a cache for ttl milliseconds so repeated
+ * connections to the same endpoint reuse them. Failed lookups are
+ * not cached.
+ *
+ * The Unix sockets are resolved right away without the thread
+ * nor the cache.
+ *
+ * There is only one resolver per process: resolver_init must be called
+ * once, with all the signals blocked, before any other function.
+ * Each thread that submits queries has its own notification file
+ * descriptor (see resolver_attach).
+ * */
+struct addrinfo;
+
+struct resolver_entry;
+
+struct resolver_query {
+	char *host;
+	char *serv;
+
+	bool done;
+	bool cancelled;
+	int error;
+	int last_errno;
+	struct resolver_entry *entry;
+	int notify_fd;
+
+	struct resolver_query *next;
+};
+
+/*
+ * Return true if host is RESOLVER_UNIX_HOST.
+ * */
+bool resolver_is_unix(const char *host);
+
+/*
+ * Fill addr and *len with the address of the Unix socket named path
+ * (see RESOLVER_UNIX_HOST).
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int resolver_unix_address(const char *path, struct sockaddr_un *addr,
+		socklen_t *len);
+
+/*
+ * Start the resolver thread with a cache whose entries live for ttl
+ * milliseconds.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int resolver_init(int ttl);
+
+/*
+ * Set up the notification file descriptor of the calling thread so
+ * it can submit queries. resolver_init does it for the thread that
+ * calls it; any other thread must call resolver_attach before
+ * resolver_submit and resolver_detach, once all its queries were
+ * released, before exiting.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int resolver_attach();
+void resolver_detach();
+
+/*
+ * The file descriptor to wait for reading: it is ready when a query
+ * submitted by the calling thread completes.
+ * */
+int resolver_fd();
+
+/*
+ * Discard the pending notifications of resolver_fd of the calling thread.
+ * */
+void resolver_drain();
+
+/*
+ * Resolve host:serv (a TCP service or a Unix socket). If the addresses
+ * are in the cache the query is done right away, otherwise the query
+ * is queued for the resolver thread.
+ *
+ * Return NULL on error (errno is set appropriately).
+ * */
+struct resolver_query* resolver_submit(const char *host, const char *serv);
+
+/*
+ * Return true if the query is done. Then, on success, set
+ * *error to 0 and *result to the list of the addresses resolved;
+ * on error set *error to the error code of getaddrinfo(3) (see
+ * gai_strerror) and, if it is EAI_SYSTEM, errno too.
+ *
+ * The result is valid until the query is released.
+ * */
+bool resolver_query_done(struct resolver_query *q, int *error,
+		struct addrinfo **result);
+
+/*
+ * Release the query and its result. If the query is still in progress
+ * it is cancelled.
+ * */
+void resolver_release(struct resolver_query *q);
+
+/*
+ * Print how many lookups were done and how many were from the cache.
+ * */
+void resolver_summary_print();
+
+/*
+ * Stop the resolver thread and free the cache and the queries queued.
+ *
+ * A lookup in progress is not waited for: the thread drops its result
+ * and frees the rest once it completes.
+ * */
+void resolver_destroy();
+
+#endif
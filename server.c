@@ -0,0 +1,1282 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/select.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "server.h"
+#include "relay.h"
+#include "pool.h"
+#include "endpoint.h"
+#include "socket.h"
+#include "cmdline.h"
+#include "timer.h"
+#include "resolver.h"
+#include "affinity.h"
+#include "adapt.h"
+#include "slab.h"
+#include "config.h"
+#include "balancer.h"
+#include "handoff.h"
+#include "busypoll.h"
+
+#include "signal.h"
+
+/*
+ * A connection from A accepted that it is waiting for its connection
+ * to B.
+ * */
+struct pending {
+	unsigned int id;
+	struct endpoint A;
+	struct endpoint B;
+	struct connector c;
+
+	/* the backend of B tried and how many were tried so far */
+	int backend;
+	int attempts;
+
+	struct pending *next;
+};
+
+/*
+ * A route served by a worker: it accepts the connections from A on its
+ * own listening socket and owns its sessions, pendings and pool end to
+ * end so the workers do not share any state but the resolver's.
+ *
+ * The sessions and the pendings are recycled by the slabs of the
+ * server (see struct slab) so accepting and closing sessions does not
+ * allocate memory once the server reached its peak.
+ *
+ * The sessions' ids are unique among the workers: the worker i
+ * (from 0) takes the ids i+1, i+1+n, i+1+2n... for n workers (stride).
+ *
+ * The sessions are spread among the backends of B by the balancer
+ * (with a single one, B, it just counts its sessions).
+ * */
+struct server {
+	struct endpoint A;
+	struct options *opts;
+	const char **colors;
+
+	/* the name of the route, empty for the route of the command line */
+	const char *tag;
+
+	struct pool pool;
+	struct balancer balancer;
+	struct pending *pendings;
+	struct session *sessions;
+
+	struct slab session_slab;
+	struct slab pending_slab;
+
+	struct ticker tcpinfo_ticker;
+	struct ticker queues_ticker;
+
+	/* it does not listen nor have a pool anymore (see server_drain) */
+	bool draining;
+
+	/* its listening socket and sessions are shared with another
+	 * tiburoncin (see handoff.h): they are closed without shutting
+	 * them down */
+	bool handed_off;
+
+	/* its listening socket is shared with the other workers or it
+	 * was inherited from the parent process (see server_listen):
+	 * it is closed without shutting it down */
+	bool shared_listener;
+
+	/* it created the file of its Unix socket (or took it over, see
+	 * handoff.h): it is removed when the socket is closed */
+	bool owns_address;
+
+	unsigned int next_id;
+	unsigned int stride;
+	long long start;
+
+	/* counters, merged by server_run on exit */
+	unsigned int accepted;
+	unsigned long long bytes[2];
+};
+
+/*
+ * A worker: it serves all the routes, a server each, from a single
+ * event loop (see worker_loop). Its buffers are recycled by its cache
+ * (see struct slab_buffers).
+ * */
+struct worker {
+	int index;
+	struct server *srvs;
+	int nsrvs;
+	struct options *opts;
+
+	struct slab_buffers buffers;
+
+	/* the drain deadline expired before all the sessions finished */
+	bool expired;
+
+	/* the wait of its event loop (see worker_loop) */
+	struct busypoll bp;
+
+	/* the listening socket for the handoff to a new tiburoncin
+	 * (see handoff.h), -1 if there is none */
+	int handoff_fd;
+
+	/* the threads' stuff, unused with a single worker */
+	pthread_t thread;
+	pthread_t main_thread;
+	sigset_t *set;
+	atomic_bool *stop;
+	atomic_bool *drain;
+	atomic_int *running;
+
+	/* it runs in the main thread so it sees the user's signals
+	 * (interrupted and draining) itself; otherwise the main thread
+	 * sets stop and drain for it */
+	bool main_thread_signals;
+	int ret;
+};
+
+/*
+ * Open a new session between A and B.
+ * On error, close both and return -1.
+ * */
+static
+int server_open_session(struct server *srv, unsigned int id,
+		struct endpoint *A, struct endpoint *B, int backend) {
+	/* we use select(2) so we cannot handle higher descriptors */
+	if (B->fd >= FD_SETSIZE) {
+		fprintf(stderr, "Too many connections, session %s#%u refused\n",
+				srv->tag, id);
+		goto alloc_failed;
+	}
+
+	struct session *ss = slab_alloc(&srv->session_slab);
+	if (!ss) {
+		perror("Session allocation failed");
+		goto alloc_failed;
+	}
+
+	ss->A = *A;
+	ss->B = *B;
+	ss->A.host = srv->A.host;
+	ss->A.serv = srv->A.serv;
+	ss->resumed = false;
+
+	if (session_init(ss, id, srv->opts, srv->colors, srv->start) != 0)
+		goto init_failed;
+
+	ss->backend = backend;
+	if (srv->balancer.n > 1)
+		printf("Session %s#%u opened to B %s:%s\n", srv->tag, id,
+				B->host, B->serv);
+	else
+		printf("Session %s#%u opened\n", srv->tag, id);
+
+	ss->next = srv->sessions;
+	srv->sessions = ss;
+	return 0;
+
+init_failed:
+	slab_free(&srv->session_slab, ss);
+
+alloc_failed:
+	balancer_release(&srv->balancer, backend);
+	shutdown_and_close(A);
+	shutdown_and_close(B);
+	return -1;
+}
+
+static
+void server_close_session(struct server *srv, struct session *ss,
+		long long now) {
+	srv->bytes[0] += ss->AtoB.hd.offset;
+	srv->bytes[1] += ss->BtoA.hd.offset;
+
+	/* keep the summary together: other workers may be printing */
+	flockfile(stdout);
+	session_summary_print(ss, now);
+	printf("Session %s#%u closed\n", srv->tag, ss->id);
+	funlockfile(stdout);
+
+	balancer_release(&srv->balancer, ss->backend);
+	session_destroy(ss);
+	slab_free(&srv->session_slab, ss);
+}
+
+/*
+ * Close the session handed off to another tiburoncin: both directions
+ * are marked as shutdown so its sockets are only closed and the other
+ * one keeps relaying them (see shutdown(2)).
+ * */
+static
+void server_release_session(struct server *srv, struct session *ss) {
+	srv->bytes[0] += ss->AtoB.hd.offset;
+	srv->bytes[1] += ss->BtoA.hd.offset;
+	printf("Session %s#%u handed off\n", srv->tag, ss->id);
+
+	ss->A.eof = ss->B.eof = 3;
+	balancer_release(&srv->balancer, ss->backend);
+	session_destroy(ss);
+	slab_free(&srv->session_slab, ss);
+}
+
+/*
+ * Select the backend of B of a new session. For the least outstanding
+ * bytes policy, the bytes in the buffers of the sessions of each
+ * backend are counted first (all of them, also the ones past the
+ * wrap around of the buffer).
+ * */
+static
+int server_pick_backend(struct server *srv, long long now) {
+	struct balancer *bl = &srv->balancer;
+
+	if (bl->policy == BALANCE_LEAST_BYTES) {
+		for (int i = 0; i < bl->n; ++i)
+			bl->backends[i].outstanding = 0;
+
+		for (struct session *ss = srv->sessions; ss; ss = ss->next) {
+			bl->backends[ss->backend].outstanding +=
+				circular_buffer_get_total_ready(&ss->AtoB.buf)
+				+ circular_buffer_get_total_ready(&ss->BtoA.buf);
+		}
+	}
+
+	return balancer_pick(bl, now);
+}
+
+/*
+ * Start the connection of the pending pd to the backend of B selected
+ * by the balancer.
+ * */
+static
+void server_connect_pending(struct server *srv, struct pending *pd,
+		long long now) {
+	pd->backend = server_pick_backend(srv, now);
+	pd->attempts += 1;
+
+	struct endpoint *be = srv->balancer.backends[pd->backend].B;
+	pd->B.host = be->host;
+	pd->B.serv = be->serv;
+	connector_start(&pd->c, &pd->B, srv->opts->skt_buf_sizes,
+			&srv->opts->tuning[1], &srv->opts->copts, now);
+}
+
+/*
+ * Accept all the pending connections from A. For each, take a
+ * connection to B from the pool or start a new one.
+ * */
+static
+void server_accept(struct server *srv, long long now) {
+	struct endpoint A, B;
+
+	while (accept_connection(srv->A.fd, &A, &srv->opts->tuning[0]) == 0) {
+		/* we use select(2) so we cannot handle higher descriptors */
+		if (A.fd >= FD_SETSIZE) {
+			fprintf(stderr, "Too many connections, connection from A refused\n");
+			shutdown_and_close(&A);
+			continue;
+		}
+
+		unsigned int id = srv->next_id;
+		srv->next_id += srv->stride;
+		srv->accepted += 1;
+		if (srv->opts->pool_size && pool_take(&srv->pool, &B) == 0) {
+			/* the pool is of B only, the single backend */
+			server_open_session(srv, id, &A, &B,
+					balancer_pick(&srv->balancer, now));
+			continue;
+		}
+
+		struct pending *pd = slab_alloc(&srv->pending_slab);
+		if (!pd) {
+			perror("Session allocation failed");
+			shutdown_and_close(&A);
+			continue;
+		}
+
+		pd->id = id;
+		pd->A = A;
+		pd->attempts = 0;
+		server_connect_pending(srv, pd, now);
+
+		pd->next = srv->pendings;
+		srv->pendings = pd;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+		perror("Accept a connection from A failed");
+}
+
+/*
+ * Open the sessions of the pending connections whose connection to B
+ * completed and drop the ones that failed. A failed backend is ejected
+ * and the connection is tried with the next one, if any is available.
+ * */
+static
+void server_process_pendings(struct server *srv, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	struct pending **pp = &srv->pendings;
+
+	while (*pp) {
+		struct pending *pd = *pp;
+		enum connector_state state = connector_process(&pd->c, rfds, wfds, now);
+
+		if (state != CONNECTOR_DONE && state != CONNECTOR_FAILED) {
+			pp = &pd->next;
+			continue;
+		}
+
+		if (state == CONNECTOR_FAILED) {
+			balancer_failed(&srv->balancer, pd->backend, now);
+			if (pd->attempts < srv->balancer.n
+					&& balancer_available(&srv->balancer, now)) {
+				server_connect_pending(srv, pd, now);
+				pp = &pd->next;
+				continue;
+			}
+		}
+
+		*pp = pd->next;
+		if (state == CONNECTOR_DONE) {
+			pd->B.fd = pd->c.fd;
+			pd->B.eof = 0;
+			pd->B.quickack = (srv->opts->tuning[1].quickack == 1);
+			balancer_connected(&srv->balancer, pd->backend);
+			server_open_session(srv, pd->id, &pd->A, &pd->B,
+					pd->backend);
+		}
+		else {
+			fprintf(stderr, "Session %s#%u: connection to B failed: %s\n",
+					srv->tag, pd->id, strerror(pd->c.last_errno));
+			shutdown_and_close(&pd->A);
+		}
+
+		slab_free(&srv->pending_slab, pd);
+	}
+}
+
+/*
+ * Set the file descriptors of the server to wait for (its listening
+ * socket, pool, pendings and sessions) and update *nfds and *deadline.
+ * The sessions that finished are closed.
+ * */
+static
+void server_fill(struct server *srv, fd_set *rfds, fd_set *wfds,
+		int *nfds, long long *deadline, long long now) {
+	struct options *opts = srv->opts;
+
+	if (!srv->draining) {
+		FD_SET(srv->A.fd, rfds);
+		if (srv->A.fd >= *nfds)
+			*nfds = srv->A.fd + 1;
+	}
+
+	if (opts->tcpinfo_interval)
+		timer_update_deadline(deadline, srv->tcpinfo_ticker.next);
+	if (opts->queues_interval)
+		timer_update_deadline(deadline, srv->queues_ticker.next);
+
+	if (opts->pool_size && !srv->draining)
+		pool_fill(&srv->pool, rfds, wfds, nfds, deadline);
+
+	for (struct pending *pd = srv->pendings; pd; pd = pd->next)
+		connector_fill(&pd->c, rfds, wfds, nfds, deadline);
+
+	for (struct session **sp = &srv->sessions; *sp; ) {
+		struct session *ss = *sp;
+		if (session_fill(ss, rfds, wfds, nfds, deadline)) {
+			sp = &ss->next;
+			continue;
+		}
+
+		/* the session is done: do not wait for its sockets */
+		FD_CLR(ss->A.fd, rfds);
+		FD_CLR(ss->B.fd, rfds);
+		*sp = ss->next;
+		server_close_session(srv, ss, now);
+	}
+}
+
+/*
+ * Process the events of the server ready in rfds and wfds.
+ * */
+static
+void server_process(struct server *srv, fd_set *rfds, fd_set *wfds,
+		long long now) {
+	struct options *opts = srv->opts;
+
+	if (opts->tcpinfo_interval && ticker_expired(&srv->tcpinfo_ticker, now)) {
+		for (struct session *ss = srv->sessions; ss; ss = ss->next)
+			session_print_tcpinfo(ss, now);
+	}
+
+	if (opts->queues_interval && ticker_expired(&srv->queues_ticker, now)) {
+		for (struct session *ss = srv->sessions; ss; ss = ss->next)
+			session_print_queues(ss, now);
+	}
+
+	for (struct session **sp = &srv->sessions; *sp; ) {
+		struct session *ss = *sp;
+		if (session_process(ss, rfds, wfds, now) == 0) {
+			sp = &ss->next;
+			continue;
+		}
+
+		*sp = ss->next;
+		server_close_session(srv, ss, now);
+	}
+
+	/*
+	 * The new sessions are opened after processing the current
+	 * ones: the events in rfds and wfds are not for them.
+	 * */
+	if (opts->pool_size && !srv->draining)
+		pool_process(&srv->pool, rfds, wfds, now);
+
+	server_process_pendings(srv, rfds, wfds, now);
+
+	if (!srv->draining && FD_ISSET(srv->A.fd, rfds))
+		server_accept(srv, now);
+}
+
+/*
+ * Drop the pending connections: no data was relayed for them yet.
+ * */
+static
+void server_drop_pendings(struct server *srv) {
+	while (srv->pendings) {
+		struct pending *pd = srv->pendings;
+		srv->pendings = pd->next;
+
+		connector_cancel(&pd->c);
+		balancer_release(&srv->balancer, pd->backend);
+		if (srv->handed_off)
+			pd->A.eof = 3;
+		shutdown_and_close(&pd->A);
+		slab_free(&srv->pending_slab, pd);
+	}
+}
+
+/*
+ * Hand off the listening socket, the sessions and the pendings of the
+ * server to the new tiburoncin connected to fd (see handoff.h).
+ *
+ * Once it acknowledges them, they are released: the server does not
+ * listen nor have any session anymore. On error, print the reason to
+ * stderr, keep them as if nothing had happened and return -1.
+ * */
+static
+int server_hand_off(struct server *srv, int fd) {
+	unsigned int n = 0;
+	for (struct session *ss = srv->sessions; ss; ss = ss->next)
+		n += 1;
+	for (struct pending *pd = srv->pendings; pd; pd = pd->next)
+		n += 1;
+
+	printf("Handing off %u sessions to the new tiburoncin...\n", n);
+	fflush(stdout);
+
+	if (handoff_send_hello(fd, srv->A.fd, n, srv->next_id) != 0)
+		goto failed;
+
+	for (struct session *ss = srv->sessions; ss; ss = ss->next) {
+		if (handoff_send_session(fd, ss) != 0)
+			goto failed;
+	}
+
+	for (struct pending *pd = srv->pendings; pd; pd = pd->next) {
+		if (handoff_send_pending(fd, pd->id, pd->backend, &pd->A) != 0)
+			goto failed;
+	}
+
+	if (handoff_recv_ack(fd) != 0)
+		goto failed;
+
+	srv->handed_off = true;
+	while (srv->sessions) {
+		struct session *ss = srv->sessions;
+		srv->sessions = ss->next;
+		server_release_session(srv, ss);
+	}
+
+	server_drop_pendings(srv);
+	return 0;
+
+failed:
+	perror("Handoff to the new tiburoncin failed");
+	return -1;
+}
+
+/*
+ * Take over the listening socket, the sessions and the pendings of the
+ * running tiburoncin connected to fd (see handoff.h); the listening
+ * socket was received with the hello already.
+ *
+ * The sockets keep the options set by the running one: the TCP tuning
+ * is not applied again.
+ *
+ * On error, print the reason to stderr and return -1; what was taken
+ * over so far is closed without shutting it down so the running one
+ * keeps relaying it.
+ * */
+static
+int server_take_over(struct server *srv, int fd, unsigned int n,
+		unsigned int next_id) {
+	int s;
+	struct options *opts = srv->opts;
+	struct balancer *bl = &srv->balancer;
+	long long now = monotonic_us();
+
+	struct handoff_session hs;
+	struct endpoint A, B;
+	struct session *ss;
+	struct pending *pd;
+
+	srv->handed_off = true;
+	for (unsigned int i = 0; i < n; ++i) {
+		if (handoff_recv_session(fd, &hs, &A, &B) != 0)
+			goto recv_failed;
+
+		/* the backends may have changed: fall back to the first */
+		int backend = (int)hs.backend < bl->n? (int)hs.backend : 0;
+		A.quickack = (opts->tuning[0].quickack == 1);
+
+		/* we use select(2) so we cannot handle higher descriptors */
+		if (A.fd >= FD_SETSIZE || (!hs.pending && B.fd >= FD_SETSIZE)) {
+			fprintf(stderr, "Too many connections, session %s#%u "
+					"cannot be taken over\n", srv->tag, hs.id);
+			EINTR_RETRY(close(A.fd));
+			if (!hs.pending)
+				EINTR_RETRY(close(B.fd));
+			return -1;
+		}
+
+		if (hs.pending) {
+			pd = slab_alloc(&srv->pending_slab);
+			if (!pd) {
+				perror("Session allocation failed");
+				EINTR_RETRY(close(A.fd));
+				return -1;
+			}
+
+			/* the connection to B starts over */
+			pd->id = hs.id;
+			pd->A = A;
+			pd->attempts = 0;
+			server_connect_pending(srv, pd, now);
+
+			pd->next = srv->pendings;
+			srv->pendings = pd;
+			printf("Session %s#%u taken over\n", srv->tag, hs.id);
+			continue;
+		}
+
+		B.host = bl->backends[backend].B->host;
+		B.serv = bl->backends[backend].B->serv;
+		B.quickack = (opts->tuning[1].quickack == 1);
+
+		ss = slab_alloc(&srv->session_slab);
+		if (!ss) {
+			perror("Session allocation failed");
+			goto alloc_failed;
+		}
+
+		ss->A = A;
+		ss->B = B;
+		ss->A.host = srv->A.host;
+		ss->A.serv = srv->A.serv;
+		ss->resumed = true;
+
+		if (session_init(ss, hs.id, opts, srv->colors, srv->start) != 0)
+			goto init_failed;
+
+		bl->backends[backend].conns += 1;
+		ss->backend = backend;
+		ss->next = srv->sessions;
+		srv->sessions = ss;
+
+		if (handoff_recv_buffers(fd, &hs, ss) != 0)
+			goto recv_failed;
+
+		printf("Session %s#%u taken over\n", srv->tag, hs.id);
+	}
+
+	if (handoff_send_ack(fd) != 0)
+		goto recv_failed;
+
+	srv->next_id = next_id;
+	srv->handed_off = false;
+	return 0;
+
+init_failed:
+	slab_free(&srv->session_slab, ss);
+
+alloc_failed:
+	EINTR_RETRY(close(A.fd));
+	EINTR_RETRY(close(B.fd));
+	return -1;
+
+recv_failed:
+	perror("Handoff from the running tiburoncin failed");
+	return -1;
+}
+
+/*
+ * Close the listening socket of the server. A shutdown would affect
+ * all the file descriptors of the socket, including the ones of the
+ * other workers, the parent process or the other tiburoncin (see
+ * shared_listener and handed_off) so it is done only if the socket is
+ * ours alone.
+ * */
+static
+void server_close_listener(struct server *srv) {
+	int s;
+
+	if (!srv->handed_off && !srv->shared_listener)
+		shutdown(srv->A.fd, SHUT_RDWR);
+	EINTR_RETRY(close(srv->A.fd));
+	if (s == -1)
+		perror("Close the listening socket failed");
+
+	if (!srv->handed_off && srv->owns_address)
+		unlink_listening(&srv->A);
+}
+
+/*
+ * Stop listening, drop the pendings and the pool and drain the
+ * sessions (see session_drain): they are closed as they finish.
+ * */
+static
+void server_drain(struct server *srv) {
+	server_close_listener(srv);
+
+	server_drop_pendings(srv);
+	if (srv->opts->pool_size)
+		pool_destroy(&srv->pool);
+
+	for (struct session *ss = srv->sessions; ss; ss = ss->next)
+		session_drain(ss);
+
+	srv->draining = true;
+}
+
+/*
+ * Accept the new tiburoncin and hand off the server of the worker to it
+ * (see server_hand_off).
+ *
+ * Return 0 if it took over, -1 otherwise: the worker keeps going.
+ * */
+static
+int worker_hand_off(struct worker *wk) {
+	int s;
+	int fd = handoff_accept(wk->handoff_fd);
+	if (fd == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+			perror("Accept the new tiburoncin failed");
+		return -1;
+	}
+
+	int ret = server_hand_off(&wk->srvs[0], fd);
+	EINTR_RETRY(close(fd));
+	return ret;
+}
+
+/*
+ * Wait for and process the events of the servers of the worker until
+ * the worker is stopped, with the signal mask set.
+ *
+ * Once the worker is told to drain, the servers are drained (see
+ * server_drain) and the loop ends when all their sessions finished
+ * or the drain deadline expired.
+ *
+ * The loop ends too once a new tiburoncin took the sessions over
+ * (see worker_hand_off).
+ *
+ * Return 0 if it was interrupted, stopped, drained or handed off,
+ * -1 on error.
+ * */
+static
+int worker_loop(struct worker *wk, sigset_t *set) {
+	int s;
+	long long now;
+	long long deadline;
+	long long drain_deadline = TIMER_NEVER;
+
+	/* the buffers are allocated and freed by this thread only
+	 * (see worker_finish) */
+	slab_buffers_attach(&wk->buffers);
+
+	for (;;) {
+		fd_set rfds, wfds;
+		int nfds = 0;
+
+		if (wk->main_thread_signals) {
+			if (interrupted)
+				atomic_store(wk->stop, true);
+			if (draining)
+				atomic_store(wk->drain, true);
+		}
+
+		if (atomic_load(wk->stop))
+			break;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+
+		if (atomic_load(wk->drain) && drain_deadline == TIMER_NEVER) {
+			if (wk->index == 0) {
+				printf("Draining the sessions for up to %i ms...\n",
+						wk->opts->drain_timeout);
+				fflush(stdout);
+			}
+
+			drain_deadline = monotonic_us()
+				+ wk->opts->drain_timeout * 1000LL;
+			for (int i = 0; i < wk->nsrvs; ++i)
+				server_drain(&wk->srvs[i]);
+
+			/* a new tiburoncin starts from scratch instead */
+			if (wk->handoff_fd != -1) {
+				EINTR_RETRY(close(wk->handoff_fd));
+				handoff_unlink(wk->opts->handoff);
+				wk->handoff_fd = -1;
+			}
+		}
+
+		deadline = drain_deadline;
+		now = monotonic_us();
+		for (int i = 0; i < wk->nsrvs; ++i)
+			server_fill(&wk->srvs[i], &rfds, &wfds, &nfds, &deadline, now);
+
+		if (drain_deadline != TIMER_NEVER) {
+			unsigned int left = 0;
+			for (int i = 0; i < wk->nsrvs; ++i) {
+				for (struct session *ss = wk->srvs[i].sessions; ss;
+						ss = ss->next)
+					left += 1;
+			}
+
+			if (!left)
+				return 0;
+
+			if (now >= drain_deadline) {
+				printf("Drain deadline expired, %u sessions dropped\n",
+						left);
+				wk->expired = true;
+				return 0;
+			}
+		}
+
+		if (wk->handoff_fd != -1) {
+			FD_SET(wk->handoff_fd, &rfds);
+			if (wk->handoff_fd >= nfds)
+				nfds = wk->handoff_fd + 1;
+		}
+
+		/* on EINTR check again if we were stopped or told to drain */
+		s = busypoll_wait(&wk->bp, nfds, &rfds, &wfds, deadline, set);
+
+		if (s == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("select call failed");
+			return -1;
+		}
+
+		now = monotonic_us();
+		for (int i = 0; i < wk->nsrvs; ++i)
+			server_process(&wk->srvs[i], &rfds, &wfds, now);
+
+		if (wk->handoff_fd != -1 && FD_ISSET(wk->handoff_fd, &rfds)
+				&& worker_hand_off(wk) == 0)
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Close the sessions, the pendings and the pool of the server, free
+ * its slabs and stop listening.
+ * */
+static
+void server_finish(struct server *srv) {
+	long long now = monotonic_us();
+
+	while (srv->sessions) {
+		struct session *ss = srv->sessions;
+		srv->sessions = ss->next;
+		if (srv->handed_off)
+			server_release_session(srv, ss);
+		else
+			server_close_session(srv, ss, now);
+	}
+
+	server_drop_pendings(srv);
+
+	slab_destroy(&srv->session_slab);
+	slab_destroy(&srv->pending_slab);
+
+	/* drained: it does not listen nor have a pool already */
+	if (srv->draining)
+		return;
+
+	if (srv->opts->pool_size)
+		pool_destroy(&srv->pool);
+
+	server_close_listener(srv);
+}
+
+
+/*
+ * Finish the servers of the worker and free its cache of buffers.
+ * */
+static
+void worker_finish(struct worker *wk) {
+	for (int i = 0; i < wk->nsrvs; ++i)
+		server_finish(&wk->srvs[i]);
+
+	slab_buffers_detach();
+	slab_buffers_destroy(&wk->buffers);
+}
+
+/*
+ * Thread of a worker: it has its own notification of the resolver
+ * and it waits with the wakeup mask so only SIGUSR1 interrupts it
+ * (see server_run).
+ * */
+static
+void* worker_thread(void *arg) {
+	struct worker *wk = arg;
+	struct options *opts = wk->opts;
+
+	if (opts->ncpus && affinity_pin(affinity_cpu(opts->cpus, opts->ncpus,
+					wk->index)) != 0) {
+		perror("CPU affinity setup failed");
+		goto setup_failed;
+	}
+
+	if (resolver_attach() != 0) {
+		perror("Resolver setup failed");
+		goto setup_failed;
+	}
+
+	wk->ret = worker_loop(wk, wk->set);
+	worker_finish(wk);
+	resolver_detach();
+	goto finished;
+
+setup_failed:
+	/* the rest of the server cannot take its share of the
+	 * connections: stop all the workers */
+	wk->ret = -1;
+	worker_finish(wk);
+	atomic_store(wk->stop, true);
+
+finished:
+
+	/* wake up the main thread: maybe we were the last one */
+	atomic_fetch_sub(wk->running, 1);
+	pthread_kill(wk->main_thread, SIGUSR1);
+	return NULL;
+}
+
+/*
+ * Listen on A for the server srv of the worker w. Unix sockets cannot
+ * share an address so the workers share the socket of the server of
+ * the first worker (first) instead. The same goes for a socket
+ * inherited (see inherit_listening): the first worker has it already.
+ *
+ * On error (including a socket too high for select(2)), return -1 and
+ * errno is set appropriately; 0 otherwise.
+ * */
+static
+int server_listen(struct server *srv, struct server *first, int w,
+		int workers) {
+	int s;
+	bool inherited = srv->opts->listen_fd != -1;
+	if (inherited && w == 0) {
+		srv->shared_listener = true;
+	}
+	else if (w > 0 && (inherited || resolver_is_unix(srv->A.host))) {
+		first->shared_listener = true;
+		srv->shared_listener = true;
+		srv->A.fd = dup(first->A.fd);
+		if (srv->A.fd == -1)
+			return -1;
+	}
+	else if (set_listening(&srv->A, srv->opts->skt_buf_sizes, SOMAXCONN,
+				workers > 1) == -1) {
+		return -1;
+	}
+	else {
+		srv->owns_address = true;
+	}
+
+	/* we use select(2) so we cannot handle higher descriptors */
+	if (srv->A.fd >= FD_SETSIZE) {
+		EINTR_RETRY(close(srv->A.fd));
+		errno = EMFILE;
+		return -1;
+	}
+
+	return 0;
+}
+
+static
+void print_counters(const char *what, const char *name, unsigned int accepted,
+		unsigned long long bytes[2]) {
+	printf("%s %s: %u sessions, %llu bytes A -> B, %llu bytes B -> A\n",
+			what, name, accepted, bytes[0], bytes[1]);
+}
+
+int server_run(struct route *routes, int nroutes, struct options *opts,
+		sigset_t *set) {
+	int ret = -1;
+	int s;
+	int workers = opts->workers;
+	int nsrvs = workers * nroutes;
+	int started = 0;
+	atomic_bool stop = false;
+	atomic_bool drain = false;
+	atomic_int running = 0;
+	sigset_t wakeset, mainset;
+
+	/* the server of the route r of the worker w is srvs[w*nroutes + r] */
+	struct server *srvs = calloc(nsrvs, sizeof(*srvs));
+	struct worker *wks = calloc(workers, sizeof(*wks));
+	if (!srvs || !wks) {
+		perror("Workers allocation failed");
+		free(srvs);
+		free(wks);
+		return ret;
+	}
+
+	long long start = monotonic_us();
+
+	/* a running tiburoncin hands off its sockets to us, if there
+	 * is one (see handoff.h) */
+	int handoff = -1;
+	unsigned int handoff_sessions = 0, handoff_next_id = 0;
+	if (opts->handoff) {
+		handoff = handoff_connect(opts->handoff);
+		if (handoff == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+			perror("Connect to the running tiburoncin failed");
+			free(srvs);
+			free(wks);
+			return ret;
+		}
+	}
+
+	int listening = 0;
+	for (; listening < nsrvs; ++listening) {
+		struct server *srv = &srvs[listening];
+		struct route *r = &routes[listening % nroutes];
+		int w = listening / nroutes;
+		char label[CONFIG_MAX_NAME + 16] = "";
+
+		if (r->name)
+			snprintf(label, sizeof(label), " (route %s)", r->name);
+
+		if (w == 0 && handoff == -1) {
+			printf("Listening for connections from A %s:%s%s...\n",
+					r->A.host, r->A.serv, label);
+		}
+
+		srv->A = r->A;
+		srv->opts = &r->opts;
+		srv->colors = r->colors;
+		srv->tag = r->name? r->name : "";
+		srv->next_id = w + 1;
+		srv->stride = workers;
+		srv->start = start;
+		ticker_init(&srv->tcpinfo_ticker,
+				r->opts.tcpinfo_interval * 1000LL, start);
+		ticker_init(&srv->queues_ticker,
+				r->opts.queues_interval * 1000LL, start);
+		balancer_init(&srv->balancer, r->opts.balance, r->opts.backends,
+				r->opts.nbackends);
+		slab_init(&srv->session_slab, sizeof(struct session));
+		slab_init(&srv->pending_slab, sizeof(struct pending));
+
+		/* a single server: -H is incompatible with -j and -C */
+		if (handoff != -1) {
+			printf("Taking over the connections from A %s:%s from "
+					"the running tiburoncin...\n",
+					r->A.host, r->A.serv);
+			if (handoff_recv_hello(handoff, &srv->A.fd, &handoff_sessions,
+						&handoff_next_id) != 0) {
+				perror("Handoff from the running tiburoncin failed");
+				goto listen_failed;
+			}
+
+			/* until the takeover completes */
+			srv->handed_off = true;
+			srv->owns_address = true;
+			continue;
+		}
+
+		if (server_listen(srv, &srvs[listening % nroutes], w, workers) != 0) {
+			perror("Listen for connections from the source failed");
+			goto listen_failed;
+		}
+	}
+
+	for (int i = 0; i < nroutes; ++i) {
+		struct route *r = &routes[i];
+		char label[CONFIG_MAX_NAME + 16] = "";
+		if (!r->opts.pool_size)
+			continue;
+
+		if (r->name)
+			snprintf(label, sizeof(label), " (route %s)", r->name);
+
+		printf("Connecting %i connections to B %s:%s in advance%s...\n",
+				r->opts.pool_size * workers, r->B.host, r->B.serv,
+				label);
+		for (int w = 0; w < workers; ++w) {
+			pool_init(&srvs[w * nroutes + i].pool, r->opts.pool_size,
+					&r->B, r->opts.skt_buf_sizes,
+					&r->opts.tuning[1], &r->opts.copts, start);
+		}
+	}
+
+	for (int w = 0; w < workers; ++w) {
+		struct worker *wk = &wks[w];
+		wk->index = w;
+		wk->srvs = &srvs[w * nroutes];
+		wk->nsrvs = nroutes;
+		wk->opts = opts;
+		wk->stop = &stop;
+		wk->drain = &drain;
+		wk->running = &running;
+		wk->handoff_fd = -1;
+		busypoll_init(&wk->bp, opts->busy_poll);
+		slab_buffers_init(&wk->buffers);
+	}
+
+	if (handoff != -1) {
+		/* the buffers of the sessions are of the worker's cache */
+		slab_buffers_attach(&wks[0].buffers);
+		int taken = server_take_over(&srvs[0], handoff, handoff_sessions,
+				handoff_next_id);
+		slab_buffers_detach();
+
+		EINTR_RETRY(close(handoff));
+		if (taken != 0)
+			goto workers_done;
+	}
+
+	/* once we took over, the next one takes over from us */
+	if (opts->handoff) {
+		if (handoff != -1)
+			handoff_unlink(opts->handoff);
+
+		wks[0].handoff_fd = handoff_listen(opts->handoff);
+		if (wks[0].handoff_fd == -1) {
+			perror("Listen for the handoff failed");
+			goto workers_done;
+		}
+	}
+
+	if (opts->drain_timeout)
+		enable_drain_on_sigterm();
+
+	if (workers == 1) {
+		/* no threads: the single worker runs in the main thread */
+		wks[0].main_thread_signals = true;
+		ret = worker_loop(&wks[0], set);
+		goto workers_done;
+	}
+
+	/*
+	 * The user's signals are handled here while the workers wait
+	 * with the wakeup mask: to stop them, set the stop flag and
+	 * wake them up with SIGUSR1. They wake us up in the same way
+	 * when they end.
+	 * */
+	if (initialize_wakeup_sigset(&wakeset) != 0) {
+		perror("Setup signal handling failed");
+		goto workers_done;
+	}
+
+	mainset = *set;
+	sigdelset(&mainset, SIGUSR1);
+
+	printf("Starting %i workers...\n", workers);
+	fflush(stdout);
+	atomic_store(&running, workers);
+	for (; started < workers; ++started) {
+		struct worker *wk = &wks[started];
+		wk->main_thread = pthread_self();
+		wk->set = &wakeset;
+
+		if ((s = pthread_create(&wk->thread, NULL, worker_thread, wk)) != 0) {
+			errno = s;
+			perror("Worker thread start failed");
+			atomic_fetch_sub(&running, workers - started);
+			break;
+		}
+	}
+
+	bool drain_notified = false;
+	while (!interrupted && started == workers && atomic_load(&running) > 0
+			&& !atomic_load(&stop)) {
+		sigsuspend(&mainset);
+
+		/* the workers drain on their own: wake them up to start */
+		if (draining && !drain_notified) {
+			atomic_store(&drain, true);
+			for (int i = 0; i < started; ++i)
+				pthread_kill(wks[i].thread, SIGUSR1);
+			drain_notified = true;
+		}
+	}
+
+	atomic_store(&stop, true);
+	for (int i = 0; i < started; ++i)
+		pthread_kill(wks[i].thread, SIGUSR1);
+
+	ret = (interrupted || draining)? 0 : -1;
+	for (int i = 0; i < started; ++i)
+		pthread_join(wks[i].thread, NULL);
+
+workers_done:
+	/* the workers that did not run in a thread are finished here */
+	for (int i = started; i < workers; ++i)
+		worker_finish(&wks[i]);
+
+	if (wks[0].handoff_fd != -1) {
+		EINTR_RETRY(close(wks[0].handoff_fd));
+
+		/* else it is the new tiburoncin's already */
+		if (!srvs[0].handed_off)
+			handoff_unlink(opts->handoff);
+	}
+
+	/* the sessions left by the drain were cut as if interrupted */
+	for (int i = 0; i < workers; ++i) {
+		if (wks[i].expired)
+			interrupted = draining;
+	}
+
+	struct pool pool_total;
+	struct slab session_total, pending_total;
+	struct slab_buffers buffers_total;
+	struct busypoll bp_total;
+	unsigned int accepted = 0;
+	bool pooled = false, adaptive = false;
+
+	memset(&pool_total, 0, sizeof(pool_total));
+	memset(&session_total, 0, sizeof(session_total));
+	memset(&pending_total, 0, sizeof(pending_total));
+	memset(&buffers_total, 0, sizeof(buffers_total));
+	busypoll_init(&bp_total, opts->busy_poll);
+	for (int w = 0; w < workers; ++w) {
+		struct worker *wk = &wks[w];
+		unsigned int wk_accepted = 0;
+		unsigned long long wk_bytes[2] = {0, 0};
+
+		for (int i = 0; i < wk->nsrvs; ++i) {
+			struct server *srv = &wk->srvs[i];
+			wk_accepted += srv->accepted;
+			wk_bytes[0] += srv->bytes[0];
+			wk_bytes[1] += srv->bytes[1];
+
+			pool_add_counters(&pool_total, &srv->pool);
+			slab_add_counters(&session_total, &srv->session_slab);
+			slab_add_counters(&pending_total, &srv->pending_slab);
+		}
+
+		if (workers > 1) {
+			char name[16];
+			snprintf(name, sizeof(name), "#%i", w + 1);
+			print_counters("Worker", name, wk_accepted, wk_bytes);
+		}
+
+		slab_buffers_add_counters(&buffers_total, &wk->buffers);
+		busypoll_add_counters(&bp_total, &wk->bp);
+		accepted += wk_accepted;
+	}
+
+	for (int i = 0; i < nroutes; ++i) {
+		struct route *r = &routes[i];
+		unsigned int r_accepted = 0;
+		unsigned long long r_bytes[2] = {0, 0};
+
+		for (int w = 0; w < workers; ++w) {
+			struct server *srv = &srvs[w * nroutes + i];
+			r_accepted += srv->accepted;
+			r_bytes[0] += srv->bytes[0];
+			r_bytes[1] += srv->bytes[1];
+		}
+
+		if (r->name)
+			print_counters("Route", r->name, r_accepted, r_bytes);
+
+		if (r->opts.nbackends > 1) {
+			struct balancer bl_total;
+			char label[CONFIG_MAX_NAME + 16] = "";
+
+			if (r->name)
+				snprintf(label, sizeof(label), " (route %s)", r->name);
+
+			balancer_init(&bl_total, r->opts.balance, r->opts.backends,
+					r->opts.nbackends);
+			for (int w = 0; w < workers; ++w)
+				balancer_add_counters(&bl_total,
+						&srvs[w * nroutes + i].balancer);
+
+			balancer_summary_print(&bl_total, label);
+		}
+
+		pooled = pooled || r->opts.pool_size;
+		adaptive = adaptive || r->opts.buf_max[0];
+	}
+
+	if (pooled)
+		pool_summary_print(&pool_total);
+
+	if (adaptive)
+		adapt_budget_print();
+
+	if (opts->busy_poll)
+		busypoll_summary_print(&bp_total);
+
+	resolver_summary_print();
+	printf("Sessions: %u accepted\n", accepted);
+
+	slab_summary_print("sessions", &session_total);
+	slab_summary_print("pendings", &pending_total);
+	slab_buffers_summary_print(&buffers_total);
+
+	free(wks);
+	free(srvs);
+	return ret;
+
+listen_failed:
+	for (int i = 0; i < listening; ++i) {
+		EINTR_RETRY(close(srvs[i].A.fd));
+		if (srvs[i].owns_address)
+			unlink_listening(&srvs[i].A);
+	}
+
+	if (handoff != -1)
+		EINTR_RETRY(close(handoff));
+
+	free(wks);
+	free(srvs);
+	return ret;
+}
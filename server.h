@@ -0,0 +1,41 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include "signal.h"
+
+/*
+ * Maximum number of workers (see opts->workers).
+ * */
+#define SERVER_MAX_WORKERS 64
+
+struct route;
+struct options;
+
+/*
+ * Run tiburoncin in multiple sessions mode: for each route, listen on
+ * host:serv of its endpoint A and, for each connection accepted, open
+ * a new connection to its B and relay the data between them (see
+ * struct session) as configured in the options of the route.
+ *
+ * If the pool_size of a route is not zero, the connections to B are
+ * taken from a pool of connections established in advance (see struct
+ * pool); if the pool is empty, a new connection is established as usual.
+ *
+ * All the routes are served by a single event loop. If opts->workers
+ * is greater than one, that many worker threads serve all the routes,
+ * each one listening on their A (with SO_REUSEPORT) and relaying the
+ * sessions that it accepts; their counters are merged on exit.
+ *
+ * The options that apply to all the routes (workers, CPUs) are
+ * taken from opts.
+ *
+ * Wait for the events setting the signal mask set atomically and
+ * return when the program is interrupted.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * A failure of a single session only closes that session.
+ * */
+int server_run(struct route *routes, int nroutes, struct options *opts,
+		sigset_t *set);
+
+#endif
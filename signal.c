@@ -2,17 +2,30 @@
 
 #include <signal.h>
 
-int interrupted = 0;
+volatile sig_atomic_t interrupted = 0;
+volatile sig_atomic_t draining = 0;
+
+static volatile sig_atomic_t drain_enabled = 0;
 
 /*
  * Save the signal number into the interrupted global variable
- * only if the program wasn't interrupted before.
+ * only if the program wasn't interrupted before; the first SIGTERM
+ * goes to draining instead if it is enabled.
  **/
 static void int_handler(int signum) {
-	if (!interrupted)
+	if (signum == SIGTERM && drain_enabled && !draining && !interrupted)
+		draining = signum;
+	else if (!interrupted)
 		interrupted = signum;
 }
 
+/*
+ * Do nothing: the signal is used only to interrupt a blocking call.
+ **/
+static void wakeup_handler(int signum) {
+	(void)signum;
+}
+
 static int initialize_block_all_sigset(sigset_t *set) {
 	if (sigfillset(set) != -1 \
 			&& sigdelset(set, SIGBUS) != -1  \
@@ -53,6 +66,10 @@ int setup_signal_handlers() {
 	if (sigaction(SIGTERM, &sa, 0) == -1)
 		return -1;
 
+	sa.sa_handler = wakeup_handler;
+	if (sigaction(SIGUSR1, &sa, 0) == -1)
+		return -1;
+
 	sa.sa_handler = SIG_IGN;
 	if (sigaction(SIGPIPE, &sa, 0) == -1)
 		return -1;
@@ -60,6 +77,10 @@ int setup_signal_handlers() {
 	return 0;
 }
 
+void enable_drain_on_sigterm() {
+	drain_enabled = 1;
+}
+
 int initialize_interrupt_sigset(sigset_t *set) {
 	if (initialize_block_all_sigset(set) != -1 \
 			    && sigdelset(set, SIGINT) != -1 \
@@ -72,3 +93,14 @@ int initialize_interrupt_sigset(sigset_t *set) {
 		return -1;
 	}
 }
+
+int initialize_wakeup_sigset(sigset_t *set) {
+	if (initialize_block_all_sigset(set) != -1 \
+			    && sigdelset(set, SIGUSR1) != -1 \
+			    && sigdelset(set, SIGPIPE) != -1) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
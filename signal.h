@@ -11,8 +11,25 @@
  * When the value is other than 0, it will have the value
  * of the signal received.
  *
+ * The handlers run in the main thread (the other threads block the
+ * user's signals) so only the main thread should read it: it tells
+ * the other threads to stop through their own atomic flags.
+ *
  * */
-extern int interrupted;
+extern volatile sig_atomic_t interrupted;
+
+/*
+ * Global variable (initialized to 0) that signals when the program
+ * was asked to terminate gracefully (see enable_drain_on_sigterm): the
+ * relay of the data in flight should be finished and the program
+ * closed.
+ *
+ * When the value is other than 0, it will have the value
+ * of the signal received (SIGTERM).
+ *
+ * As interrupted, only the main thread should read it.
+ * */
+extern volatile sig_atomic_t draining;
 
 /*
  * EINTR_RETRY wraps a given expression into a do { } while(c) loop
@@ -64,7 +81,10 @@ int block_all_signals();
  * Setup the signal handlers:
  *	- SIGINT (Interrupt / Ctrl-C): set interrupted variable to nonzero
  *	- SIGQUIT (Quit from keyboard): set interrupted variable to nonzero
- *	- SIGTERM (Termination): set interrupted variable to nonzero
+ *	- SIGTERM (Termination): set interrupted variable to nonzero or,
+ *	the first time after enable_drain_on_sigterm, set draining
+ *	- SIGUSR1: do nothing but interrupt the blocking call (see
+ *	initialize_wakeup_sigset)
  *	- SIGPIPE (Broken Pipe): ignore the signal
  *
  * Other signals are left to their default handlers. See signal(7).
@@ -74,6 +94,13 @@ int block_all_signals();
  * */
 int setup_signal_handlers();
 
+/*
+ * From now on, the first SIGTERM sets draining instead of interrupted.
+ * A second signal sets interrupted as usual: the drain is forced to
+ * finish.
+ * */
+void enable_drain_on_sigterm();
+
 /*
  * Initialize a signal set (mask) to unblock SIGINT, SIGQUIT,
  * SIGTERM and SIGPIPE.
@@ -87,4 +114,17 @@ int setup_signal_handlers();
  * */
 int initialize_interrupt_sigset(sigset_t *set);
 
+/*
+ * Initialize a signal set (mask) to unblock SIGUSR1 and SIGPIPE only.
+ *
+ * A thread that waits with this mask is woken up by another thread
+ * sending it SIGUSR1 (see pthread_kill(3)) while the signals
+ * of the user are handled by the main thread.
+ *
+ * On error, return -1 and errno is set appropriately; return 0 on success.
+ *
+ * Note: on error, the value of *set is undefined.
+ * */
+int initialize_wakeup_sigset(sigset_t *set);
+
 #endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "slab.h"
+#include "bufalloc.h"
+
+/* cling (C++) loads this file too: see circular_buffer.h */
+#ifdef __cplusplus
+#define SLAB_THREAD_LOCAL thread_local
+#else
+#define SLAB_THREAD_LOCAL _Thread_local
+#endif
+
+struct slab_chunk {
+	struct slab_chunk *next;
+	max_align_t objs[];
+};
+
+/* a free object holds the next one of the free list */
+struct slab_object {
+	struct slab_object *next;
+};
+
+/* the cache of the buffers of the calling thread, if any */
+static SLAB_THREAD_LOCAL struct slab_buffers *current = NULL;
+
+void slab_init(struct slab *sl, size_t obj_sz) {
+	size_t align = sizeof(max_align_t);
+
+	memset(sl, 0, sizeof(*sl));
+	if (obj_sz < sizeof(struct slab_object))
+		obj_sz = sizeof(struct slab_object);
+
+	/* round up so all the objects of a chunk are aligned */
+	sl->obj_sz = (obj_sz + align - 1) / align * align;
+}
+
+void slab_destroy(struct slab *sl) {
+	while (sl->chunks) {
+		struct slab_chunk *c = sl->chunks;
+		sl->chunks = c->next;
+		free(c);
+	}
+
+	sl->free = NULL;
+}
+
+/*
+ * Allocate a new chunk and put its objects in the free list.
+ * */
+static
+int slab_grow(struct slab *sl) {
+	size_t sz = sizeof(struct slab_chunk) + sl->obj_sz * SLAB_CHUNK_OBJS;
+	struct slab_chunk *c = (struct slab_chunk*)malloc(sz);
+	if (!c)
+		return -1;
+
+	c->next = sl->chunks;
+	sl->chunks = c;
+	sl->nchunks += 1;
+	sl->bytes += sz;
+
+	/* in reverse so the objects are taken in the order of the chunk */
+	for (int i = SLAB_CHUNK_OBJS - 1; i >= 0; --i) {
+		struct slab_object *obj = (struct slab_object*)
+			((char*)c->objs + i * sl->obj_sz);
+		obj->next = sl->free;
+		sl->free = obj;
+	}
+
+	return 0;
+}
+
+void* slab_alloc(struct slab *sl) {
+	if (!sl->free && slab_grow(sl) != 0)
+		return NULL;
+
+	struct slab_object *obj = sl->free;
+	sl->free = obj->next;
+
+	sl->allocs += 1;
+	sl->in_use += 1;
+	if (sl->in_use > sl->peak)
+		sl->peak = sl->in_use;
+
+	return obj;
+}
+
+void slab_free(struct slab *sl, void *obj) {
+	struct slab_object *o = (struct slab_object*)obj;
+	o->next = sl->free;
+	sl->free = o;
+	sl->in_use -= 1;
+}
+
+void slab_buffers_init(struct slab_buffers *sb) {
+	memset(sb, 0, sizeof(*sb));
+}
+
+void slab_buffers_destroy(struct slab_buffers *sb) {
+	for (int i = 0; i < sb->nclasses; ++i) {
+		struct slab_class *cl = &sb->classes[i];
+		while (cl->cached) {
+			cl->cached -= 1;
+			bufalloc_free(cl->buffers[cl->cached], cl->sz);
+			sb->bytes -= cl->sz;
+		}
+	}
+}
+
+void slab_buffers_attach(struct slab_buffers *sb) {
+	current = sb;
+}
+
+void slab_buffers_detach() {
+	current = NULL;
+}
+
+/*
+ * Return the class of the buffers of sz bytes, adding it if there
+ * is room, or NULL.
+ * */
+static
+struct slab_class* slab_class_of(struct slab_buffers *sb, size_t sz) {
+	for (int i = 0; i < sb->nclasses; ++i) {
+		if (sb->classes[i].sz == sz)
+			return &sb->classes[i];
+	}
+
+	if (sb->nclasses == SLAB_CLASSES)
+		return NULL;
+
+	struct slab_class *cl = &sb->classes[sb->nclasses++];
+	cl->sz = sz;
+	cl->cached = 0;
+	return cl;
+}
+
+void* slab_buffer_alloc(size_t sz) {
+	struct slab_buffers *sb = current;
+	if (!sb)
+		return bufalloc_alloc(sz);
+
+	sb->allocs += 1;
+
+	struct slab_class *cl = slab_class_of(sb, sz);
+	if (cl && cl->cached) {
+		sb->reused += 1;
+		cl->cached -= 1;
+		return cl->buffers[cl->cached];
+	}
+
+	void *buf = bufalloc_alloc(sz);
+	if (buf) {
+		sb->bytes += sz;
+		if (sb->bytes > sb->peak)
+			sb->peak = sb->bytes;
+	}
+
+	return buf;
+}
+
+void slab_buffer_free(void *buf, size_t sz) {
+	struct slab_buffers *sb = current;
+	if (!sb) {
+		bufalloc_free(buf, sz);
+		return;
+	}
+
+	struct slab_class *cl = slab_class_of(sb, sz);
+	if (cl && cl->cached < SLAB_CLASS_BUFFERS) {
+		bufalloc_release(buf, sz);
+		cl->buffers[cl->cached] = buf;
+		cl->cached += 1;
+		return;
+	}
+
+	bufalloc_free(buf, sz);
+	sb->bytes -= sz;
+}
+
+void slab_add_counters(struct slab *total, struct slab *sl) {
+	total->allocs += sl->allocs;
+	total->nchunks += sl->nchunks;
+	total->peak += sl->peak;
+	total->bytes += sl->bytes;
+}
+
+void slab_buffers_add_counters(struct slab_buffers *total,
+		struct slab_buffers *sb) {
+	total->allocs += sb->allocs;
+	total->reused += sb->reused;
+	total->peak += sb->peak;
+}
+
+void slab_summary_print(const char *what, struct slab *sl) {
+	printf("Slab of %s: %llu allocations, %u chunks, "
+			"%u in use at most, %zu bytes\n", what,
+			sl->allocs, sl->nchunks, sl->peak, sl->bytes);
+}
+
+void slab_buffers_summary_print(struct slab_buffers *sb) {
+	printf("Slab of buffers: %llu allocations, %llu reused, "
+			"%zu bytes at most\n", sb->allocs, sb->reused, sb->peak);
+}
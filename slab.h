@@ -0,0 +1,121 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/* struct slab: allocator of objects of a fixed size (the sessions
+ * for example) that recycles them.
+ *
+ * The objects are carved from chunks of SLAB_CHUNK_OBJS objects and
+ * the freed ones are kept in a free list for the next allocations;
+ * the chunks are freed only when the slab is destroyed.
+ *
+ * So once the slab has as many objects as the peak of objects in use
+ * there are no more calls to malloc(3) nor free(3).
+ *
+ * A slab is not thread safe: each worker has its own.
+ * */
+struct slab {
+	size_t obj_sz;
+	struct slab_chunk *chunks;
+	struct slab_object *free;
+
+	/* counters, see slab_summary_print; bytes is the memory
+	 * of the chunks */
+	unsigned long long allocs;
+	unsigned int nchunks;
+	unsigned int in_use;
+	unsigned int peak;
+	size_t bytes;
+};
+
+#define SLAB_CHUNK_OBJS 16
+
+void slab_init(struct slab *sl, size_t obj_sz);
+void slab_destroy(struct slab *sl);
+
+/*
+ * Return an object of the slab or NULL on error (errno is set
+ * appropriately).
+ * */
+void* slab_alloc(struct slab *sl);
+void slab_free(struct slab *sl, void *obj);
+
+/* struct slab_buffers: cache of the relay buffers by size class.
+ *
+ * Each class holds the buffers of a given size freed so far (up to
+ * SLAB_CLASS_BUFFERS); the next allocation of that size takes one of
+ * them instead of allocating a new one with bufalloc_alloc.
+ *
+ * The buffers of -b and the ones grown or shrunk with -g are of a few
+ * sizes only so SLAB_CLASSES classes are enough; the buffers of other
+ * sizes are not cached.
+ *
+ * The buffers cached are released (see bufalloc_release) so with the
+ * lazy modes they do not hold memory while they are not used.
+ *
+ * The cache is used by the thread that attached it (see
+ * slab_buffers_attach) when it allocates or frees a buffer with
+ * slab_buffer_alloc and slab_buffer_free.
+ * */
+#define SLAB_CLASS_BUFFERS 64
+#define SLAB_CLASSES 16
+
+struct slab_class {
+	size_t sz;
+	unsigned int cached;
+	void *buffers[SLAB_CLASS_BUFFERS];
+};
+
+struct slab_buffers {
+	struct slab_class classes[SLAB_CLASSES];
+	int nclasses;
+
+	/* counters, see slab_buffers_summary_print; bytes is the memory
+	 * of the buffers in use and cached */
+	unsigned long long allocs;
+	unsigned long long reused;
+	size_t bytes;
+	size_t peak;
+};
+
+void slab_buffers_init(struct slab_buffers *sb);
+
+/*
+ * Free the buffers cached; sb must not be attached.
+ * */
+void slab_buffers_destroy(struct slab_buffers *sb);
+
+/*
+ * Use the cache sb for the buffers allocated and freed by the calling
+ * thread from now on. Detach it before destroying it.
+ * */
+void slab_buffers_attach(struct slab_buffers *sb);
+void slab_buffers_detach();
+
+/*
+ * Allocate a buffer of sz bytes from the cache of the thread or from
+ * bufalloc_alloc if there is no cache or it has none.
+ *
+ * Return NULL on error (errno is set appropriately).
+ * */
+void* slab_buffer_alloc(size_t sz);
+
+/*
+ * Give the buffer of sz bytes back to the cache of the thread or to
+ * bufalloc_free if there is no cache or it is full.
+ * */
+void slab_buffer_free(void *buf, size_t sz);
+
+/*
+ * Add the counters of sl (sb) to total so the slabs of the workers
+ * can be reported together.
+ * */
+void slab_add_counters(struct slab *total, struct slab *sl);
+void slab_buffers_add_counters(struct slab_buffers *total,
+		struct slab_buffers *sb);
+
+void slab_summary_print(const char *what, struct slab *sl);
+void slab_buffers_summary_print(struct slab_buffers *sb);
+
+#endif
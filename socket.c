@@ -1,7 +1,12 @@
 #define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,15 +16,26 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "endpoint.h"
 #include "socket.h"
 #include "signal.h"
+#include "timer.h"
+#include "resolver.h"
 
 #define DEFAULT_BACKLOG 1
-#define CONNECT_TRIES 3
-#define CONNECT_WAIT_TRY_SECS 1
+
+/* the first socket passed by the supervisor, see sd_listen_fds(3) */
+#define SD_LISTEN_FDS_START 3
+
+#define DEFAULT_CONNECT_TRIES 3
+#define DEFAULT_BACKOFF_BASE_MSECS 1000
+#define DEFAULT_BACKOFF_MAX_MSECS 30000
+#define DEFAULT_ATTEMPT_TIMEOUT_MSECS 0
+#define DEFAULT_ATTEMPT_DELAY_MSECS 250 /* RFC 8305, section 5 */
 
 /*
  * Given a hostname and servicename in the endpoint p,
@@ -68,7 +84,6 @@ int set_nonblocking(int fd) {
 	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-static
 int set_socket_buffer_sizes(int fd, size_t skt_buf_sizes[2]) {
 	int optnames[2] = { SO_SNDBUF, SO_RCVBUF };
 	for (int i = 0; i < 2; ++i) {
@@ -89,16 +104,116 @@ int set_socket_buffer_sizes(int fd, size_t skt_buf_sizes[2]) {
 	return 0;
 }
 
+void tcp_tuning_init(struct tcp_tuning *tuning) {
+	tuning->nodelay = -1;
+	tuning->cork = -1;
+	tuning->quickack = -1;
+	tuning->notsent_lowat = -1;
+	tuning->rcvlowat = -1;
+}
+
+/*
+ * Apply the TCP tuning to the socket skipping the options
+ * that must be left untouched (-1).
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+static
+int set_tcp_tuning(int fd, struct tcp_tuning *tuning) {
+	int levels[5] = {
+		IPPROTO_TCP, IPPROTO_TCP, IPPROTO_TCP, IPPROTO_TCP, SOL_SOCKET
+	};
+	int optnames[5] = {
+		TCP_NODELAY, TCP_CORK, TCP_QUICKACK, TCP_NOTSENT_LOWAT, SO_RCVLOWAT
+	};
+	int values[5] = {
+		tuning->nodelay, tuning->cork, tuning->quickack,
+		tuning->notsent_lowat, tuning->rcvlowat
+	};
+
+	/* the TCP options do not apply to the Unix sockets */
+	int domain = AF_UNSPEC;
+	socklen_t len = sizeof(domain);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1)
+		return -1;
+
+	for (int i = 0; i < 5; ++i) {
+		if (values[i] == -1)
+			continue;
+
+		if (domain == AF_UNIX && levels[i] == IPPROTO_TCP)
+			continue;
+
+		int val = values[i];
+		if (setsockopt(fd, levels[i], optnames[i], &val, sizeof(val)) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
 /*
- * Create a socket in listening mode for accepting connections.
- * The socket will be listening on host:serv address set by A.
+ * Return 1 if nobody listens on the Unix socket at addr: a connection
+ * to it is refused. A socket that is alive (or that cannot be probed)
+ * is not stale.
+ * */
+static
+int unix_socket_stale(struct sockaddr_un *addr, socklen_t addrlen) {
+	int s;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		return 0;
+
+	/* nonblocking: a full backlog fails with EAGAIN, not refused */
+	EINTR_RETRY(connect(fd, (struct sockaddr*) addr, addrlen));
+	int stale = (s == -1 && errno == ECONNREFUSED);
+
+	EINTR_RETRY(close(fd));
+	return stale;
+}
+
+/*
+ * Create a Unix socket in listening mode (see set_listening).
  *
- * Return a valid file descriptor if it succeeds,
- * -1 if not.
- *  In case of error, errno is set appropriately.
- *  */
+ * A stale socket file left by a previous run is removed; the socket
+ * of a running process or any other kind of file is not touched and
+ * the bind fails.
+ * */
 static
-int set_listening(struct endpoint *A, size_t skt_buf_sizes[2]) {
+int set_listening_unix(struct endpoint *A, size_t skt_buf_sizes[2],
+		int backlog) {
+	int s;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct stat st;
+
+	if (resolver_unix_address(A->serv, &addr, &addrlen) != 0)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (A->serv[0] != '@' && stat(A->serv, &st) == 0 && S_ISSOCK(st.st_mode)
+			&& unix_socket_stale(&addr, addrlen))
+		unlink(A->serv);
+
+	if (set_socket_buffer_sizes(fd, skt_buf_sizes) == -1
+			|| set_nonblocking(fd) == -1
+			|| bind(fd, (struct sockaddr*) &addr, addrlen) == -1
+			|| listen(fd, backlog) == -1) {
+		int last_errno = errno;
+		EINTR_RETRY(close(fd));
+		errno = last_errno;
+		return -1;
+	}
+
+	A->fd = fd;
+	return 0;
+}
+
+int set_listening(struct endpoint *A, size_t skt_buf_sizes[2], int backlog,
+		bool reuseport) {
 	int ret = -1;
 	int val = 1;
 
@@ -107,6 +222,9 @@ int set_listening(struct endpoint *A, size_t skt_buf_sizes[2]) {
 	int last_errno = 0;
 	struct addrinfo *result, *rp;
 
+	if (resolver_is_unix(A->host))
+		return set_listening_unix(A, skt_buf_sizes, backlog);
+
 	s = resolv(A, &result);
 	if (s != 0)
 		goto resolv_failed;
@@ -120,10 +238,12 @@ int set_listening(struct endpoint *A, size_t skt_buf_sizes[2]) {
 		}
 
 		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) != -1
+				&& (!reuseport || setsockopt(fd, SOL_SOCKET,
+					SO_REUSEPORT, &val, sizeof(val)) != -1)
 				&& set_socket_buffer_sizes(fd, skt_buf_sizes) != -1
 				&& set_nonblocking(fd) != -1
 				&& bind(fd, rp->ai_addr, rp->ai_addrlen) != -1
-				&& listen(fd, DEFAULT_BACKLOG) != -1) {
+				&& listen(fd, backlog) != -1) {
 			break;	/* good */
 		}
 		else {
@@ -145,80 +265,9 @@ resolv_failed:
 	return ret;
 }
 
-/*
- * Connect to socket fd to the destination described in rp.
- * This virtually works like the connect syscall (see connect(2)) but allows
- * to set a signal mask before blocking atomically.
- *
- * Note: the file descriptor must have the O_NONBLOCK flag set
- * (non blocking mode, see fcntl(2))
- *
- * Return -1 on error, (errno is set appropriately) 0 on success.
- *
- * Note: this function may fail under different circumstances which may
- * produce the same error number (errno) due different causes:
- *  - the connect syscall could fail
- *  - the pselect syscall could fail
- *  - the getsockopt could fail (used to get the status of the connection)
- *  - the connection could fail
- **/
-static
-int pconnect(int fd, struct addrinfo *rp, sigset_t *set) {
-	int s;
-	EINTR_RETRY(connect(fd, rp->ai_addr, rp->ai_addrlen));
-
-	/*
-	 * The connection failed, and failed quickly. We should fail too.
-	 * */
-	if (s == -1 && errno != EINPROGRESS)
-		return -1;
-
-	/*
-	 * The connection was established quickly, we are done.
-	 * */
-	if (s != -1)
-		return 0;
-
-	/*
-	 * The connection didn't fail but it is still in progress,
-	 * so wait for it.
-	 * See connect(2)
-	 * */
-	fd_set wfds;
-	FD_ZERO(&wfds);
-	FD_SET(fd, &wfds);
-
-	EINTR_RETRY(pselect(fd + 1, NULL, &wfds, NULL, NULL, set));
-
-	/*
-	 * The wait failed, we should fail too.
-	 * */
-	if (s == -1)
-		return -1;
-
-	/*
-	 * See if the connection succeed or not.
-	 * See socket(7)
-	 * */
-	int val = -1;
-	size_t vlen = sizeof(val);
-	s = getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)&val, (void*)&vlen);
-
-	/*
-	 * We couldn't retrieved the socket error (if any), fail.
-	 * */
-	if (s == -1)
-		return -1;
-
-	if (val != 0) {
-		errno = val; /* TODO Is it possible that val == EAGAIN/EWOULDBLOCK/EINPROGRESS like in the accept? */
-		return -1;
-	}
-
-	/*
-	 * The connection was established, hurra!
-	 * */
-	return 0;
+void unlink_listening(struct endpoint *A) {
+	if (resolver_is_unix(A->host) && A->serv[0] != '@')
+		unlink(A->serv);
 }
 
 /*
@@ -240,11 +289,18 @@ int pconnect(int fd, struct addrinfo *rp, sigset_t *set) {
  * produce the same error number (errno) due different causes:
  *  - the pselect syscall could fail
  *  - the accept syscall could fail
+ *  - passive_fd is too high for pselect (EMFILE)
  * */
 static
 int paccept(int passive_fd, sigset_t *set) {
 	int s = -1;
 
+	/* pselect cannot wait for higher descriptors */
+	if (passive_fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+
 	fd_set rfds;
 	do {
 		FD_ZERO(&rfds);
@@ -278,12 +334,13 @@ int paccept(int passive_fd, sigset_t *set) {
  * On error, return -1 and errno is set appropriately.
  * */
 int wait_for_connection(struct endpoint *A, size_t skt_buf_sizes[2],
-		sigset_t *set) {
+		struct tcp_tuning *tuning, sigset_t *set, bool listening) {
 	int ret = -1;
 	int s = -1;
 	int last_errno = 0;
 
-	if (set_listening(A, skt_buf_sizes) == -1) {
+	if (!listening && set_listening(A, skt_buf_sizes, DEFAULT_BACKLOG,
+				false) == -1) {
 		last_errno = errno;
 		goto listening_failed;
 	}
@@ -297,6 +354,9 @@ int wait_for_connection(struct endpoint *A, size_t skt_buf_sizes[2],
 
 	int fd = s;
 	s = set_nonblocking(fd);
+	if (s != -1)
+		s = set_tcp_tuning(fd, tuning);
+
 	if (s == -1) {
 		last_errno = errno;
 
@@ -307,79 +367,532 @@ int wait_for_connection(struct endpoint *A, size_t skt_buf_sizes[2],
 
 	A->fd = fd;
 	A->eof = 0;
+	A->quickack = (tuning->quickack == 1);
 	ret = 0;
 
 accept_failed:
-	shutdown(passive_fd, SHUT_RDWR);
+	/* an inherited socket is still the parent's */
+	if (!listening)
+		shutdown(passive_fd, SHUT_RDWR);
 	EINTR_RETRY(close(passive_fd));	// TODO error is ignored
 
+	if (!listening)
+		unlink_listening(A);
+
 listening_failed:
 	errno = last_errno;
 	return ret;
 }
 
-int establish_connection(struct endpoint *B, size_t skt_buf_sizes[2],
-		sigset_t *set) {
-	int ret = -1;
+int inherit_listening(struct endpoint *A, int fd) {
+	static char host[NI_MAXHOST];
+	/* large enough for the path of a Unix socket too */
+	static char serv[sizeof(struct sockaddr_un)];
 
-	int fd;
-	int s;
-	int last_errno = 0;
-	struct addrinfo *result, *rp;
-	int remain = CONNECT_TRIES;
+	int val;
+	socklen_t len = sizeof(val);
 
-	do {
-		s = resolv(B, &result);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == -1)
+		return -1;
+
+	if (!val) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &len) == -1)
+		return -1;
+
+	if (val != SOCK_STREAM) {
+		errno = ESOCKTNOSUPPORT;
+		return -1;
+	}
+
+	if (set_nonblocking(fd) == -1)
+		return -1;
+
+	A->fd = fd;
+	if (A->host)
+		return 0;
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*) &addr, &addrlen) == -1)
+		return -1;
+
+	if (addr.ss_family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un*) &addr;
+		size_t n = addrlen - offsetof(struct sockaddr_un, sun_path);
+
+		/* an abstract socket is named by @ instead of a NUL */
+		if (n && un->sun_path[0] == '\0')
+			snprintf(serv, sizeof(serv), "@%.*s", (int)n - 1,
+					&un->sun_path[1]);
+		else
+			snprintf(serv, sizeof(serv), "%.*s", (int)n, un->sun_path);
+
+		snprintf(host, sizeof(host), "%s", RESOLVER_UNIX_HOST);
+	}
+	else {
+		int s = getnameinfo((struct sockaddr*) &addr, addrlen, host,
+				sizeof(host), serv, sizeof(serv),
+				NI_NUMERICHOST | NI_NUMERICSERV);
 		if (s != 0) {
-			last_errno = errno;
-			result = NULL;
+			errno = EINVAL;
+			return -1;
 		}
+	}
 
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	A->host = host;
+	A->serv = serv;
+	return 0;
+}
 
-			if (fd == -1) {
-				last_errno = errno;
-				continue;
-			}
+int inherited_listening_fd() {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int fd = -1;
+
+	/* the sockets are for us and not for our parent */
+	if (pid && fds && strtol(pid, NULL, 10) == getpid()
+			&& strtol(fds, NULL, 10) >= 1)
+		fd = SD_LISTEN_FDS_START;
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return fd;
+}
+
+int accept_connection(int passive_fd, struct endpoint *A,
+		struct tcp_tuning *tuning) {
+	int s;
+
+	EINTR_RETRY(accept(passive_fd, NULL, NULL));
+	if (s == -1)
+		return -1;
+
+	int fd = s;
+	if (set_nonblocking(fd) == -1 || set_tcp_tuning(fd, tuning) == -1) {
+		int last_errno = errno;
+
+		shutdown(fd, SHUT_RDWR);
+		EINTR_RETRY(close(fd));	// TODO error is ignored
+
+		errno = last_errno;
+		return -1;
+	}
+
+	A->fd = fd;
+	A->eof = 0;
+	A->quickack = (tuning->quickack == 1);
+	return 0;
+}
+
+void connect_options_init(struct connect_options *copts) {
+	copts->tries = DEFAULT_CONNECT_TRIES;
+	copts->backoff_base = DEFAULT_BACKOFF_BASE_MSECS;
+	copts->backoff_max = DEFAULT_BACKOFF_MAX_MSECS;
+	copts->attempt_timeout = DEFAULT_ATTEMPT_TIMEOUT_MSECS;
+	copts->attempt_delay = DEFAULT_ATTEMPT_DELAY_MSECS;
+}
+
+/*
+ * Order the resolved addresses interleaving the address families
+ * (IPv6, IPv4, IPv6, ...) starting with the family of the first
+ * address returned by the resolver. See RFC 8305, section 4.
+ * */
+static
+void connector_order_addresses(struct connector *c) {
+	struct addrinfo *rp;
+	int first_family = c->result? c->result->ai_family : AF_UNSPEC;
+
+	struct addrinfo *preferred[CONNECTOR_MAX_ATTEMPTS];
+	struct addrinfo *others[CONNECTOR_MAX_ATTEMPTS];
+	int npreferred = 0, nothers = 0;
+
+	for (rp = c->result; rp != NULL; rp = rp->ai_next) {
+		if (rp->ai_family == first_family) {
+			if (npreferred < CONNECTOR_MAX_ATTEMPTS)
+				preferred[npreferred++] = rp;
+		}
+		else {
+			if (nothers < CONNECTOR_MAX_ATTEMPTS)
+				others[nothers++] = rp;
+		}
+	}
+
+	c->naddrs = 0;
+	for (int i = 0, j = 0; c->naddrs < CONNECTOR_MAX_ATTEMPTS
+			&& (i < npreferred || j < nothers); ) {
+		if (i < npreferred)
+			c->addrs[c->naddrs++] = preferred[i++];
+
+		if (j < nothers && c->naddrs < CONNECTOR_MAX_ATTEMPTS)
+			c->addrs[c->naddrs++] = others[j++];
+	}
+
+	c->next_addr = 0;
+}
+
+/*
+ * Start the resolution of the endpoint for a new round of attempts.
+ * The resolution is asynchronous, see connector_resolved.
+ * */
+static
+void connector_new_round(struct connector *c) {
+	c->state = CONNECTOR_RESOLVING;
+	c->remain -= 1;
+	c->result = NULL;
+
+	c->query = resolver_submit(c->B->host, c->B->serv);
+	if (!c->query) {
+		/* fail the round: there are no addresses to try */
+		c->last_errno = errno;
+		c->state = CONNECTOR_CONNECTING;
+		c->naddrs = c->next_addr = 0;
+	}
+}
+
+/*
+ * If the resolution of the endpoint completed, get ready to
+ * try the addresses resolved and return true.
+ * */
+static
+bool connector_resolved(struct connector *c, long long now) {
+	int error;
+
+	if (!resolver_query_done(c->query, &error, &c->result))
+		return false;
+
+	if (error != 0) {
+		fprintf(stderr, "Address resolution failed for %s:%s: %s\n",
+				c->B->host, c->B->serv, gai_strerror(error));
+
+		/* quite arbitrary as it is not easy to map a gai error
+		 * into a errno */
+		c->last_errno = (error == EAI_SYSTEM)? errno : EADDRNOTAVAIL;
+		c->result = NULL;
+	}
+
+	c->state = CONNECTOR_CONNECTING;
+	connector_order_addresses(c);
+	c->next_attempt_at = now;
+	return true;
+}
 
-			if (set_socket_buffer_sizes(fd, skt_buf_sizes) != -1
-					&& set_nonblocking(fd) != -1
-					&& pconnect(fd, rp, set) != -1 ) {
-				break;	/* good */
+/*
+ * Release the addresses resolved (or cancel the resolution).
+ * */
+static
+void connector_release_result(struct connector *c) {
+	if (c->query != NULL)
+		resolver_release(c->query);
+
+	c->query = NULL;
+	c->result = NULL;
+}
+
+static
+void connector_close_attempt(struct connector *c, int i) {
+	int s;
+	EINTR_RETRY(close(c->fds[i]));
+
+	c->nactive -= 1;
+	c->fds[i] = c->fds[c->nactive];
+	c->started[i] = c->started[c->nactive];
+}
+
+static
+void connector_succeed(struct connector *c, int fd) {
+	c->fd = fd;
+	c->state = CONNECTOR_DONE;
+
+	/* cancel the rest */
+	connector_cancel(c);
+}
+
+/*
+ * Start an attempt to the next address (if any).
+ * Return 0 if an attempt is in progress or it succeeded right away,
+ * -1 if it failed.
+ * */
+static
+int connector_start_attempt(struct connector *c, long long now) {
+	int s;
+	struct addrinfo *rp = c->addrs[c->next_addr++];
+
+	int fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	if (fd == -1) {
+		c->last_errno = errno;
+		return -1;
+	}
+
+	/* the callers use select(2) so they cannot handle higher
+	 * descriptors: count it as a failed attempt */
+	if (fd >= FD_SETSIZE) {
+		c->last_errno = EMFILE;
+		EINTR_RETRY(close(fd));
+		return -1;
+	}
+
+	if (set_socket_buffer_sizes(fd, c->skt_buf_sizes) == -1
+			|| set_tcp_tuning(fd, c->tuning) == -1
+			|| set_nonblocking(fd) == -1) {
+		c->last_errno = errno;
+		EINTR_RETRY(close(fd));
+		return -1;
+	}
+
+	EINTR_RETRY(connect(fd, rp->ai_addr, rp->ai_addrlen));
+
+	/*
+	 * The connection was established quickly, we are done.
+	 * */
+	if (s != -1) {
+		connector_succeed(c, fd);
+		return 0;
+	}
+
+	/*
+	 * The connection failed, and failed quickly.
+	 * */
+	if (errno != EINPROGRESS) {
+		c->last_errno = errno;
+		EINTR_RETRY(close(fd));
+		return -1;
+	}
+
+	/*
+	 * The connection didn't fail but it is still in progress,
+	 * so wait for it. See connect(2)
+	 * */
+	c->fds[c->nactive] = fd;
+	c->started[c->nactive] = now;
+	c->nactive += 1;
+
+	c->next_attempt_at = now + c->copts->attempt_delay * 1000LL;
+	return 0;
+}
+
+void connector_start(struct connector *c, struct endpoint *B,
+		size_t skt_buf_sizes[2], struct tcp_tuning *tuning,
+		struct connect_options *copts, long long now) {
+	memset(c, 0, sizeof(*c));
+	c->B = B;
+	c->skt_buf_sizes = skt_buf_sizes;
+	c->tuning = tuning;
+	c->copts = copts;
+	c->remain = copts->tries > 0? copts->tries : 1;
+	c->backoff = copts->backoff_base * 1000LL;
+	c->fd = -1;
+
+	connector_new_round(c);
+	connector_process(c, NULL, NULL, now);
+}
+
+void connector_fill(struct connector *c, fd_set *rfds, fd_set *wfds,
+		int *nfds, long long *deadline) {
+	if (c->state == CONNECTOR_WAITING_RETRY) {
+		timer_update_deadline(deadline, c->retry_at);
+		return;
+	}
+
+	/* the connection completed (or failed) without waiting:
+	 * the caller must process it right away */
+	if (c->state == CONNECTOR_DONE || c->state == CONNECTOR_FAILED) {
+		timer_update_deadline(deadline, 0);
+		return;
+	}
+
+	if (c->state == CONNECTOR_RESOLVING) {
+		int fd = resolver_fd();
+		FD_SET(fd, rfds);
+		if (fd >= *nfds)
+			*nfds = fd + 1;
+		return;
+	}
+
+	if (c->state != CONNECTOR_CONNECTING)
+		return;
+
+	for (int i = 0; i < c->nactive; ++i) {
+		FD_SET(c->fds[i], wfds);
+		if (c->fds[i] >= *nfds)
+			*nfds = c->fds[i] + 1;
+
+		if (c->copts->attempt_timeout)
+			timer_update_deadline(deadline, c->started[i]
+					+ c->copts->attempt_timeout * 1000LL);
+	}
+
+	if (c->next_addr < c->naddrs)
+		timer_update_deadline(deadline, c->next_attempt_at);
+}
+
+enum connector_state connector_process(struct connector *c, fd_set *rfds,
+		fd_set *wfds, long long now) {
+	if (c->state == CONNECTOR_WAITING_RETRY) {
+		if (now < c->retry_at)
+			return c->state;
+
+		connector_new_round(c);
+	}
+
+	if (c->state == CONNECTOR_RESOLVING) {
+		if (rfds && FD_ISSET(resolver_fd(), rfds))
+			resolver_drain();
+
+		if (!connector_resolved(c, now))
+			return c->state;
+	}
+
+	if (c->state != CONNECTOR_CONNECTING)
+		return c->state;
+
+	for (int i = 0; i < c->nactive; ) {
+		int fd = c->fds[i];
+
+		if (wfds && FD_ISSET(fd, wfds)) {
+			/*
+			 * See if the connection succeed or not.
+			 * See socket(7)
+			 * */
+			int val = -1;
+			socklen_t vlen = sizeof(val);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &val, &vlen) == -1)
+				val = errno;
+
+			if (val == 0) {
+				/* remove it from the attempts so it is not
+				 * closed by the cancel */
+				c->nactive -= 1;
+				c->fds[i] = c->fds[c->nactive];
+				c->started[i] = c->started[c->nactive];
+
+				connector_succeed(c, fd);
+				return c->state;
 			}
-			else {
-				/* bad */
-				last_errno = errno;
-				EINTR_RETRY(close(fd));
+
+			if (val != EINPROGRESS && val != EAGAIN) {
+				c->last_errno = val;
+				connector_close_attempt(c, i);
+
+				/* a failure starts the next attempt right away */
+				c->next_attempt_at = now;
+				continue;
 			}
 		}
 
-		if (result != NULL)
-			freeaddrinfo(result);
+		if (c->copts->attempt_timeout &&
+				now - c->started[i] >= c->copts->attempt_timeout * 1000LL) {
+			c->last_errno = ETIMEDOUT;
+			connector_close_attempt(c, i);
+			c->next_attempt_at = now;
+			continue;
+		}
+
+		++i;
+	}
 
-		if (rp == NULL && --remain > 0) {
-			struct timespec t = {
-				.tv_sec  = CONNECT_WAIT_TRY_SECS,
-				.tv_nsec = 0
-			};
-			EINTR_RETRY(nanosleep(&t, &t)); /* ignore any error */
+	/*
+	 * Start the next attempt if it is its time or if there
+	 * are no attempts in progress. If it fails quickly, try the next.
+	 * */
+	while (c->next_addr < c->naddrs
+			&& (now >= c->next_attempt_at || c->nactive == 0)
+			&& c->nactive < CONNECTOR_MAX_ATTEMPTS) {
+		if (connector_start_attempt(c, now) == 0)
+			break;
+	}
+
+	if (c->state == CONNECTOR_DONE)
+		return c->state;
+
+	if (c->nactive == 0 && c->next_addr >= c->naddrs) {
+		/* all the addresses failed in this round */
+		connector_release_result(c);
+
+		if (c->remain > 0) {
+			c->state = CONNECTOR_WAITING_RETRY;
+			c->retry_at = now + c->backoff;
+
+			c->backoff *= 2;
+			if (c->backoff > c->copts->backoff_max * 1000LL)
+				c->backoff = c->copts->backoff_max * 1000LL;
 		}
+		else {
+			c->state = CONNECTOR_FAILED;
+		}
+	}
 
-	} while (rp == NULL && remain > 0);
+	return c->state;
+}
 
-	if (rp != NULL) {
-		B->fd = fd;
-		B->eof = 0;
-		ret = 0;
+void connector_cancel(struct connector *c) {
+	while (c->nactive > 0)
+		connector_close_attempt(c, c->nactive - 1);
+
+	connector_release_result(c);
+	c->naddrs = c->next_addr = 0;
+}
+
+int establish_connection(struct endpoint *B, size_t skt_buf_sizes[2],
+		struct tcp_tuning *tuning, struct connect_options *copts,
+		sigset_t *set) {
+	int s;
+	struct connector c;
+	struct timespec timeout;
+
+	connector_start(&c, B, skt_buf_sizes, tuning, copts, monotonic_us());
+
+	while (c.state == CONNECTOR_RESOLVING
+			|| c.state == CONNECTOR_CONNECTING
+			|| c.state == CONNECTOR_WAITING_RETRY) {
+		fd_set rfds, wfds;
+		int nfds = 0;
+		long long deadline = TIMER_NEVER;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		connector_fill(&c, &rfds, &wfds, &nfds, &deadline);
+
+		EINTR_RETRY(pselect(nfds, &rfds, &wfds, NULL,
+				timer_timeout(deadline, monotonic_us(), &timeout),
+				set));
+
+		/*
+		 * The wait failed, we should fail too.
+		 * */
+		if (s == -1) {
+			int last_errno = errno;
+			connector_cancel(&c);
+			errno = last_errno;
+			return -1;
+		}
+
+		connector_process(&c, &rfds, &wfds, monotonic_us());
 	}
 
-	errno = last_errno;
-	return ret;
+	if (c.state == CONNECTOR_FAILED) {
+		errno = c.last_errno;
+		return -1;
+	}
 
+	B->fd = c.fd;
+	B->eof = 0;
+	B->quickack = (tuning->quickack == 1);
+	return 0;
 }
 
 
+void rearm_quickack(struct endpoint *p) {
+	int val = 1;
+	if (p->quickack)
+		setsockopt(p->fd, IPPROTO_TCP, TCP_QUICKACK, &val, sizeof(val));
+}
+
 void partial_shutdown(struct endpoint *p, int direction) {
 	shutdown(p->fd, direction);
 	p->eof |= (direction+1);
@@ -5,8 +5,39 @@
 #define FLOW_WR 2
 #define FLOW_RDWR (FLOW_RD|FLOW_WR)
 
+#include <sys/select.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "signal.h"
 
+#define CONNECTOR_MAX_ATTEMPTS 16
+
+/*
+ * TCP tuning for one leg of the channel (A or B).
+ *
+ * Each field is the value for the socket option of the same name,
+ * see tcp(7) and socket(7). A value of -1 means that the option is left
+ * untouched (the default of the operative system is used).
+ *
+ * The tuning of A is applied to the accepted socket and the tuning of B
+ * to the connected socket.
+ *
+ * Note: TCP_QUICKACK is not permanent and the kernel may disable it
+ * at any moment so it is re-enabled after each read (see rearm_quickack).
+ * */
+struct tcp_tuning {
+	int nodelay;
+	int cork;
+	int quickack;
+	int notsent_lowat;
+	int rcvlowat;
+};
+
+/*
+ * Initialize the tuning leaving all the options untouched.
+ * */
+void tcp_tuning_init(struct tcp_tuning *tuning);
 
 /* struct endpoint: a wrapper around nonblocking sockets.
  *
@@ -30,28 +61,215 @@ struct endpoint;
  * Wait for a connection on host:serv given in the endpoint A.
  * During the wait, set the signal mask set atomically before blocking.
  *
+ * If listening is true, A is listening already (see inherit_listening)
+ * and it is used instead.
+ *
+ * The TCP tuning is applied to the accepted socket.
+ *
  * Save the file descriptor of the peer socket if it succeeds into A
  * and return 0.
  * On error, return -1 and errno is set appropriately.
  * */
 int wait_for_connection(struct endpoint *A, size_t skt_buf_sizes[2],
-		sigset_t *set);
+		struct tcp_tuning *tuning, sigset_t *set, bool listening);
+
+/*
+ * Set the sizes of the send and receive buffers of the socket
+ * (SO_SNDBUF and SO_RCVBUF); a size of 0 leaves it untouched.
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int set_socket_buffer_sizes(int fd, size_t skt_buf_sizes[2]);
+
+/*
+ * Create a socket in listening mode for accepting connections
+ * with a queue of backlog pending connections (see listen(2)).
+ * The socket will be listening on host:serv address set by A
+ * and its file descriptor is saved into A.
+ *
+ * The socket is nonblocking: see accept_connection.
+ *
+ * If reuseport is true, SO_REUSEPORT is set so other sockets can
+ * listen on the same address and the kernel balances the connections
+ * among them (see socket(7)). It is ignored for Unix sockets.
+ *
+ * Return 0 if it succeeds, -1 if not.
+ * In case of error, errno is set appropriately.
+ * */
+int set_listening(struct endpoint *A, size_t skt_buf_sizes[2], int backlog,
+		bool reuseport);
+
+/*
+ * Remove the file of the Unix socket on which A listened (see
+ * set_listening) once it is closed; nothing for the other addresses.
+ * */
+void unlink_listening(struct endpoint *A);
+
+/*
+ * Use the socket fd, already bound and listening, inherited from the
+ * parent process as the listening socket of A instead of creating one
+ * (see set_listening): the connections that arrived before we started
+ * are waiting in its queue. The socket is set nonblocking.
+ *
+ * If A has no address, the address of the socket is used (it is kept
+ * in static storage so there can be only one).
+ *
+ * Return 0 if it succeeds, -1 if not (fd is not a listening stream
+ * socket, for example). In case of error, errno is set appropriately.
+ * */
+int inherit_listening(struct endpoint *A, int fd);
+
+/*
+ * Return the first socket passed by the supervisor (see LISTEN_FDS in
+ * sd_listen_fds(3)) or -1 if there is none. The variables of the
+ * environment are unset so they are not passed to our children.
+ * */
+int inherited_listening_fd();
+
+/*
+ * Accept a pending connection to the listening socket passive_fd
+ * without blocking (see set_listening).
+ *
+ * The TCP tuning is applied to the accepted socket which is
+ * nonblocking too.
+ *
+ * Save the file descriptor of the peer socket if it succeeds into A
+ * and return 0.
+ * On error, return -1 and errno is set appropriately: EAGAIN or
+ * EWOULDBLOCK means that there is no pending connection.
+ * */
+int accept_connection(int passive_fd, struct endpoint *A,
+		struct tcp_tuning *tuning);
+
+/*
+ * Options for connecting to an endpoint.
+ *
+ * All the resolved addresses are tried concurrently, "happy eyeballs"
+ * style (RFC 8305): the attempts are started attempt_delay milliseconds
+ * apart (or as soon as the previous attempt fails) interleaving the
+ * address families and the first attempt that succeeds wins.
+ * Each attempt is cancelled after attempt_timeout milliseconds
+ * (0 means that the kernel's timeout is used).
+ *
+ * If all the attempts fail, the resolution and the attempts are retried
+ * up to tries times in total, waiting between each round an exponential
+ * backoff that starts at backoff_base milliseconds and it is doubled
+ * each time up to backoff_max milliseconds.
+ * */
+struct connect_options {
+	int tries;
+	int backoff_base;
+	int backoff_max;
+	int attempt_timeout;
+	int attempt_delay;
+};
+
+void connect_options_init(struct connect_options *copts);
+
+/* struct connector: a nonblocking connection in progress to an endpoint.
+ *
+ * The connector is driven by the caller's event loop: connector_fill
+ * sets the file descriptors to wait for and the deadline of the next
+ * timeout; connector_process advances the state of the connector after
+ * the wait.
+ *
+ * The sockets of the attempts (and so the connected one) are always
+ * below FD_SETSIZE: a higher one fails the attempt with EMFILE.
+ *
+ * See establish_connection for a blocking version.
+ * */
+enum connector_state {
+	CONNECTOR_RESOLVING,
+	CONNECTOR_CONNECTING,
+	CONNECTOR_WAITING_RETRY,
+	CONNECTOR_DONE,
+	CONNECTOR_FAILED
+};
+
+struct addrinfo;
+struct resolver_query;
+
+struct connector {
+	struct endpoint *B;
+	size_t *skt_buf_sizes;
+	struct tcp_tuning *tuning;
+	struct connect_options *copts;
+
+	enum connector_state state;
+	int remain;
+	long long backoff;
+	long long retry_at;
+
+	struct resolver_query *query;
+	struct addrinfo *result;
+	struct addrinfo *addrs[CONNECTOR_MAX_ATTEMPTS];
+	int naddrs;
+	int next_addr;
+	long long next_attempt_at;
+
+	int fds[CONNECTOR_MAX_ATTEMPTS];
+	long long started[CONNECTOR_MAX_ATTEMPTS];
+	int nactive;
+
+	int fd;
+	int last_errno;
+};
+
+/*
+ * Start a connection to host:serv defined in the endpoint B at time now
+ * (in microseconds, see monotonic_us).
+ *
+ * The connector keeps references to the endpoint and the options
+ * given so they must outlive it.
+ * */
+void connector_start(struct connector *c, struct endpoint *B,
+		size_t skt_buf_sizes[2], struct tcp_tuning *tuning,
+		struct connect_options *copts, long long now);
+
+/*
+ * Set in wfds the file descriptors of the attempts in progress (or in
+ * rfds the resolver's one while B is resolved, see resolver_fd) and
+ * update *nfds (the highest file descriptor plus one) and *deadline
+ * (the time of the next timeout, see timer_update_deadline).
+ *
+ * If the connector is already done (or failed), the deadline expires
+ * right away so the caller processes it without waiting.
+ * */
+void connector_fill(struct connector *c, fd_set *rfds, fd_set *wfds,
+		int *nfds, long long *deadline);
+
+/*
+ * Advance the connector: take the addresses once resolved, complete
+ * or fail the attempts ready in wfds, cancel the ones timed out and
+ * start new ones if it is time to.
+ *
+ * Return the new state of the connector. Once CONNECTOR_DONE, the
+ * connected socket is in c->fd; once CONNECTOR_FAILED, c->last_errno
+ * has the error of the last attempt.
+ * */
+enum connector_state connector_process(struct connector *c, fd_set *rfds,
+		fd_set *wfds, long long now);
+
+/*
+ * Close any attempt in progress.
+ * */
+void connector_cancel(struct connector *c);
 
 /*
  * Establish a connection to host:serv defined in the endpoint B.
  * During the connection, set the signal mask set atomically before blocking.
  *
+ * The TCP tuning is applied to the socket before connecting.
+ *
  * Save the file descriptor of the peer socket if it succeeds into B
  * and return 0.
  * On error, return -1 and errno is set appropriately.
  *
- * Note: the function will try to connect to the endpoint several times
- * (CONNECT_TRIES == 3 by default), sleeping for CONNECT_WAIT_TRY_SECS == 1
- * seconds between each try, only then it will give up.
- *
- * The signal mask *will not be changed* during this wait.
+ * This is the blocking version of struct connector: all the addresses
+ * are tried concurrently and the whole process is retried with an
+ * exponential backoff as configured in copts (see connect_options).
  * */
 int establish_connection(struct endpoint *B, size_t skt_buf_sizes[2],
+		struct tcp_tuning *tuning, struct connect_options *copts,
 		sigset_t *set);
 
 
@@ -61,6 +279,12 @@ int establish_connection(struct endpoint *B, size_t skt_buf_sizes[2],
 void shutdown_and_close(struct endpoint *p);
 
 
+/*
+ * Re-enable the TCP_QUICKACK option if it was requested for the endpoint.
+ * Any error is ignored: this is only a hint for the kernel.
+ * */
+void rearm_quickack(struct endpoint *p);
+
 void partial_shutdown(struct endpoint *p, int direction);
 int is_read_eof(struct endpoint *p);
 int is_write_eof(struct endpoint *p);
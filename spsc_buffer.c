@@ -0,0 +1,66 @@
+#include "spsc_buffer.h"
+#include "bufalloc.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+int spsc_buffer_init(struct spsc_buffer_t *b, size_t sz) {
+	memset(b, 0, sizeof(*b));
+	b->sz = sz;
+	atomic_init(&b->head, 0);
+	atomic_init(&b->tail, 0);
+
+	b->buf = (char*)bufalloc_alloc(sz);
+	if (!b->buf)
+		return -1;
+
+	return 0;
+}
+
+void spsc_buffer_destroy(struct spsc_buffer_t *b) {
+	bufalloc_free(b->buf, b->sz);
+}
+
+size_t spsc_buffer_get_free(struct spsc_buffer_t *b, size_t *pos) {
+	size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+
+	size_t room = b->sz - (head - tail);
+	size_t until_end = b->sz - (head % b->sz);
+
+	*pos = head % b->sz;
+	return room < until_end? room : until_end;
+}
+
+size_t spsc_buffer_get_ready(struct spsc_buffer_t *b, size_t *pos) {
+	size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+
+	size_t ready = head - tail;
+	size_t until_end = b->sz - (tail % b->sz);
+
+	*pos = tail % b->sz;
+	return ready < until_end? ready : until_end;
+}
+
+size_t spsc_buffer_get_total_ready(struct spsc_buffer_t *b) {
+	/* the tail is read first: the head read after it is never behind */
+	size_t tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+
+	return head - tail;
+}
+
+void spsc_buffer_advance_head(struct spsc_buffer_t *b, size_t s) {
+	size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+	assert (s <= b->sz - (head - atomic_load(&b->tail)));
+
+	atomic_store_explicit(&b->head, head + s, memory_order_release);
+}
+
+void spsc_buffer_advance_tail(struct spsc_buffer_t *b, size_t s) {
+	size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+	assert (s <= atomic_load(&b->head) - tail);
+
+	atomic_store_explicit(&b->tail, tail + s, memory_order_release);
+}
@@ -0,0 +1,58 @@
+
+#ifndef SPSC_BUFFER_H_
+#define SPSC_BUFFER_H_
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/*
+ * struct spsc_buffer_t is a circular buffer like struct circular_buffer_t
+ * but shared by two threads without locks: a single producer that
+ * writes at the head and a single consumer that reads from the tail.
+ *
+ * Here the head and the tail are not positions but how many bytes
+ * were written and read so far: the difference is how many bytes are
+ * ready so a full buffer is not confused with an empty one and the
+ * hbehind flag is not needed. The position in the buffer is the
+ * counter modulo its size.
+ *
+ * Each side moves only its own counter and publishes it with a release
+ * store; the other side reads it with an acquire load. So the bytes
+ * written before moving the head are visible to the consumer and the
+ * bytes read before moving the tail are not overwritten by the producer.
+ *
+ * The counters are in different cache lines so the two threads do not
+ * invalidate each other's line on every move.
+ *
+ * Note: the functions of the producer (get_free, advance_head) and the
+ * ones of the consumer (get_ready, advance_tail) must be called from
+ * their own thread only.
+ * */
+struct spsc_buffer_t {
+	char *buf;
+	size_t sz;
+
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+};
+
+int spsc_buffer_init(struct spsc_buffer_t *b, size_t sz);
+void spsc_buffer_destroy(struct spsc_buffer_t *b);
+
+/*
+ * Return how many contiguous bytes are free (for the producer) or
+ * ready (for the consumer) and set *pos where they begin.
+ * */
+size_t spsc_buffer_get_free(struct spsc_buffer_t *b, size_t *pos);
+size_t spsc_buffer_get_ready(struct spsc_buffer_t *b, size_t *pos);
+
+/*
+ * Return how many bytes are ready in total; it can be called
+ * from any thread but the value may be stale by then.
+ * */
+size_t spsc_buffer_get_total_ready(struct spsc_buffer_t *b);
+
+void spsc_buffer_advance_head(struct spsc_buffer_t *b, size_t s);
+void spsc_buffer_advance_tail(struct spsc_buffer_t *b, size_t s);
+
+#endif
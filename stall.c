@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stall.h"
+#include "timer.h"
+
+void stall_init(struct stall *st, const char *from, const char *to,
+		const char *what, const char *color_escape, long long threshold) {
+	memset(st, 0, sizeof(*st));
+	st->from = from;
+	st->to = to;
+	st->what = what;
+	st->color_escape = color_escape;
+	st->threshold = threshold;
+	st->since = TIMER_NEVER;
+}
+
+static
+void stall_print(struct stall *st, double elapsed, const char *fmt,
+		long long duration) {
+	flockfile(stdout);
+	if (st->color_escape)
+		printf("%s", st->color_escape);
+
+	printf("[%10.3f] %s -> %s ", elapsed, st->from, st->to);
+	printf(fmt, st->what, duration / 1000.0, st->held);
+	printf("\n");
+
+	if (st->color_escape)
+		printf("%s", "\x1b[0m"); /* reset */
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+void stall_update(struct stall *st, bool stalled, size_t held, long long now,
+		double elapsed) {
+	if (stalled) {
+		if (st->since == TIMER_NEVER) {
+			st->since = now;
+			st->held = 0;
+		}
+
+		if (held > st->held)
+			st->held = held;
+
+		if (!st->raised && now - st->since >= st->threshold) {
+			st->raised = true;
+			stall_print(st, elapsed, "stalled (%s) for %.3f ms, "
+					"%zu bytes held", now - st->since);
+		}
+	}
+	else if (st->since != TIMER_NEVER) {
+		long long duration = now - st->since;
+
+		if (st->raised) {
+			stall_print(st, elapsed, "stall (%s) cleared after %.3f ms, "
+					"%zu bytes held", duration);
+
+			st->count += 1;
+			st->total += duration;
+			if (duration > st->longest)
+				st->longest = duration;
+		}
+
+		st->since = TIMER_NEVER;
+		st->raised = false;
+	}
+}
+
+long long stall_deadline(struct stall *st) {
+	if (st->since == TIMER_NEVER || st->raised)
+		return TIMER_NEVER;
+
+	return st->since + st->threshold;
+}
+
+void stall_summary_print(struct stall *st) {
+	printf("%s -> %s stalls (%s): %llu, total %.3f ms, longest %.3f ms\n",
+			st->from, st->to, st->what, st->count,
+			st->total / 1000.0, st->longest / 1000.0);
+}
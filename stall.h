@@ -0,0 +1,59 @@
+#ifndef STALL_H_
+#define STALL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* struct stall: detects when a direction (from -> to) is stalled.
+ *
+ * A direction is stalled if its condition holds (for example, "the
+ * buffer is full") for longer than a threshold.
+ *
+ * When that happens a timestamped event is printed; when the condition
+ * stops holding, another event is printed with the duration of the
+ * stall and the maximum of bytes held in the meantime.
+ *
+ * The count, total and longest durations of the stalls are kept for
+ * the summary (see stall_summary_print).
+ * */
+struct stall {
+	const char *from;
+	const char *to;
+	const char *what;
+	const char *color_escape;
+
+	long long threshold;
+	long long since;
+	bool raised;
+	size_t held;
+
+	unsigned long long count;
+	long long total;
+	long long longest;
+};
+
+/*
+ * Initialize the stall detector. The threshold is in microseconds and
+ * what is a description of the condition ("buffer full").
+ * */
+void stall_init(struct stall *st, const char *from, const char *to,
+		const char *what, const char *color_escape, long long threshold);
+
+/*
+ * Update the detector with the current condition (stalled or not) and
+ * how many bytes are held, at time now (in microseconds).
+ *
+ * Elapsed is the time elapsed (in seconds) used to prefix the events.
+ * */
+void stall_update(struct stall *st, bool stalled, size_t held, long long now,
+		double elapsed);
+
+/*
+ * Return when the stall will be raised if the condition keeps holding
+ * or TIMER_NEVER if there is nothing to wait for.
+ * */
+long long stall_deadline(struct stall *st);
+
+void stall_summary_print(struct stall *st);
+
+#endif
@@ -0,0 +1,59 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tcpinfo.h"
+
+/* bytes per second to megabits per second */
+#define MBPS(r) ((double)(r) * 8 / 1000000.0)
+
+int tcpinfo_print(const char *name, int fd, double elapsed,
+		const char *color_escape) {
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	/* older kernels may fill less fields, zero them */
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		/* not a TCP socket (Unix socket): nothing to sample */
+		if (errno == EOPNOTSUPP || errno == ENOPROTOOPT)
+			return 0;
+
+		return -1;
+	}
+
+	/* without pacing, the kernel reports the maximum rate (~0) */
+	char pacing[32] = "unlimited";
+	if (info.tcpi_pacing_rate != ~0ULL)
+		snprintf(pacing, sizeof(pacing), "%.2f Mbps",
+				MBPS(info.tcpi_pacing_rate));
+
+	flockfile(stdout);
+	if (color_escape)
+		printf("%s", color_escape);
+
+	printf("[%10.3f] %s tcp: rtt %.3f ms (var %.3f ms), cwnd %u, "
+			"retrans %u (total %u), pacing %s, "
+			"delivery %.2f Mbps, acked %llu bytes\n",
+			elapsed, name,
+			info.tcpi_rtt / 1000.0, info.tcpi_rttvar / 1000.0,
+			info.tcpi_snd_cwnd,
+			info.tcpi_retrans, info.tcpi_total_retrans,
+			pacing,
+			MBPS(info.tcpi_delivery_rate),
+			(unsigned long long)info.tcpi_bytes_acked);
+
+	if (color_escape)
+		printf("%s", "\x1b[0m"); /* reset */
+	fflush(stdout);
+	funlockfile(stdout);
+
+	return 0;
+}
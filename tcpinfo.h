@@ -0,0 +1,22 @@
+#ifndef TCPINFO_H_
+#define TCPINFO_H_
+
+/*
+ * Sample the TCP_INFO of the socket fd and print one line
+ * with the most relevant fields: the smoothed RTT and its variance,
+ * the congestion window, the retransmissions, the pacing and
+ * delivery rates and how many bytes were acknowledged.
+ *
+ * The line is prefixed with the time elapsed (in seconds) and the
+ * name of the leg (A or B) so the output can be read as a time series.
+ *
+ * If fd is not a TCP socket (a Unix socket), nothing is printed.
+ *
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ *
+ * See TCP_INFO in tcp(7).
+ * */
+int tcpinfo_print(const char *name, int fd, double elapsed,
+		const char *color_escape);
+
+#endif
@@ -13,213 +13,34 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-#include "hexdump.h"
 #include "endpoint.h"
 #include "socket.h"
 #include "cmdline.h"
-#include "circular_buffer.h"
+#include "relay.h"
+#include "server.h"
+#include "pipeline.h"
+#include "udp.h"
+#include "resolver.h"
+#include "affinity.h"
+#include "bufalloc.h"
+#include "adapt.h"
+#include "config.h"
+#include "timer.h"
+#include "busypoll.h"
+#include "uring.h"
 
 #include "signal.h"
 
-#define MAX(a, b) (((a) > (b)) ? (a) : (b))
-
-int passthrough(struct endpoint *ep_producer, struct endpoint *ep_consumer,
-		fd_set *rfds, fd_set *wfds,
-		struct circular_buffer_t *b,
-		struct hexdump *hd) {
-	int producer = ep_producer->fd;
-	int consumer = ep_consumer->fd;
-	int s;
-
-	if (FD_ISSET(producer, rfds)) {	 // ready to produce
-		EINTR_RETRY(read(producer, &b->buf[b->head], circular_buffer_get_free(b)));
-
-		if (s < 0) {
-			/*
-			 * Despite that we use some sort of select/poll multiplexer
-			 * the read/write it could block.
-			 *
-			 * For example, if the fd is a socket and it receives data,
-			 * that would mark it "ready for reading" but if the packet
-			 * received is corrupted, it will be discarded and the read call will
-			 * block because there is not more data.
-			 *
-			 * To workaround this, the fd must have the O_NONBLOCK flag.
-			 * See select(2).
-			 * */
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				FD_CLR(producer, rfds);
-				goto read_would_block;
-			}
-
-			return -1;
-		}
-		else if (s == 0) {
-			/* ack to the other end that we received the shutdown */
-			partial_shutdown(ep_producer, SHUT_RD);
-			hexdump_shutdown_print(hd);
-		}
-		else {
-			/* print what we got */
-			hexdump_sent_print(hd, &b->buf[b->head], s);
-		}
-
-		/* update our head pointer */
-		circular_buffer_advance_head(b, s);
-	}
-
-read_would_block:
-
-	if (FD_ISSET(consumer, wfds)) {	 // ready to consume
-		EINTR_RETRY(write(consumer, &b->buf[b->tail], circular_buffer_get_ready(b)));
-
-		if (s < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				FD_CLR(consumer, wfds);
-				goto write_would_block;
-			}
-
-			return -1;
-		}
-		else if (s == 0) {
-			/* ack to the other end that we received the shutdown */
-			partial_shutdown(ep_consumer, SHUT_WR);
-			hexdump_shutdown_print(hd);
-		}
-		else {
-			/* print how many is still here and we couldn't send */
-			hexdump_remain_print(hd, s);
-		}
-
-		/* update our tail pointer */
-		circular_buffer_advance_tail(b, s);
-
-	}
-	else if (FD_ISSET(producer, rfds)) {
-		/* print how many is still here and we couldn't send */
-		hexdump_remain_print(hd, 0);
-	}
-
-write_would_block:
-	return 0;
-}
-
-/*
- * Set the file descriptors sets rfds and wfds for
- * reading/writing based on the available free space or
- * data ready in the buffer buf and based on if the producer
- * and or the consumer are not closed.
- *
- * Three values are possible:
- *  - 0 means that the pipe is still alive
- *  - 1 means that the producer is closed and no more data
- *	is ready to send (buffer is empty): shutdown the consumer
- *  - 2 means that the we have data ready to send but the consumer
- *	is closed so the pipe is broken: shutdown the producer
- *  */
-enum pipe_status {
-	PIPE_OPEN,
-	PIPE_CLOSED,
-	PIPE_BROKEN
-};
-enum pipe_status enable_read_write(struct endpoint *ep_producer,
-		struct endpoint *ep_consumer,
-		fd_set *rfds, fd_set *wfds,
-		struct circular_buffer_t *buf) {
-
-	int producer = ep_producer->fd;
-	int consumer = ep_consumer->fd;
-
-	/*
-	 * Are our both endpoints, the consumer and the producer
-	 * closed? If we have data in the pipe means that the pipe
-	 * is broken, otherwise means that we are done, close the
-	 * pipe
-	 * */
-	if (is_write_eof(ep_consumer) && is_read_eof(ep_producer)) {
-		if (circular_buffer_get_ready(buf))
-			return PIPE_BROKEN;
-		else
-			return PIPE_CLOSED;
-	}
-
-	/*
-	 * If our consumer closed his side of the pipe means that we cannot
-	 * write any data any more.
-	 * If we still have data in the pipe that means that the
-	 * pipe is broken, otherwise means that the pipe was closed
-	 * by the consumer and this may be ok.
-	 *
-	 * In any case, a close by the consumer will imply a close
-	 * for the producer as soon as possible.
-	 *
-	 * This may produce a broken pipe in the producer but we cannot
-	 * know it because the producer didn't send us that data so from
-	 * our point of view, everything is working normal.
-	 * */
-	if (is_write_eof(ep_consumer)) {
-		partial_shutdown(ep_producer, SHUT_RD);
-
-		if (circular_buffer_get_ready(buf))
-			return PIPE_BROKEN;
-		else
-			return PIPE_CLOSED;
-	}
-
-	/*
-	 * If the producer closed his side of the pipe means that we will
-	 * not have more data in the pipe.
-	 * If the pipe is already empty, close the consumer, closing the
-	 * pipe, acknowling to the consumer that we are closing.
-	 * If we still have data, keep the pipe alive as usual, we need to
-	 * wait until the data in the pipe is flushed away to the consumer
-	 * only then we need to close the pipe.
-	 * */
-	if (is_read_eof(ep_producer)) {
-		if (!circular_buffer_get_ready(buf)) {
-			partial_shutdown(ep_consumer, SHUT_WR);
-			return PIPE_CLOSED;
-		}
-		else {
-			/* keep the pipe and don't close the consumer
-			 * we want to keep flushing all the data that
-			 * we have in the pipe before closing it
-			 * */
-		}
-	}
-
-	/*
-	 * If we have room in the buffer and the producer is not closed,
-	 * enable it for reading, he may have more data for us.
-	 * */
-	if (circular_buffer_get_free(buf) && !is_read_eof(ep_producer))
-		FD_SET(producer, rfds);
-
-	/*
-	 * If we have fresh data in the buffer to be sent to the consumer
-	 * and the consumer is not closed, enable it for writing, he may
-	 * want this data.
-	 * */
-	if (circular_buffer_get_ready(buf) && !is_write_eof(ep_consumer))
-		FD_SET(consumer, wfds);
-
-	return PIPE_OPEN;
-}
-
 int main(int argc, char *argv[]) {
 	int ret = -1;
 	int s;
 	struct endpoint A, B;
-	size_t buf_sizes[2] = {0, 0};
-	size_t skt_buf_sizes[2] = {0, 0};
-	char *out_filenames[2] = {0, 0};
+	struct options opts;
 	const char *colors[2] = {"\x1b[91m", "\x1b[94m"};
-	int colorless = 0;
 	sigset_t intset;
 
-	if (parse_cmd_line(argc, argv, &A, &B, buf_sizes, skt_buf_sizes,
-				out_filenames, &colorless)) {
-		what(argv);
+	if (parse_cmd_line(argc, argv, &A, &B, &opts)) {
+		what();
 		usage(argv);
 		return ret;
 	}
@@ -240,127 +61,233 @@ int main(int argc, char *argv[]) {
 		goto setup_signal_failed;
 	}
 
+	/*
+	 * The resolver thread inherits the signal mask: it must be
+	 * started after blocking all the signals.
+	 * */
+	if (resolver_init(opts.resolver_ttl) != 0) {
+		perror("Resolver setup failed");
+		goto setup_signal_failed;
+	}
+
+	/*
+	 * Pin us after starting the resolver thread: it does not
+	 * relay any data so it can run anywhere.
+	 * */
+	if (opts.ncpus && affinity_pin(opts.cpus[0]) != 0) {
+		perror("CPU affinity setup failed");
+		goto establish_conn_failed;
+	}
+
+	bufalloc_set_mode(opts.buf_mode);
+	adapt_set_budget(opts.buf_budget);
+
 	/* disable the colors? */
-	if (colorless)
+	if (opts.colorless)
 		colors[0] = colors[1] = 0;
 
+	/* the listening socket of A is ready already */
+	if (opts.listen_fd != -1 && inherit_listening(&A, opts.listen_fd) != 0) {
+		perror("Inherit the listening socket of A failed");
+		goto establish_conn_failed;
+	}
+
+	/* A <--> us <--> B, datagrams */
+	if (opts.udp) {
+		ret = udp_run(&A, &B, &opts, colors, &intset);
+		goto establish_conn_failed;
+	}
+
+	/* many A <--> us <--> many B, for each route */
+	if (opts.config) {
+		struct route *routes;
+		int nroutes;
+
+		if (config_load(opts.config, argv[0], &routes, &nroutes) != 0)
+			goto establish_conn_failed;
+
+		/* -c in the command line applies to all the routes */
+		for (int i = 0; opts.colorless && i < nroutes; ++i)
+			routes[i].colors[0] = routes[i].colors[1] = 0;
+
+		/* and -k to their sockets too */
+		for (int i = 0; i < nroutes; ++i)
+			routes[i].opts.busy_poll = opts.busy_poll;
+
+		ret = server_run(routes, nroutes, &opts, &intset);
+		config_free(routes, nroutes);
+		goto establish_conn_failed;
+	}
+
+	/* many A <--> us <--> many B */
+	if (opts.multi) {
+		struct route route = {
+			.name = NULL, .A = A, .B = B, .opts = opts,
+			.colors = { colors[0], colors[1] }, .line = NULL
+		};
+
+		ret = server_run(&route, 1, &opts, &intset);
+		goto establish_conn_failed;
+	}
+
 	/* us <--> B */
 	printf("Connecting to B %s:%s...\n", B.host, B.serv);
-	if (establish_connection(&B, skt_buf_sizes, &intset) != 0) {
+	if (establish_connection(&B, opts.skt_buf_sizes, &opts.tuning[1],
+				&opts.copts, &intset) != 0) {
 		perror("Establish a connection to the destination failed");
 		goto establish_conn_failed;
 	}
 
 	/* A <--> us */
 	printf("Waiting for a connection from A %s:%s...\n", A.host, A.serv);
-	if (wait_for_connection(&A, skt_buf_sizes, &intset) != 0) {
+	if (wait_for_connection(&A, opts.skt_buf_sizes, &opts.tuning[0], &intset,
+				opts.listen_fd != -1) != 0) {
 		perror("Wait for connection from the source failed");
 		goto wait_conn_failed;
 	}
 
-	printf("Allocating buffers: %zu and %zu bytes...\n", buf_sizes[0],
-			buf_sizes[1]);
-	struct circular_buffer_t buf_AtoB;
-	if (circular_buffer_init(&buf_AtoB, buf_sizes[0]) != 0) {
-		perror("Buffer allocation for A->B failed");
-		goto buf_AtoB_failed;
-	}
-
-	struct circular_buffer_t buf_BtoA;
-	if (circular_buffer_init(&buf_BtoA, buf_sizes[1]) != 0) {
-		perror("Buffer allocation for B->A failed");
-		goto buf_BtoA_failed;
-	}
+	printf("Allocating buffers: %zu and %zu bytes...\n",
+			opts.buf_sizes[0], opts.buf_sizes[1]);
 
-	struct hexdump hd_AtoB;
-	if (hexdump_init(&hd_AtoB, "A", "B", colors[0], out_filenames[0]) != 0) {
-		perror("Hexdump A->B allocation failed");
-		goto hd_A_to_B_failed;
+	/* A <--> us <--> B, a thread each */
+	if (opts.pipeline) {
+		ret = pipeline_run(&A, &B, &opts, colors, &intset);
+		goto establish_conn_failed;
 	}
 
-	struct hexdump hd_BtoA;
-	if (hexdump_init(&hd_BtoA, "B", "A", colors[1], out_filenames[1]) != 0) {
-		perror("Hexdump B->A allocation failed");
-		goto hd_B_to_A_failed;
+	struct session ss;
+	ss.A = A;
+	ss.B = B;
+	ss.resumed = false;
+	if (session_init(&ss, 0, &opts, colors, monotonic_us()) != 0)
+		goto session_failed;
+
+	/* A <--> us <--> B, through an io_uring */
+	if (opts.backend == BACKEND_URING) {
+		unsigned long long syscalls = 0;
+		ret = uring_run(&ss, &intset, &syscalls);
+
+		session_summary_print(&ss, monotonic_us());
+		if (opts.analyze)
+			analyzer_syscalls_print(&ss.AtoB.an_state, "io_uring", syscalls);
+		session_destroy(&ss);
+		goto establish_conn_failed;
 	}
 
-	int nfds = MAX(A.fd, B.fd) + 1;
 	fd_set rfds, wfds;
+	int nfds;
+
+	long long now;
+	long long deadline;
 
-	enum pipe_status pstatus_AtoB = PIPE_OPEN;
-	enum pipe_status pstatus_BtoA = PIPE_OPEN;
+	struct ticker tcpinfo_ticker;
+	ticker_init(&tcpinfo_ticker, opts.tcpinfo_interval * 1000LL, ss.start);
+
+	struct ticker queues_ticker;
+	ticker_init(&queues_ticker, opts.queues_interval * 1000LL, ss.start);
+
+	struct busypoll bp;
+	busypoll_init(&bp, opts.busy_poll);
+
+	/* TIMER_NEVER while we are not draining (see session_drain) */
+	long long drain_deadline = TIMER_NEVER;
+	if (opts.drain_timeout)
+		enable_drain_on_sigterm();
 
 	while (1) {
 		FD_ZERO(&rfds);
 		FD_ZERO(&wfds);
+		nfds = 0;
 
-		if (pstatus_AtoB == PIPE_OPEN)
-			pstatus_AtoB = enable_read_write(&A, &B,
-					&rfds, &wfds,
-					&buf_AtoB);
-
-		if (pstatus_BtoA == PIPE_OPEN)
-			pstatus_BtoA = enable_read_write(&B, &A,
-					&rfds, &wfds,
-					&buf_BtoA);
+		if (draining && drain_deadline == TIMER_NEVER) {
+			printf("Draining the session for up to %i ms...\n",
+					opts.drain_timeout);
+			drain_deadline = monotonic_us() + opts.drain_timeout * 1000LL;
+			session_drain(&ss);
+		}
 
+		deadline = drain_deadline;
+		if (opts.tcpinfo_interval)
+			timer_update_deadline(&deadline, tcpinfo_ticker.next);
+		if (opts.queues_interval)
+			timer_update_deadline(&deadline, queues_ticker.next);
 
-		if (pstatus_AtoB != PIPE_OPEN && pstatus_BtoA != PIPE_OPEN)
+		if (!session_fill(&ss, &rfds, &wfds, &nfds, &deadline))
 			break; /* we finished: no data can be sent from
 				  A to B nor B to A. */
 
-
-		EINTR_RETRY(pselect(nfds, &rfds, &wfds, NULL, NULL, &intset));
+		/* on EINTR check again if we were asked to drain */
+		s = busypoll_wait(&bp, nfds, &rfds, &wfds, deadline, &intset);
 
 		if (s == -1) {
+			if (errno == EINTR && !interrupted)
+				continue;
+
 			perror("select call failed");
 			goto passthrough_failed;
 		}
 
-		if (passthrough(&A, &B, &rfds, &wfds, &buf_AtoB, &hd_AtoB) != 0) {
-			perror("Passthrough from A to B failed");
+		now = monotonic_us();
+		if (drain_deadline != TIMER_NEVER && now >= drain_deadline) {
+			printf("Drain deadline expired, the data left is dropped\n");
+			interrupted = draining;
 			goto passthrough_failed;
 		}
 
-		if (passthrough(&B, &A, &rfds, &wfds, &buf_BtoA, &hd_BtoA) != 0) {
-			perror("Passthrough from B to A failed");
-			goto passthrough_failed;
+		if (opts.tcpinfo_interval && ticker_expired(&tcpinfo_ticker, now)) {
+			if (session_print_tcpinfo(&ss, now) != 0)
+				goto passthrough_failed;
 		}
-	}
 
-	ret = 0;
+		if (opts.queues_interval && ticker_expired(&queues_ticker, now)) {
+			if (session_print_queues(&ss, now) != 0)
+				goto passthrough_failed;
+		}
 
-passthrough_failed:
-	hexdump_destroy(&hd_BtoA);
+		if (session_process(&ss, &rfds, &wfds, now) != 0)
+			goto passthrough_failed;
+	}
 
-hd_B_to_A_failed:
-	hexdump_destroy(&hd_AtoB);
+	if (draining)
+		printf("Session drained\n");
 
-hd_A_to_B_failed:
-	circular_buffer_destroy(&buf_BtoA);
+	ret = 0;
 
-buf_BtoA_failed:
-	circular_buffer_destroy(&buf_AtoB);
+passthrough_failed:
+	session_summary_print(&ss, monotonic_us());
+	if (opts.busy_poll)
+		busypoll_summary_print(&bp);
+	if (opts.analyze) {
+		/* the waits plus the reads and the writes */
+		struct analyzer *an = &ss.AtoB.an_state;
+		analyzer_syscalls_print(an, "select", bp.polls + bp.blocked
+				+ an->reads + an->sends
+				+ an->reverse->reads + an->reverse->sends);
+	}
+	session_destroy(&ss);
+	goto establish_conn_failed;
 
-buf_AtoB_failed:
+session_failed:
 	shutdown_and_close(&A);
 
 wait_conn_failed:
 	shutdown_and_close(&B);
 
 establish_conn_failed:
+	resolver_destroy();
+
 setup_signal_failed:
 
-	if (!colorless)
+	if (!opts.colorless)
 		printf("%s", "\x1b[0m"); /* reset */
 	if (interrupted)
 		printf("\nUser cancelled.\n");
 
-	if (out_filenames[0]) {
-		free(out_filenames[0]);
+	if (opts.out_filenames[0]) {
+		free(opts.out_filenames[0]);
 	}
-	if (out_filenames[1]) {
-		free(out_filenames[1]);
+	if (opts.out_filenames[1]) {
+		free(opts.out_filenames[1]);
 	}
 
 	return interrupted?  128 + interrupted : ret;
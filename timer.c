@@ -0,0 +1,46 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <time.h>
+
+#include "timer.h"
+
+long long monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts); /* it cannot fail with a valid clock */
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ticker_init(struct ticker *t, long long interval, long long now) {
+	t->interval = interval;
+	t->next = now + interval;
+}
+
+bool ticker_expired(struct ticker *t, long long now) {
+	if (now < t->next)
+		return false;
+
+	t->next += t->interval;
+	if (t->next <= now)
+		t->next = now + t->interval; /* we are too late, skip the missed ticks */
+
+	return true;
+}
+
+void timer_update_deadline(long long *deadline, long long when) {
+	if (when == TIMER_NEVER)
+		return;
+
+	if (*deadline == TIMER_NEVER || when < *deadline)
+		*deadline = when;
+}
+
+struct timespec* timer_timeout(long long deadline, long long now,
+		struct timespec *ts) {
+	if (deadline == TIMER_NEVER)
+		return NULL;
+
+	long long remain = deadline > now? deadline - now : 0;
+	ts->tv_sec = remain / 1000000LL;
+	ts->tv_nsec = (remain % 1000000LL) * 1000;
+	return ts;
+}
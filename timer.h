@@ -0,0 +1,52 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Deadline that never expires.
+ * */
+#define TIMER_NEVER (-1LL)
+
+/*
+ * Return the current time in microseconds from an arbitrary
+ * point in the past. The clock is monotonic (see CLOCK_MONOTONIC
+ * in clock_gettime(2)).
+ * */
+long long monotonic_us();
+
+/* struct ticker: a periodic timer.
+ *
+ * The ticker expires every 'interval' microseconds. It does not
+ * accumulate missed ticks: if the ticker is checked too late it
+ * expires once and the next tick is rescheduled from the current
+ * time.
+ * */
+struct ticker {
+	long long interval;
+	long long next;
+};
+
+void ticker_init(struct ticker *t, long long interval, long long now);
+
+/*
+ * Return true if the ticker expired and reschedule it.
+ * */
+bool ticker_expired(struct ticker *t, long long now);
+
+/*
+ * Update the deadline *deadline to 'when' if 'when' is sooner.
+ * Any of both may be TIMER_NEVER.
+ * */
+void timer_update_deadline(long long *deadline, long long when);
+
+/*
+ * Convert the deadline into a timeout relative to now suitable for
+ * pselect. Return NULL if the deadline is TIMER_NEVER (block forever),
+ * otherwise return ts.
+ * */
+struct timespec* timer_timeout(long long deadline, long long now,
+		struct timespec *ts);
+
+#endif
@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "udp.h"
+#include "endpoint.h"
+#include "socket.h"
+#include "cmdline.h"
+#include "hexdump.h"
+#include "relay.h"
+#include "resolver.h"
+#include "timer.h"
+
+#include "signal.h"
+
+/*
+ * A flow: the datagrams from one source address of A, relayed
+ * through its own socket connected to B.
+ * */
+struct udp_flow {
+	unsigned int id;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fd;
+
+	char names[2][16];
+	char *out_filenames[2];
+	struct hexdump hd[2];	/* A -> B and B -> A */
+
+	long long last_active;
+	struct udp_flow *next;
+};
+
+/*
+ * A batch of datagrams: the buffers and the headers to receive
+ * them and the headers to send them.
+ * */
+struct udp_batch {
+	char *bufs;
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_storage addrs[UDP_BATCH];
+	struct mmsghdr msgs[UDP_BATCH];
+
+	struct iovec out_iovs[UDP_BATCH];
+	struct mmsghdr out[UDP_BATCH];
+};
+
+struct udp_relay {
+	int fd;
+	struct sockaddr_storage B;
+	socklen_t Blen;
+	int Bfamily;
+
+	struct options *opts;
+	const char **colors;
+
+	struct udp_flow *buckets[UDP_FLOW_BUCKETS];
+	unsigned int next_id;
+
+	struct udp_batch batch;
+
+	unsigned long long datagrams[2];
+	unsigned long long bytes[2];
+	unsigned long long dropped;
+};
+
+/*
+ * Resolve host:serv of the endpoint p as an UDP service.
+ * See resolv in socket.c.
+ * */
+static
+int udp_resolv(struct endpoint *p, struct addrinfo **result) {
+	struct addrinfo hints;
+	int s;
+
+	if (resolver_is_unix(p->host)) {
+		fprintf(stderr, "Unix sockets are not supported in datagram mode\n");
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if ((s = getaddrinfo(p->host, p->serv, &hints, result)) != 0) {
+		fprintf(stderr, "Address resolution failed for %s:%s: %s\n",
+				p->host, p->serv, gai_strerror(s));
+
+		if (s != EAI_SYSTEM)
+			errno = EADDRNOTAVAIL;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Bind an UDP socket to host:serv of the endpoint A.
+ * Return the file descriptor or -1 on error (errno is set appropriately).
+ * */
+static
+int udp_bind(struct endpoint *A, size_t skt_buf_sizes[2]) {
+	int s;
+	int val = 1;
+	int fd = -1;
+	int last_errno = 0;
+	struct addrinfo *result, *rp;
+
+	if (udp_resolv(A, &result) != 0)
+		return -1;
+
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+				rp->ai_protocol);
+
+		if (fd == -1) {
+			last_errno = errno;
+			continue;
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) != -1
+				&& set_socket_buffer_sizes(fd, skt_buf_sizes) != -1
+				&& bind(fd, rp->ai_addr, rp->ai_addrlen) != -1) {
+			break;	/* good */
+		}
+
+		last_errno = errno;
+		EINTR_RETRY(close(fd));
+	}
+
+	freeaddrinfo(result);
+	errno = last_errno;
+
+	return rp != NULL? fd : -1;
+}
+
+static
+unsigned int udp_hash(struct sockaddr_storage *addr, socklen_t addrlen) {
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	unsigned char *p = (unsigned char*) addr;
+
+	for (socklen_t i = 0; i < addrlen; ++i) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h % UDP_FLOW_BUCKETS;
+}
+
+static
+struct udp_flow* udp_flow_open(struct udp_relay *r,
+		struct sockaddr_storage *addr, socklen_t addrlen, long long now) {
+	int s;
+	struct udp_flow *flow = calloc(1, sizeof(*flow));
+	if (!flow) {
+		perror("Flow allocation failed");
+		return NULL;
+	}
+
+	flow->fd = socket(r->Bfamily, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (flow->fd == -1) {
+		perror("Flow socket creation failed");
+		goto socket_failed;
+	}
+
+	/* we use select(2) so we cannot handle higher descriptors */
+	if (flow->fd >= FD_SETSIZE) {
+		fprintf(stderr, "Too many flows, datagram from A dropped\n");
+		goto connect_failed;
+	}
+
+	if (set_socket_buffer_sizes(flow->fd, r->opts->skt_buf_sizes) != 0
+			|| connect(flow->fd, (struct sockaddr*) &r->B, r->Blen) != 0) {
+		perror("Flow connection to B failed");
+		goto connect_failed;
+	}
+
+	flow->id = ++r->next_id;
+	memcpy(&flow->addr, addr, addrlen);
+	flow->addrlen = addrlen;
+	flow->last_active = now;
+
+	snprintf(flow->names[0], sizeof(flow->names[0]), "A#%u", flow->id);
+	snprintf(flow->names[1], sizeof(flow->names[1]), "B#%u", flow->id);
+	flow->out_filenames[0] = session_filename(r->opts->out_filenames[0], flow->id);
+	flow->out_filenames[1] = session_filename(r->opts->out_filenames[1], flow->id);
+
+	if (hexdump_init(&flow->hd[0], flow->names[0], flow->names[1],
+				r->colors[0], flow->out_filenames[0]) != 0) {
+		perror("Hexdump A->B allocation failed");
+		goto hd_A_to_B_failed;
+	}
+
+	if (hexdump_init(&flow->hd[1], flow->names[1], flow->names[0],
+				r->colors[1], flow->out_filenames[1]) != 0) {
+		perror("Hexdump B->A allocation failed");
+		goto hd_B_to_A_failed;
+	}
+
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	if (getnameinfo((struct sockaddr*) addr, addrlen, host, sizeof(host),
+				serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+		strcpy(host, "?");
+		strcpy(serv, "?");
+	}
+
+	printf("Flow #%u from %s:%s opened\n", flow->id, host, serv);
+
+	unsigned int bucket = udp_hash(addr, addrlen);
+	flow->next = r->buckets[bucket];
+	r->buckets[bucket] = flow;
+	return flow;
+
+hd_B_to_A_failed:
+	hexdump_destroy(&flow->hd[0]);
+
+hd_A_to_B_failed:
+	free(flow->out_filenames[0]);
+	free(flow->out_filenames[1]);
+
+connect_failed:
+	EINTR_RETRY(close(flow->fd));
+
+socket_failed:
+	free(flow);
+	return NULL;
+}
+
+static
+void udp_flow_close(struct udp_flow *flow) {
+	int s;
+	printf("Flow #%u closed\n", flow->id);
+
+	hexdump_destroy(&flow->hd[1]);
+	hexdump_destroy(&flow->hd[0]);
+	free(flow->out_filenames[0]);
+	free(flow->out_filenames[1]);
+
+	EINTR_RETRY(close(flow->fd));
+	free(flow);
+}
+
+/*
+ * Find the flow of the source address addr or open a new one.
+ * */
+static
+struct udp_flow* udp_flow_lookup(struct udp_relay *r,
+		struct sockaddr_storage *addr, socklen_t addrlen, long long now) {
+	struct udp_flow *flow = r->buckets[udp_hash(addr, addrlen)];
+
+	for (; flow; flow = flow->next) {
+		if (flow->addrlen == addrlen && memcmp(&flow->addr, addr, addrlen) == 0)
+			return flow;
+	}
+
+	return udp_flow_open(r, addr, addrlen, now);
+}
+
+/*
+ * Prepare the headers to receive a batch of datagrams into the buffers.
+ * */
+static
+void udp_batch_reset(struct udp_batch *batch) {
+	for (int i = 0; i < UDP_BATCH; ++i) {
+		batch->iovs[i].iov_base = &batch->bufs[i * UDP_MAX_DATAGRAM];
+		batch->iovs[i].iov_len = UDP_MAX_DATAGRAM;
+
+		memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+	}
+}
+
+/*
+ * Set the i-th outgoing header to send the i-th datagram received
+ * to the address name (NULL if the socket is connected).
+ * */
+static
+void udp_batch_out(struct udp_batch *batch, int i, struct sockaddr_storage *name,
+		socklen_t namelen) {
+	batch->out_iovs[i].iov_base = batch->iovs[i].iov_base;
+	batch->out_iovs[i].iov_len = batch->msgs[i].msg_len;
+
+	memset(&batch->out[i], 0, sizeof(batch->out[i]));
+	batch->out[i].msg_hdr.msg_iov = &batch->out_iovs[i];
+	batch->out[i].msg_hdr.msg_iovlen = 1;
+	batch->out[i].msg_hdr.msg_name = name;
+	batch->out[i].msg_hdr.msg_namelen = namelen;
+}
+
+/*
+ * Send the count outgoing headers from first; the datagrams that
+ * cannot be sent are dropped.
+ * */
+static
+void udp_send(struct udp_relay *r, int fd, int first, int count) {
+	int s;
+	struct mmsghdr *out = &r->batch.out[first];
+
+	while (count > 0) {
+		EINTR_RETRY(sendmmsg(fd, out, count, MSG_DONTWAIT));
+
+		if (s == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* the socket is full: drop them all */
+				r->dropped += count;
+				return;
+			}
+
+			/* the first datagram failed (like a previous ICMP
+			 * port unreachable): drop it and try the rest */
+			s = 1;
+			r->dropped += 1;
+		}
+
+		out += s;
+		count -= s;
+	}
+}
+
+/*
+ * Receive a batch of datagrams from fd. Return how many were received,
+ * 0 if none or -1 on error.
+ * */
+static
+int udp_receive(struct udp_relay *r, int fd) {
+	int s;
+
+	udp_batch_reset(&r->batch);
+	EINTR_RETRY(recvmmsg(fd, r->batch.msgs, UDP_BATCH, MSG_DONTWAIT, NULL));
+
+	if (s == -1) {
+		/* no datagrams or an error reported by ICMP (like a
+		 * port unreachable from B) which is not ours */
+		if (errno == EAGAIN || errno == EWOULDBLOCK
+				|| errno == ECONNREFUSED || errno == EHOSTUNREACH
+				|| errno == ENETUNREACH)
+			return 0;
+
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Relay a batch of datagrams from A to their flows to B.
+ * */
+static
+int udp_relay_from_A(struct udp_relay *r, long long now) {
+	struct udp_flow *flows[UDP_BATCH];
+	struct udp_batch *batch = &r->batch;
+
+	int n = udp_receive(r, r->fd);
+	if (n <= 0)
+		return n;
+
+	for (int i = 0; i < n; ++i) {
+		flows[i] = udp_flow_lookup(r, &batch->addrs[i],
+				batch->msgs[i].msg_hdr.msg_namelen, now);
+
+		if (!flows[i]) {
+			r->dropped += 1;
+			continue;
+		}
+
+		flows[i]->last_active = now;
+		hexdump_sent_print(&flows[i]->hd[0], batch->iovs[i].iov_base,
+				batch->msgs[i].msg_len);
+
+		r->datagrams[0] += 1;
+		r->bytes[0] += batch->msgs[i].msg_len;
+
+		udp_batch_out(batch, i, NULL, 0);
+	}
+
+	/* send the consecutive datagrams of the same flow together */
+	for (int i = 0; i < n; ) {
+		int j = i + 1;
+		while (j < n && flows[j] == flows[i])
+			++j;
+
+		if (flows[i])
+			udp_send(r, flows[i]->fd, i, j - i);
+
+		i = j;
+	}
+
+	return 0;
+}
+
+/*
+ * Relay a batch of datagrams from B back to the source of the flow.
+ * */
+static
+int udp_relay_from_B(struct udp_relay *r, struct udp_flow *flow,
+		long long now) {
+	struct udp_batch *batch = &r->batch;
+
+	int n = udp_receive(r, flow->fd);
+	if (n <= 0)
+		return n;
+
+	flow->last_active = now;
+	for (int i = 0; i < n; ++i) {
+		hexdump_sent_print(&flow->hd[1], batch->iovs[i].iov_base,
+				batch->msgs[i].msg_len);
+
+		r->datagrams[1] += 1;
+		r->bytes[1] += batch->msgs[i].msg_len;
+
+		udp_batch_out(batch, i, &flow->addr, flow->addrlen);
+	}
+
+	udp_send(r, r->fd, 0, n);
+	return 0;
+}
+
+int udp_run(struct endpoint *A, struct endpoint *B, struct options *opts,
+		const char *colors[2], sigset_t *set) {
+	int ret = -1;
+	int s;
+	struct udp_relay *r = calloc(1, sizeof(*r));
+	struct addrinfo *result;
+
+	if (!r || !(r->batch.bufs = malloc(UDP_BATCH * UDP_MAX_DATAGRAM))) {
+		perror("Datagram buffers allocation failed");
+		goto alloc_failed;
+	}
+
+	r->opts = opts;
+	r->colors = colors;
+
+	if (udp_resolv(B, &result) != 0) {
+		perror("Resolve the destination failed");
+		goto alloc_failed;
+	}
+
+	memcpy(&r->B, result->ai_addr, result->ai_addrlen);
+	r->Blen = result->ai_addrlen;
+	r->Bfamily = result->ai_family;
+	freeaddrinfo(result);
+
+	printf("Relaying datagrams from A %s:%s to B %s:%s...\n",
+			A->host, A->serv, B->host, B->serv);
+	r->fd = udp_bind(A, opts->skt_buf_sizes);
+	if (r->fd == -1) {
+		perror("Bind to the source address failed");
+		goto alloc_failed;
+	}
+
+	struct timespec timeout;
+	long long now = monotonic_us();
+
+	/* the flows idle are looked for once per second */
+	struct ticker expire_ticker;
+	ticker_init(&expire_ticker, 1000000LL, now);
+
+	while (!interrupted) {
+		fd_set rfds;
+		int nfds = r->fd + 1;
+
+		FD_ZERO(&rfds);
+		FD_SET(r->fd, &rfds);
+		for (int b = 0; b < UDP_FLOW_BUCKETS; ++b) {
+			for (struct udp_flow *flow = r->buckets[b]; flow; flow = flow->next) {
+				FD_SET(flow->fd, &rfds);
+				if (flow->fd >= nfds)
+					nfds = flow->fd + 1;
+			}
+		}
+
+		EINTR_RETRY(pselect(nfds, &rfds, NULL, NULL,
+				timer_timeout(expire_ticker.next, monotonic_us(), &timeout),
+				set));
+
+		if (s == -1) {
+			if (errno != EINTR)
+				perror("select call failed");
+			break;
+		}
+
+		now = monotonic_us();
+
+		/*
+		 * The flows are processed before the new ones are opened
+		 * from A: the events in rfds are not for them.
+		 * */
+		bool expire = ticker_expired(&expire_ticker, now);
+		for (int b = 0; b < UDP_FLOW_BUCKETS; ++b) {
+			for (struct udp_flow **fp = &r->buckets[b]; *fp; ) {
+				struct udp_flow *flow = *fp;
+
+				if (FD_ISSET(flow->fd, &rfds)
+						&& udp_relay_from_B(r, flow, now) != 0) {
+					perror("Receive from B failed");
+					goto relay_failed;
+				}
+
+				if (expire && now - flow->last_active
+						>= UDP_FLOW_TIMEOUT_MSECS * 1000LL) {
+					*fp = flow->next;
+					udp_flow_close(flow);
+					continue;
+				}
+
+				fp = &flow->next;
+			}
+		}
+
+		if (FD_ISSET(r->fd, &rfds) && udp_relay_from_A(r, now) != 0) {
+			perror("Receive from A failed");
+			goto relay_failed;
+		}
+	}
+
+	ret = interrupted? 0 : -1;
+
+relay_failed:
+	for (int b = 0; b < UDP_FLOW_BUCKETS; ++b) {
+		while (r->buckets[b]) {
+			struct udp_flow *flow = r->buckets[b];
+			r->buckets[b] = flow->next;
+			udp_flow_close(flow);
+		}
+	}
+
+	printf("Datagrams A -> B: %llu (%llu bytes)\n", r->datagrams[0], r->bytes[0]);
+	printf("Datagrams B -> A: %llu (%llu bytes)\n", r->datagrams[1], r->bytes[1]);
+	printf("Datagrams dropped: %llu, flows: %u\n", r->dropped, r->next_id);
+
+	EINTR_RETRY(close(r->fd));
+
+alloc_failed:
+	if (r)
+		free(r->batch.bufs);
+	free(r);
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef UDP_H_
+#define UDP_H_
+
+#include "signal.h"
+
+struct endpoint;
+struct options;
+
+#define UDP_BATCH 64
+#define UDP_MAX_DATAGRAM 65536
+#define UDP_FLOW_BUCKETS 1024
+#define UDP_FLOW_TIMEOUT_MSECS 30000
+
+/*
+ * Run tiburoncin in datagram mode: receive UDP datagrams on host:serv
+ * of the endpoint A and relay them to B keeping the boundaries of
+ * the messages.
+ *
+ * Each source address seen in A is a flow with its own socket
+ * connected to B so the replies of B are sent back to that source.
+ * The flows are named A#<n> and B#<n> (like the sessions, see
+ * struct session) and they are closed after UDP_FLOW_TIMEOUT_MSECS
+ * milliseconds without traffic.
+ *
+ * The datagrams are received and sent in batches of up to UDP_BATCH
+ * (see recvmmsg(2) and sendmmsg(2)) and each one is hexdumped.
+ * A datagram that cannot be sent without blocking is dropped, as
+ * the network would do.
+ *
+ * Wait for the events setting the signal mask set atomically and
+ * return when the program is interrupted.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int udp_run(struct endpoint *A, struct endpoint *B, struct options *opts,
+		const char *colors[2], sigset_t *set);
+
+#endif
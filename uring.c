@@ -0,0 +1,583 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "uring.h"
+#include "relay.h"
+#include "socket.h"
+#include "timer.h"
+
+#include "signal.h"
+
+#define URING_ENTRIES 64
+
+/*
+ * The kind of a request is in the lowest bit of its user_data and
+ * the index of its flow in the others.
+ * */
+#define URING_OP_RECV 0
+#define URING_OP_SEND 1
+
+/*
+ * The user_data of the cancellations (see cancel_all).
+ * */
+#define URING_CANCEL UINT64_MAX
+
+/* struct ring: the submission and completion queues shared with the
+ * kernel, see io_uring_setup(2).
+ *
+ * The requests are queued moving sq_local_tail and submitted all
+ * together by ring_enter.
+ * */
+struct ring {
+	int fd;
+
+	void *rings;
+	size_t rings_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	_Atomic unsigned *sq_head;
+	_Atomic unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* calls to io_uring_enter(2) */
+	unsigned long long enters;
+};
+
+/* struct uring_flow: a flow relayed by the io_uring.
+ *
+ * The producer is read with a multishot recv that takes the buffers
+ * of the ring br (registered with the id bgid) in order. The buffers
+ * received are pending, in the same order, until they are moved to
+ * the flow's buffer; the first one may be moved partially up to
+ * pending_off. Then they are given back to the kernel.
+ *
+ * The recv is posted while receiving and sends are the sends in
+ * flight (up to two, linked).
+ * */
+struct uring_flow {
+	struct flow *f;
+	unsigned short bgid;
+
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	size_t map_sz;
+	size_t buf_sz;
+	unsigned short br_tail;
+
+	unsigned short pending[URING_RING_BUFS];
+	unsigned int pending_lens[URING_RING_BUFS];
+	unsigned int pending_first;
+	unsigned int pending_count;
+	size_t pending_off;
+
+	bool receiving;
+	int sends;
+};
+
+static
+int ring_init(struct ring *r) {
+	int s;
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (r->fd == -1)
+		return -1;
+
+	/* both queues are mapped together (Linux 5.4 or newer) */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		goto failed;
+	}
+
+	size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->rings_sz = sq_sz > cq_sz? sq_sz : cq_sz;
+	r->rings = mmap(NULL, r->rings_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->rings == MAP_FAILED)
+		goto failed;
+
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto sqes_failed;
+
+	char *base = r->rings;
+	r->sq_head = (_Atomic unsigned*)(base + p.sq_off.head);
+	r->sq_tail = (_Atomic unsigned*)(base + p.sq_off.tail);
+	r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local_tail = atomic_load(r->sq_tail);
+
+	r->cq_head = (_Atomic unsigned*)(base + p.cq_off.head);
+	r->cq_tail = (_Atomic unsigned*)(base + p.cq_off.tail);
+	r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+	/* each slot of the queue is always its own sqe */
+	unsigned *array = (unsigned*)(base + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+
+	return 0;
+
+sqes_failed:
+	munmap(r->rings, r->rings_sz);
+
+failed:
+	{
+		int last_errno = errno;
+		EINTR_RETRY(close(r->fd));
+		errno = last_errno;
+	}
+	return -1;
+}
+
+/*
+ * Submit the requests queued and, if wait, wait for a completion
+ * setting the signal mask set atomically.
+ * */
+static
+int ring_enter(struct ring *r, bool wait, sigset_t *set) {
+	atomic_store_explicit(r->sq_tail, r->sq_local_tail, memory_order_release);
+	unsigned submit = r->sq_local_tail
+		- atomic_load_explicit(r->sq_head, memory_order_acquire);
+
+	r->enters += 1;
+	if (syscall(__NR_io_uring_enter, r->fd, submit, wait? 1 : 0,
+				wait? IORING_ENTER_GETEVENTS : 0,
+				wait? set : NULL, _NSIG / 8) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Return a cleared sqe queued for submission; if the queue is full,
+ * the requests queued are submitted first.
+ * */
+static
+struct io_uring_sqe* ring_get_sqe(struct ring *r) {
+	unsigned head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+	if (r->sq_local_tail - head == r->sq_entries) {
+		if (ring_enter(r, false, NULL) != 0)
+			return NULL;
+	}
+
+	struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+	r->sq_local_tail += 1;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static
+void ring_destroy(struct ring *r) {
+	int s;
+
+	EINTR_RETRY(close(r->fd));
+	munmap(r->sqes, r->sqes_sz);
+	munmap(r->rings, r->rings_sz);
+}
+
+/*
+ * Give the buffer bid of the ring of u back to the kernel.
+ * */
+static
+void give_back(struct uring_flow *u, unsigned short bid) {
+	/* the tail is in the first buffer: set the fields one by one */
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_RING_BUFS - 1)];
+	b->addr = (uintptr_t)(u->bufs + bid * u->buf_sz);
+	b->len = u->buf_sz;
+	b->bid = bid;
+
+	u->br_tail += 1;
+	atomic_store_explicit((_Atomic unsigned short*)&u->br->tail, u->br_tail,
+			memory_order_release);
+}
+
+static
+int uring_flow_init(struct uring_flow *u, struct ring *r, struct flow *f,
+		unsigned short bgid) {
+	memset(u, 0, sizeof(*u));
+	u->f = f;
+	u->bgid = bgid;
+	u->buf_sz = f->buf.sz;
+
+	/* the ring must be page aligned: put it in its own page and the
+	 * buffers after it */
+	size_t page = sysconf(_SC_PAGESIZE);
+	u->map_sz = page + URING_RING_BUFS * u->buf_sz;
+	void *map = mmap(NULL, u->map_sz, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	u->br = map;
+	u->bufs = (char*)map + page;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_RING_BUFS;
+	reg.bgid = bgid;
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) == -1) {
+		int last_errno = errno;
+		munmap(map, u->map_sz);
+		errno = last_errno;
+		return -1;
+	}
+
+	for (unsigned short bid = 0; bid < URING_RING_BUFS; ++bid)
+		give_back(u, bid);
+
+	return 0;
+}
+
+static
+void uring_flow_destroy(struct uring_flow *u) {
+	munmap(u->br, u->map_sz);
+}
+
+/*
+ * Move the data pending in the buffers of the ring to the flow's
+ * buffer as it has room and give them back.
+ * */
+static
+void move_pending(struct uring_flow *u) {
+	struct circular_buffer_t *b = &u->f->buf;
+
+	while (u->pending_count) {
+		size_t room = circular_buffer_get_free(b);
+		if (!room)
+			break;
+
+		unsigned short bid = u->pending[u->pending_first];
+		size_t left = u->pending_lens[u->pending_first] - u->pending_off;
+		size_t n = left < room? left : room;
+
+		memcpy(&b->buf[b->head], u->bufs + bid * u->buf_sz + u->pending_off, n);
+		circular_buffer_advance_head(b, n);
+		u->pending_off += n;
+
+		if (n == left) {
+			give_back(u, bid);
+			u->pending_first = (u->pending_first + 1) % URING_RING_BUFS;
+			u->pending_count -= 1;
+			u->pending_off = 0;
+		}
+	}
+}
+
+static
+int post_recv(struct ring *r, struct uring_flow *u, unsigned int index) {
+	struct io_uring_sqe *sqe = ring_get_sqe(r);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = u->f->producer->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = u->bgid;
+	sqe->user_data = (index << 1) | URING_OP_RECV;
+
+	u->receiving = true;
+	return 0;
+}
+
+static
+int post_send(struct ring *r, struct uring_flow *u, unsigned int index,
+		char *data, size_t len, bool link) {
+	struct io_uring_sqe *sqe = ring_get_sqe(r);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = u->f->consumer->fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = len;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->flags = link? IOSQE_IO_LINK : 0;
+	sqe->user_data = (index << 1) | URING_OP_SEND;
+
+	u->sends += 1;
+	return 0;
+}
+
+/*
+ * Post the recv and the sends that the flow needs, like
+ * enable_read_write does with the file descriptors sets.
+ *
+ * Return the status of the pipe, see enum pipe_status; set errno
+ * and return -1 on error.
+ * */
+static
+int flow_post(struct ring *r, struct uring_flow *u, unsigned int index) {
+	struct flow *f = u->f;
+	struct endpoint *producer = f->producer;
+	struct endpoint *consumer = f->consumer;
+	struct circular_buffer_t *b = &f->buf;
+
+	/* the data received and not moved yet is in the pipe too */
+	bool data = circular_buffer_get_total_ready(b) || u->pending_count;
+
+	if (is_write_eof(consumer) && is_read_eof(producer))
+		return data? PIPE_BROKEN : PIPE_CLOSED;
+
+	if (is_write_eof(consumer)) {
+		partial_shutdown(producer, SHUT_RD);
+		return data? PIPE_BROKEN : PIPE_CLOSED;
+	}
+
+	if (is_read_eof(producer) && !data) {
+		partial_shutdown(consumer, SHUT_WR);
+		return PIPE_CLOSED;
+	}
+
+	/* the kernel has buffers to receive into */
+	if (!is_read_eof(producer) && !u->receiving
+			&& u->pending_count < URING_RING_BUFS) {
+		if (post_recv(r, u, index) != 0)
+			return -1;
+	}
+
+	size_t total = circular_buffer_get_total_ready(b);
+	size_t ready = circular_buffer_get_ready(b);
+	if (total && !u->sends) {
+		if (post_send(r, u, index, &b->buf[b->tail], ready,
+					total > ready) != 0)
+			return -1;
+
+		/* the data wrapped around: the rest is at the begin */
+		if (total > ready && post_send(r, u, index, b->buf,
+					total - ready, false) != 0)
+			return -1;
+	}
+
+	return PIPE_OPEN;
+}
+
+/*
+ * Process the completion of a recv or a send of the flow.
+ * Set errno and return -1 on error.
+ * */
+static
+int flow_complete(struct uring_flow *u, struct io_uring_cqe *cqe, int op) {
+	struct flow *f = u->f;
+	int res = cqe->res;
+
+	if (op == URING_OP_RECV) {
+		/* the multishot recv ended: post it again if needed */
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			u->receiving = false;
+
+		if (res > 0) {
+			unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			unsigned int last = (u->pending_first + u->pending_count)
+				% URING_RING_BUFS;
+
+			/* print what we got */
+			hexdump_sent_print(&f->hd, u->bufs + bid * u->buf_sz, res);
+			rearm_quickack(f->producer);
+
+			if (f->an)
+				analyzer_record(f->an, res, monotonic_us());
+
+			u->pending[last] = bid;
+			u->pending_lens[last] = res;
+			u->pending_count += 1;
+		}
+		else if (res == 0) {
+			/* ack to the other end that we received the shutdown */
+			if (!is_read_eof(f->producer)) {
+				partial_shutdown(f->producer, SHUT_RD);
+				hexdump_shutdown_print(&f->hd);
+			}
+		}
+		else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+			/* without buffers, it is posted again when they are
+			 * given back */
+			errno = -res;
+			return -1;
+		}
+	}
+	else {
+		u->sends -= 1;
+
+		if (res > 0) {
+			/* print how many is still here and we couldn't send */
+			hexdump_remain_print(&f->hd, res);
+
+			if (f->an)
+				analyzer_record_sent(f->an, res, monotonic_us());
+
+			circular_buffer_advance_tail(&f->buf, res);
+		}
+		else if (res == 0) {
+			/* ack to the other end that we received the shutdown */
+			partial_shutdown(f->consumer, SHUT_WR);
+			hexdump_shutdown_print(&f->hd);
+		}
+		else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+			/* a send linked after a short one is canceled: the
+			 * rest is sent again with the next one */
+			errno = -res;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Cancel the recvs and sends still in flight and wait for them: the
+ * kernel must not touch the buffers once they are freed.
+ * */
+static
+void cancel_all(struct ring *r, struct uring_flow flows[2]) {
+	while (flows[0].receiving || flows[0].sends
+			|| flows[1].receiving || flows[1].sends) {
+		struct io_uring_sqe *sqe = ring_get_sqe(r);
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		sqe->user_data = URING_CANCEL;
+
+		if (ring_enter(r, true, NULL) != 0 && errno != EINTR)
+			return;
+
+		unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+			if (cqe->user_data == URING_CANCEL)
+				continue;
+
+			struct uring_flow *u = &flows[(cqe->user_data >> 1) & 1];
+			if ((cqe->user_data & 1) == URING_OP_SEND)
+				u->sends -= 1;
+			else if (!(cqe->flags & IORING_CQE_F_MORE))
+				u->receiving = false;
+		}
+		atomic_store_explicit(r->cq_head, head, memory_order_release);
+	}
+}
+
+int uring_run(struct session *ss, sigset_t *set,
+		unsigned long long *syscalls) {
+	int ret = -1;
+	struct ring r;
+	struct uring_flow flows[2];
+
+	if (ring_init(&r) != 0) {
+		perror("io_uring setup failed");
+		goto ring_failed;
+	}
+
+	if (uring_flow_init(&flows[0], &r, &ss->AtoB, 0) != 0) {
+		perror("io_uring buffers for A->B failed");
+		goto flow_AtoB_failed;
+	}
+
+	if (uring_flow_init(&flows[1], &r, &ss->BtoA, 1) != 0) {
+		perror("io_uring buffers for B->A failed");
+		goto flow_BtoA_failed;
+	}
+
+	while (!interrupted) {
+		bool open = false;
+
+		for (unsigned int i = 0; i < 2; ++i) {
+			struct flow *f = flows[i].f;
+
+			move_pending(&flows[i]);
+			if (f->status == PIPE_OPEN) {
+				int status = flow_post(&r, &flows[i], i);
+				if (status == -1) {
+					perror("io_uring submission failed");
+					goto failed;
+				}
+
+				f->status = status;
+			}
+
+			open = open || f->status == PIPE_OPEN;
+		}
+
+		if (!open)
+			break;	/* we finished: no data can be sent from
+				   A to B nor B to A. */
+
+		/* on EINTR check again if we were interrupted */
+		if (ring_enter(&r, true, set) != 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("io_uring wait failed");
+			goto failed;
+		}
+
+		unsigned head = atomic_load_explicit(r.cq_head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(r.cq_tail, memory_order_acquire);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &r.cqes[head & r.cq_mask];
+			struct uring_flow *u = &flows[(cqe->user_data >> 1) & 1];
+
+			if (flow_complete(u, cqe, cqe->user_data & 1) != 0) {
+				fprintf(stderr, "Passthrough from %s to %s failed: %s\n",
+						u->f->hd.from, u->f->hd.to, strerror(errno));
+				atomic_store_explicit(r.cq_head, head + 1,
+						memory_order_release);
+				goto failed;
+			}
+		}
+		atomic_store_explicit(r.cq_head, head, memory_order_release);
+	}
+
+	ret = 0;
+
+failed:
+	*syscalls = r.enters;
+	cancel_all(&r, flows);
+	uring_flow_destroy(&flows[1]);
+
+flow_BtoA_failed:
+	uring_flow_destroy(&flows[0]);
+
+flow_AtoB_failed:
+	ring_destroy(&r);
+
+ring_failed:
+	return ret;
+}
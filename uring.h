@@ -0,0 +1,53 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "signal.h"
+
+/*
+ * Buffers of each receive ring (a power of two).
+ * */
+#define URING_RING_BUFS 8
+
+/*
+ * How the event loop of the single session waits for and does the
+ * reads and writes (see -E):
+ *  - BACKEND_SELECT: waits for the readiness of the sockets with
+ *    pselect(2) and then reads and writes them, the default
+ *  - BACKEND_URING: posts the reads and writes to an io_uring and
+ *    waits for their completions (see uring_run)
+ * */
+enum event_backend {
+	BACKEND_SELECT,
+	BACKEND_URING
+};
+
+struct session;
+
+/*
+ * Relay the data of the session ss (already initialized, see
+ * session_init) with an io_uring instead of pselect(2).
+ *
+ * Each producer has a multishot recv posted that the kernel fills
+ * with the buffers of a ring registered for it (URING_RING_BUFS
+ * buffers of the size of the session's buffer): what is received is
+ * printed and then moved to the session's buffer as it has room and
+ * its ring's buffer is given back to the kernel. The data of the
+ * session's buffer is sent directly from it; if it wraps around,
+ * with two sends linked so they are done in order. The requests of
+ * all the events processed are submitted together with the wait for
+ * the next ones: one system call for each batch.
+ *
+ * The shutdowns are propagated as in the pselect(2) loop (see
+ * enum pipe_status).
+ *
+ * Wait setting the signal mask set atomically and return when both
+ * flows finish or the program is interrupted. The session is not
+ * destroyed. The calls to io_uring_enter(2) done are counted in
+ * *syscalls. Linux 6.0 or newer.
+ *
+ * On error, print the reason to stderr and return -1; 0 otherwise.
+ * */
+int uring_run(struct session *ss, sigset_t *set,
+		unsigned long long *syscalls);
+
+#endif
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <linux/errqueue.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "zerocopy.h"
+#include "circular_buffer.h"
+#include "signal.h"
+
+int zerocopy_enable(int fd) {
+	int val = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val));
+}
+
+void zerocopy_init(struct zerocopy *zc) {
+	memset(zc, 0, sizeof(*zc));
+}
+
+size_t zerocopy_get_unsent(struct zerocopy *zc, struct circular_buffer_t *b) {
+	return circular_buffer_get_total_ready(b) - zc->inflight;
+}
+
+bool zerocopy_pending(struct zerocopy *zc) {
+	return zc->count > 0;
+}
+
+/*
+ * Append a send of len bytes to the in flight queue.
+ * If done is true, the send does not require a notification (it
+ * was copied by the kernel right away) but it will be discarded
+ * in order anyways.
+ * */
+static
+void push_send(struct zerocopy *zc, size_t len, bool done) {
+	unsigned int i = (zc->first + zc->count) % ZEROCOPY_MAX_INFLIGHT;
+	zc->lens[i] = len;
+	zc->done[i] = done;
+	zc->count += 1;
+	zc->inflight += len;
+
+	/* only the zerocopy sends consume an id */
+	if (!done)
+		zc->ids[i] = zc->next_id++;
+}
+
+int zerocopy_send(struct zerocopy *zc, int fd, struct circular_buffer_t *b) {
+	int s;
+	size_t pos;
+
+	if (zc->count == ZEROCOPY_MAX_INFLIGHT)
+		return 0;
+
+	size_t ready = circular_buffer_get_ready_after(b, zc->inflight, &pos);
+	if (!ready)
+		return 0;
+
+	EINTR_RETRY(send(fd, &b->buf[pos], ready, MSG_ZEROCOPY));
+
+	if (s == -1 && errno == ENOBUFS) {
+		/*
+		 * The kernel could not pin more pages (see optmem_max
+		 * in socket(7)). If we are waiting for notifications, retry
+		 * later when some pages are released, otherwise nothing
+		 * will free them: fall back to a regular (copied) send.
+		 * */
+		if (zc->count > 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		EINTR_RETRY(send(fd, &b->buf[pos], ready, 0));
+		if (s > 0)
+			push_send(zc, s, true);
+
+		return s;
+	}
+
+	if (s > 0) {
+		push_send(zc, s, false);
+		zc->sends += 1;
+		zc->bytes += s;
+	}
+
+	return s;
+}
+
+/*
+ * Mark as done the sends with ids in the range [lo, hi] (inclusive),
+ * counting their bytes if the kernel copied them.
+ * The ids are 32 bits counters that may wrap around.
+ * */
+static
+void complete_range(struct zerocopy *zc, uint32_t lo, uint32_t hi,
+		bool copied) {
+	for (unsigned int k = 0; k < zc->count; ++k) {
+		unsigned int i = (zc->first + k) % ZEROCOPY_MAX_INFLIGHT;
+		if (!zc->done[i] && (uint32_t)(zc->ids[i] - lo) <= (uint32_t)(hi - lo)) {
+			zc->done[i] = true;
+			if (copied)
+				zc->copied += zc->lens[i];
+		}
+	}
+}
+
+/*
+ * Discard from the buffer the sends completed in order.
+ * Return how many bytes were discarded.
+ * */
+static
+size_t release_completed(struct zerocopy *zc, struct circular_buffer_t *b) {
+	size_t released = 0;
+	while (zc->count > 0 && zc->done[zc->first]) {
+		size_t len = zc->lens[zc->first];
+
+		/* each send was contiguous and started at the tail */
+		circular_buffer_advance_tail(b, len);
+		zc->inflight -= len;
+		released += len;
+
+		zc->first = (zc->first + 1) % ZEROCOPY_MAX_INFLIGHT;
+		zc->count -= 1;
+	}
+
+	return released;
+}
+
+int zerocopy_reap(struct zerocopy *zc, int fd, struct circular_buffer_t *b) {
+	int s;
+	char control[128];
+
+	while (zc->count > 0) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		EINTR_RETRY(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT));
+		if (s == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;	/* no more notifications for now */
+
+			return -1;
+		}
+
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr = (void*)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+
+			/* ee_info and ee_data are the lower and upper ids */
+			complete_range(zc, serr->ee_info, serr->ee_data,
+					serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+
+	return (int)release_completed(zc, b);
+}
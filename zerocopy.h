@@ -0,0 +1,85 @@
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ZEROCOPY_MAX_INFLIGHT 256
+
+struct circular_buffer_t;
+
+/* struct zerocopy: tracks the sends done with MSG_ZEROCOPY
+ * from a circular buffer to a socket.
+ *
+ * With a zerocopy send the kernel does not copy the data: it keeps
+ * a reference to the pages of the buffer until the data is sent
+ * (and acknowledged). So the data sent cannot be discarded from the
+ * buffer (moving its tail) until the kernel notifies that it is done
+ * with it.
+ *
+ * The kernel assigns to each successful send an incremental id and
+ * notifies the completed ranges of ids through the error queue of the
+ * socket. See msg_zerocopy in the kernel documentation.
+ *
+ * The bytes sent but not completed yet are the first 'inflight' bytes
+ * ready in the buffer: the next send must start after them
+ * (see circular_buffer_get_ready_after).
+ * */
+struct zerocopy {
+	size_t lens[ZEROCOPY_MAX_INFLIGHT];
+	uint32_t ids[ZEROCOPY_MAX_INFLIGHT];
+	bool done[ZEROCOPY_MAX_INFLIGHT];
+	unsigned int first;
+	unsigned int count;
+	uint32_t next_id;
+
+	size_t inflight;
+
+	/* the zerocopy sends and their bytes; the kernel may copy the
+	 * data anyways (SO_EE_CODE_ZEROCOPY_COPIED): these are the bytes
+	 * of such sends */
+	unsigned long long sends;
+	unsigned long long bytes;
+	unsigned long long copied;
+};
+
+/*
+ * Enable the zerocopy sends on the socket (SO_ZEROCOPY).
+ * On error, return -1 and errno is set appropriately; 0 otherwise.
+ * */
+int zerocopy_enable(int fd);
+
+void zerocopy_init(struct zerocopy *zc);
+
+/*
+ * Send the next chunk of ready data in the buffer b to the socket fd
+ * without discarding it.
+ *
+ * Return how many bytes were sent (0 if there is nothing to send or
+ * there are too many sends in flight). On error, return -1 and errno
+ * is set appropriately (EAGAIN/EWOULDBLOCK if the send would block).
+ * */
+int zerocopy_send(struct zerocopy *zc, int fd, struct circular_buffer_t *b);
+
+/*
+ * Read the completion notifications from the error queue of the
+ * socket fd and discard from the buffer b the data that the kernel
+ * does not use any more, moving its tail.
+ *
+ * Return how many bytes were discarded. On error, return -1 and errno
+ * is set appropriately.
+ * */
+int zerocopy_reap(struct zerocopy *zc, int fd, struct circular_buffer_t *b);
+
+/*
+ * How many bytes are ready in the buffer b and were not sent yet.
+ * */
+size_t zerocopy_get_unsent(struct zerocopy *zc, struct circular_buffer_t *b);
+
+/*
+ * Return true if there are sends waiting for a completion notification.
+ * */
+bool zerocopy_pending(struct zerocopy *zc);
+
+#endif